@@ -0,0 +1,491 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+// every instruction becomes a few lines of C working on a local copy of
+// the stack top. numbers, locals, globals and jumps are done inline,
+// calls, returns and property access go through the vm* helpers, and
+// whatever else (or a type check that fails) stores the frame and
+// returns to the interpreter, which runs that instruction itself. the
+// interpreter hands frames back at the function start, after calls and
+// at loop headers, so those offsets are the entries of the switch at
+// the top of each function.
+
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+// the script first, then every function in the order its constant
+// shows up. the same walk runs over the script compiled at startup.
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction*, list->functions,
+        oldCapacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+static void freeFunctionList(FunctionList* list) {
+  FREE_ARRAY(ObjFunction*, list->functions, list->capacity);
+}
+
+static uint32_t hashChunk(Chunk* chunk) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < chunk->count; i++) {
+    hash ^= chunk->code[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// offsets that get a label: jump targets and the entries.
+static void findLabels(Chunk* chunk, bool* labels, bool* entries) {
+  entries[0] = labels[0] = true;
+  for (int offset = 0; offset < chunk->count;) {
+    int next = offset + instructionSize(chunk, offset);
+    switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      labels[next + readShort(chunk, offset + 1)] = true;
+      break;
+    case OP_FOR_PREP:
+    case OP_LESS_LOCAL_CONST_JUMP:
+      labels[next + readShort(chunk, offset + 3)] = true;
+      break;
+    case OP_LOOP: {
+      int target = next - readShort(chunk, offset + 1);
+      entries[target] = labels[target] = true;
+      break;
+    }
+    case OP_FOR_LOOP: {
+      int target = next - readShort(chunk, offset + 3);
+      entries[target] = labels[target] = true;
+      break;
+    }
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+      if (next < chunk->count) entries[next] = labels[next] = true;
+      break;
+    }
+    offset = next;
+  }
+}
+
+static void emitNumber(FILE* out, double number) {
+  fprintf(out, "NUMBER_VAL(%a)", number);
+}
+
+static bool isLiteral(Value value) {
+  return IS_NUMBER(value) && isfinite(AS_NUMBER(value));
+}
+
+static void emitBinary(FILE* out, int offset, const char* valueType,
+    const char* op) {
+  fprintf(out, "  if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) "
+      "AOT_EXIT(%d);\n", offset);
+  fprintf(out, "  sp--; sp[-1] = %s(AS_NUMBER(sp[-1]) %s AS_NUMBER(sp[0]));\n",
+      valueType, op);
+}
+
+// the comparison and OP_NOT the instruction stands for, NaN gives true.
+static void emitNegated(FILE* out, int offset, const char* op) {
+  fprintf(out, "  if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) "
+      "AOT_EXIT(%d);\n", offset);
+  fprintf(out, "  sp--; sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) %s "
+      "AS_NUMBER(sp[0])));\n", op);
+}
+
+static void emitInstruction(FILE* out, Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  int next = offset + instructionSize(chunk, offset);
+
+  switch (code[0]) {
+  case OP_CONSTANT: {
+    Value constant = chunk->constants.values[code[1]];
+    if (isLiteral(constant)) {
+      fprintf(out, "  *sp++ = ");
+      emitNumber(out, AS_NUMBER(constant));
+      fprintf(out, ";\n");
+    } else {
+      fprintf(out, "  *sp++ = k[%d];\n", code[1]);
+    }
+    break;
+  }
+  case OP_CONSTANT_LONG:
+    fprintf(out, "  *sp++ = k[%d];\n",
+        (code[1] << 16) | (code[2] << 8) | code[3]);
+    break;
+  case OP_NIL:   fprintf(out, "  *sp++ = NIL_VAL;\n"); break;
+  case OP_TRUE:  fprintf(out, "  *sp++ = BOOL_VAL(true);\n"); break;
+  case OP_FALSE: fprintf(out, "  *sp++ = BOOL_VAL(false);\n"); break;
+  case OP_POP:   fprintf(out, "  sp--;\n"); break;
+  case OP_POPN:  fprintf(out, "  sp -= %d;\n", code[1]); break;
+  case OP_DUP:   fprintf(out, "  sp[0] = sp[-1]; sp++;\n"); break;
+  case OP_GET_LOCAL:
+    fprintf(out, "  *sp++ = slots[%d];\n", code[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "  slots[%d] = sp[-1];\n", code[1]);
+    break;
+  case OP_GET_LOCAL_LONG:
+    fprintf(out, "  *sp++ = slots[%d];\n", readShort(chunk, offset + 1));
+    break;
+  case OP_SET_LOCAL_LONG:
+    fprintf(out, "  slots[%d] = sp[-1];\n", readShort(chunk, offset + 1));
+    break;
+  case OP_SET_LOCAL_POP:
+    fprintf(out, "  slots[%d] = *--sp;\n", code[1]);
+    break;
+  case OP_GET_GLOBAL: {
+    int slot = readShort(chunk, offset + 1);
+    fprintf(out, "  if (IS_UNDEFINED(vm.globalValues.values[%d])) "
+        "AOT_EXIT(%d);\n", slot, offset);
+    fprintf(out, "  *sp++ = vm.globalValues.values[%d];\n", slot);
+    break;
+  }
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  vm.globalValues.values[%d] = *--sp;\n",
+        readShort(chunk, offset + 1));
+    break;
+  case OP_SET_GLOBAL: {
+    int slot = readShort(chunk, offset + 1);
+    fprintf(out, "  if (IS_UNDEFINED(vm.globalValues.values[%d])) "
+        "AOT_EXIT(%d);\n", slot, offset);
+    fprintf(out, "  vm.globalValues.values[%d] = sp[-1];\n", slot);
+    break;
+  }
+  case OP_GET_UPVALUE:
+    fprintf(out, "  *sp++ = *frame->closure->upvalues[%d]->location;\n",
+        code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out, "  *frame->closure->upvalues[%d]->location = sp[-1];\n",
+        code[1]);
+    break;
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG: {
+    bool get = code[0] == OP_GET_PROPERTY || code[0] == OP_GET_PROPERTY_LONG;
+    fprintf(out, "  AOT_SYNC(%d);\n", next);
+    fprintf(out, "  if (!%s(AS_STRING(k[%d]), &caches[%d])) "
+        "return CODE_ERROR;\n",
+        get ? "vmGetProperty" : "vmSetProperty", constantIndex(code),
+        readShort(chunk, offset + 1 + constantWidth(code[0])));
+    fprintf(out, "  AOT_RELOAD();\n");
+    break;
+  }
+  case OP_GET_INDEX:
+    fprintf(out, "  if (!IS_LIST(sp[-2]) || !IS_NUMBER(sp[-1])) "
+        "AOT_EXIT(%d);\n", offset);
+    fprintf(out, "  {\n"
+        "    ObjList* list = AS_LIST(sp[-2]);\n"
+        "    int index = (int)AS_NUMBER(sp[-1]);\n"
+        "    if (index < 0 || index >= list->array.count) AOT_EXIT(%d);\n"
+        "    sp--; sp[-1] = list->array.values[index];\n"
+        "  }\n", offset);
+    break;
+  case OP_SET_INDEX:
+    fprintf(out, "  if (!IS_LIST(sp[-3]) || !IS_NUMBER(sp[-2])) "
+        "AOT_EXIT(%d);\n", offset);
+    fprintf(out, "  {\n"
+        "    ObjList* list = AS_LIST(sp[-3]);\n"
+        "    int index = (int)AS_NUMBER(sp[-2]);\n"
+        "    if (index < 0 || index >= list->array.count) AOT_EXIT(%d);\n"
+        "    list->array.values[index] = sp[-1];\n"
+        "    writeBarrier((Obj*)list, sp[-1]);\n"
+        "    sp -= 2;\n"
+        "  }\n", offset);
+    break;
+  case OP_EQUAL:
+  case OP_EQUAL_NUM:
+    fprintf(out, "  sp--; sp[-1] = BOOL_VAL(valuesEqual(sp[-1], sp[0]));\n");
+    break;
+  case OP_NOT_EQUAL:
+    fprintf(out, "  sp--; sp[-1] = BOOL_VAL(!valuesEqual(sp[-1], sp[0]));\n");
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitBinary(out, offset, "BOOL_VAL", ">");
+    break;
+  case OP_LESS_EQUAL:
+    emitNegated(out, offset, ">");
+    break;
+  case OP_GREATER_EQUAL:
+    emitNegated(out, offset, "<");
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitBinary(out, offset, "BOOL_VAL", "<");
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+    emitBinary(out, offset, "NUMBER_VAL", "+");
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    emitBinary(out, offset, "NUMBER_VAL", "-");
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    emitBinary(out, offset, "NUMBER_VAL", "*");
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emitBinary(out, offset, "NUMBER_VAL", "/");
+    break;
+  case OP_INC:
+  case OP_DEC:
+    fprintf(out, "  if (!IS_NUMBER(sp[-1])) AOT_EXIT(%d);\n", offset);
+    fprintf(out, "  sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) %c 1);\n",
+        code[0] == OP_INC ? '+' : '-');
+    break;
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL:
+    fprintf(out, "  if (!IS_NUMBER(slots[%d])) AOT_EXIT(%d);\n",
+        code[1], offset);
+    fprintf(out, "  slots[%d] = NUMBER_VAL(AS_NUMBER(slots[%d]) %c 1);\n",
+        code[1], code[1], code[0] == OP_INC_LOCAL ? '+' : '-');
+    break;
+  case OP_ADD_LOCALS:
+    fprintf(out, "  if (!IS_NUMBER(slots[%d]) || !IS_NUMBER(slots[%d])) "
+        "AOT_EXIT(%d);\n", code[1], code[2], offset);
+    fprintf(out, "  *sp++ = NUMBER_VAL(AS_NUMBER(slots[%d]) + "
+        "AS_NUMBER(slots[%d]));\n", code[1], code[2]);
+    break;
+  case OP_LESS_LOCAL_CONST_JUMP: {
+    Value constant = chunk->constants.values[code[2]];
+    if (!isLiteral(constant)) {
+      fprintf(out, "  AOT_EXIT(%d);\n", offset);
+      break;
+    }
+    fprintf(out, "  if (!IS_NUMBER(slots[%d])) AOT_EXIT(%d);\n",
+        code[1], offset);
+    fprintf(out, "  if (!(AS_NUMBER(slots[%d]) < %a)) goto L%d;\n",
+        code[1], AS_NUMBER(constant), next + readShort(chunk, offset + 3));
+    break;
+  }
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    // leaves before the counter moves, the interpreter reports the error
+    fprintf(out, "  if (!IS_NUMBER(slots[%d]) || !IS_NUMBER(slots[%d])) "
+        "AOT_EXIT(%d);\n", code[1], code[2], offset);
+    if (code[0] == OP_FOR_PREP) {
+      fprintf(out, "  if (!(AS_NUMBER(slots[%d]) < AS_NUMBER(slots[%d]))) "
+          "goto L%d;\n", code[1], code[2],
+          next + readShort(chunk, offset + 3));
+    } else {
+      fprintf(out, "  slots[%d] = NUMBER_VAL(AS_NUMBER(slots[%d]) + 1);\n",
+          code[1], code[1]);
+      fprintf(out, "  if (AS_NUMBER(slots[%d]) < AS_NUMBER(slots[%d])) "
+          "goto L%d;\n", code[1], code[2],
+          next - readShort(chunk, offset + 3));
+    }
+    break;
+  case OP_NOT:
+    fprintf(out, "  sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));\n");
+    break;
+  case OP_NEGATE:
+    fprintf(out, "  if (!IS_NUMBER(sp[-1])) AOT_EXIT(%d);\n", offset);
+    fprintf(out, "  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n");
+    break;
+  case OP_PRINT:
+    fprintf(out, "  vmPrint(*--sp);\n");
+    break;
+  case OP_JUMP:
+    fprintf(out, "  goto L%d;\n", next + readShort(chunk, offset + 1));
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "  if (AOT_FALSEY(sp[-1])) goto L%d;\n",
+        next + readShort(chunk, offset + 1));
+    break;
+  case OP_POP_JUMP_IF_FALSE:
+    fprintf(out, "  sp--; if (AOT_FALSEY(sp[0])) goto L%d;\n",
+        next + readShort(chunk, offset + 1));
+    break;
+  case OP_LOOP:
+    fprintf(out, "  goto L%d;\n", next - readShort(chunk, offset + 1));
+    break;
+  case OP_CALL:
+    fprintf(out, "  AOT_SYNC(%d);\n", next);
+    fprintf(out, "  if (!vmCall(%d)) return CODE_ERROR;\n", code[1]);
+    fprintf(out, "  AOT_RELOAD();\n");
+    break;
+  case OP_INVOKE:
+  case OP_INVOKE_LONG: {
+    int width = constantWidth(code[0]);
+    fprintf(out, "  AOT_SYNC(%d);\n", next);
+    fprintf(out, "  if (!vmInvoke(AS_STRING(k[%d]), %d, &caches[%d])) "
+        "return CODE_ERROR;\n", constantIndex(code), code[1 + width],
+        readShort(chunk, offset + 2 + width));
+    fprintf(out, "  AOT_RELOAD();\n");
+    break;
+  }
+  case OP_RETURN:
+    fprintf(out, "  AOT_SYNC(%d);\n", next);
+    fprintf(out, "  vmReturn();\n");
+    fprintf(out, "  return CODE_RETURNED;\n");
+    break;
+  default:
+    // lists, maps, classes, closures and super: the interpreter's
+    fprintf(out, "  AOT_EXIT(%d);\n", offset);
+    break;
+  }
+}
+
+static void emitFunction(FILE* out, ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  bool* labels = calloc(chunk->count + 1, sizeof(bool));
+  bool* entries = calloc(chunk->count + 1, sizeof(bool));
+  if (labels == NULL || entries == NULL) {
+    fprintf(stderr, "not enough memory to emit c.\n");
+    exit(74);
+  }
+  findLabels(chunk, labels, entries);
+
+  fprintf(out, "\n// ");
+  if (function->name == NULL) {
+    fprintf(out, "<script>\n");
+  } else {
+    fprintf(out, "%s\n", function->name->chars);
+  }
+  fprintf(out, "static int fn%d(CallFrame* frame) {\n", index);
+  fprintf(out, "  uint8_t* code = frame->closure->function->chunk.code;\n");
+  fprintf(out, "  Value* k = frame->closure->function->chunk.constants.values;\n");
+  fprintf(out, "  InlineCache* caches = frame->closure->function->chunk.caches;\n");
+  fprintf(out, "  Value* slots = frame->slots;\n");
+  fprintf(out, "  Value* sp = vm.stackTop;\n");
+  fprintf(out, "  (void)k; (void)caches; (void)slots;\n");
+  fprintf(out, "  switch (frame->ip - code) {\n");
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (entries[offset]) {
+      fprintf(out, "  case %d: goto L%d;\n", offset, offset);
+    }
+  }
+  fprintf(out, "  default: return CODE_EXIT;\n");
+  fprintf(out, "  }\n");
+
+  for (int offset = 0; offset < chunk->count;) {
+    if (labels[offset]) fprintf(out, "L%d:\n", offset);
+    emitInstruction(out, chunk, offset);
+    offset += instructionSize(chunk, offset);
+  }
+  fprintf(out, "}\n");
+
+  free(labels);
+  free(entries);
+}
+
+static void emitSource(FILE* out, const char* source) {
+  fprintf(out, "static const char source[] =\n  \"");
+  for (const char* c = source; *c != '\0'; c++) {
+    switch (*c) {
+    case '\n':
+      fprintf(out, "\\n\"\n  \"");
+      break;
+    case '"':  fprintf(out, "\\\""); break;
+    case '\\': fprintf(out, "\\\\"); break;
+    default:
+      if ((unsigned char)*c < ' ' || (unsigned char)*c >= 0x7f) {
+        fprintf(out, "\\%03o", (unsigned char)*c);
+      } else {
+        fputc(*c, out);
+      }
+      break;
+    }
+  }
+  fprintf(out, "\";\n");
+}
+
+bool emitC(const char* source, const char* path, FILE* out) {
+  ObjFunction* script = compile(source);
+  if (script == NULL) return false;
+
+  push(OBJ_VAL(script)); // for collector
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+
+  fprintf(out, "// generated by clox --emit-c %s, do not edit.\n", path);
+  fprintf(out, "#include \"aot.h\"\n\n");
+  emitSource(out, source);
+
+  for (int i = 0; i < list.count; i++) {
+    emitFunction(out, list.functions[i], i);
+  }
+
+  fprintf(out, "\nstatic const AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    Chunk* chunk = &list.functions[i]->chunk;
+    fprintf(out, "  {fn%d, %d, %uu},\n", i, chunk->count, hashChunk(chunk));
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "int main() {\n");
+  fprintf(out, "  return aotMain(source, functions, %d);\n", list.count);
+  fprintf(out, "}\n");
+
+  freeFunctionList(&list);
+  pop();
+  return true;
+}
+
+int aotMain(const char* source, const AotFunction* functions, int count) {
+  initVM();
+
+  ObjFunction* script = compile(source);
+  if (script == NULL) {
+    freeVM();
+    return 65;
+  }
+
+  push(OBJ_VAL(script)); // for collector
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+
+  bool matches = list.count == count;
+  for (int i = 0; matches && i < count; i++) {
+    Chunk* chunk = &list.functions[i]->chunk;
+    matches = chunk->count == functions[i].size &&
+      hashChunk(chunk) == functions[i].hash;
+  }
+  if (matches) {
+    for (int i = 0; i < count; i++) {
+      list.functions[i]->compiled = functions[i].code;
+    }
+    vm.compiledCode = true;
+  } else {
+    fprintf(stderr, "clox: the compiler changed since the c was "
+        "emitted, interpreting.\n");
+  }
+  freeFunctionList(&list);
+  pop();
+
+  InterpretResult result = interpretFunction(script);
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+
+  freeVM();
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// clox --emit-c turns a script into a C program. every function becomes
+// a C function of its own that takes over its frame, the program links
+// against the runtime (everything but main.c) and compiles the embedded
+// source again at startup to get the objects the code works on.
+
+// one generated function, with the size and hash of the bytecode it was
+// translated from so a changed compiler is noticed at startup.
+typedef struct {
+  CompiledFn code;
+  int size;
+  uint32_t hash;
+} AotFunction;
+
+// write the C program for source to out, false on a compile error.
+bool emitC(const char* source, const char* path, FILE* out);
+// main() of a generated program.
+int aotMain(const char* source, const AotFunction* functions, int count);
+
+// used by the generated code. sp mirrors vm.stackTop, code and the
+// other locals are set up at the top of every function. a call can
+// move the frames and the stack, the frame is found again by index.
+#define AOT_SYNC(offset) do { \
+  frame->ip = code + (offset); \
+  vm.stackTop = sp; \
+} while (false)
+
+#define AOT_RELOAD() do { \
+  frame = &vm.frames[vm.frameCount - 1]; \
+  slots = frame->slots; \
+  sp = vm.stackTop; \
+} while (false)
+
+// let the interpreter run the instruction at offset.
+#define AOT_EXIT(offset) do { \
+  AOT_SYNC(offset); \
+  return CODE_EXIT; \
+} while (false)
+
+#define AOT_FALSEY(value) \
+  (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#endif
@@ -0,0 +1,601 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+#define BYTECODE_MAGIC "loxc"
+#define BYTE_ORDER_MARK 0x01020304u
+#define NO_NAME 0xffffffffu
+#define MAX_CONSTANTS (1 << 24)
+
+typedef enum {
+  CONST_NIL,
+  CONST_FALSE,
+  CONST_TRUE,
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+  CONST_UNDEFINED, // padding the compiler leaves in the byte range
+} ConstantTag;
+
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+// the script first, then every function in the order its constant
+// shows up, so a function always comes after the one that creates it.
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction*, list->functions,
+        oldCapacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+static int functionIndex(FunctionList* list, ObjFunction* function) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == function) return i;
+  }
+  return -1;
+}
+
+void writeU32(FILE* out, uint32_t value) {
+  fwrite(&value, sizeof(value), 1, out);
+}
+
+void writePadded(FILE* out, const void* bytes, size_t length) {
+  static const uint8_t zeros[4] = {0};
+  fwrite(bytes, 1, length, out);
+  fwrite(zeros, 1, (4 - length % 4) % 4, out);
+}
+
+void writeString(FILE* out, ObjString* string) {
+  writeU32(out, (uint32_t)string->length);
+  writePadded(out, string->chars, string->length);
+}
+
+void writeCode(FILE* out, Chunk* chunk) {
+  writeU32(out, (uint32_t)chunk->count);
+  writePadded(out, chunk->code, chunk->count);
+  writeU32(out, (uint32_t)chunk->lineCount);
+  fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, out);
+}
+
+static bool writeConstant(FILE* out, FunctionList* list, Value value) {
+  if (IS_NIL(value)) {
+    writeU32(out, CONST_NIL);
+  } else if (IS_BOOL(value)) {
+    writeU32(out, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    writeU32(out, CONST_NUMBER);
+    fwrite(&number, sizeof(number), 1, out);
+  } else if (IS_UNDEFINED(value)) {
+    writeU32(out, CONST_UNDEFINED);
+  } else if (IS_STRING(value)) {
+    writeU32(out, CONST_STRING);
+    writeString(out, AS_STRING(value));
+  } else if (IS_FUNCTION(value)) {
+    writeU32(out, CONST_FUNCTION);
+    writeU32(out, (uint32_t)functionIndex(list, AS_FUNCTION(value)));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool writeFunction(FILE* out, FunctionList* list,
+    ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeU32(out, (uint32_t)function->arity);
+  writeU32(out, (uint32_t)function->upvalueCount);
+  writeU32(out, (uint32_t)function->frameSize);
+  writeU32(out, (uint32_t)chunk->cacheCount);
+  if (function->name == NULL) {
+    writeU32(out, NO_NAME);
+  } else {
+    writeString(out, function->name);
+  }
+
+  writeU32(out, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!writeConstant(out, list, chunk->constants.values[i])) {
+      return false;
+    }
+  }
+
+  writeCode(out, chunk);
+  return true;
+}
+
+bool writeBytecode(ObjFunction* script, FILE* out) {
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+
+  fwrite(BYTECODE_MAGIC, 1, 4, out);
+  writeU32(out, BYTECODE_VERSION);
+  writeU32(out, BYTE_ORDER_MARK);
+  writeU32(out, OPCODE_COUNT);
+  writeU32(out, (uint32_t)vm.globalNames.count);
+  writeU32(out, (uint32_t)list.count);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    writeString(out, AS_STRING(vm.globalNames.values[i]));
+  }
+
+  bool written = true;
+  for (int i = 0; i < list.count && written; i++) {
+    written = writeFunction(out, &list, list.functions[i]);
+  }
+  FREE_ARRAY(ObjFunction*, list.functions, list.capacity);
+  return written;
+}
+
+bool isBytecodeFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  char magic[4];
+  bool matches = fread(magic, 1, 4, file) == 4 &&
+    memcmp(magic, BYTECODE_MAGIC, 4) == 0;
+  fclose(file);
+  return matches;
+}
+
+typedef struct MappedFile {
+  uint8_t* start;
+  size_t size;
+  struct MappedFile* next;
+} MappedFile;
+
+// files stay mapped while their functions may still run.
+static MappedFile* mappedFiles = NULL;
+
+bool openReader(Reader* reader, const char* path, const char* kind) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open file \"%s\".\n", path);
+    return false;
+  }
+  struct stat info;
+  uint8_t* start = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    start = mmap(NULL, (size_t)info.st_size,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (start == MAP_FAILED) {
+    fprintf(stderr, "could not read file \"%s\".\n", path);
+    return false;
+  }
+
+  MappedFile* file = ALLOCATE(MappedFile, 1);
+  file->start = start;
+  file->size = (size_t)info.st_size;
+  file->next = mappedFiles;
+  mappedFiles = file;
+
+  reader->path = path;
+  reader->kind = kind;
+  reader->start = start;
+  reader->size = (size_t)info.st_size;
+  reader->offset = 0;
+  reader->failed = false;
+  return true;
+}
+
+void readFailed(Reader* reader, const char* message) {
+  if (!reader->failed) {
+    fprintf(stderr, "invalid %s \"%s\": %s.\n",
+      reader->kind, reader->path, message);
+  }
+  reader->failed = true;
+}
+
+// the padding after the bytes is skipped too.
+uint8_t* readBytes(Reader* reader, size_t length) {
+  if (reader->failed) return NULL;
+  size_t padded = length + (4 - length % 4) % 4;
+  if (length > SIZE_MAX - 4 || padded > reader->size - reader->offset) {
+    readFailed(reader, "truncated");
+    return NULL;
+  }
+  uint8_t* bytes = reader->start + reader->offset;
+  reader->offset += padded;
+  return bytes;
+}
+
+uint32_t readU32(Reader* reader) {
+  uint32_t value = 0;
+  uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+ObjString* readString(Reader* reader) {
+  uint32_t length = readU32(reader);
+  if (length > INT32_MAX) {
+    readFailed(reader, "string too long");
+    return NULL;
+  }
+  uint8_t* chars = readBytes(reader, length);
+  if (chars == NULL) return NULL;
+  return copyString((const char*)chars, (int)length);
+}
+
+bool readCode(Reader* reader, Chunk* chunk) {
+  uint32_t codeLength = readU32(reader);
+  if (codeLength == 0 || codeLength > INT32_MAX) {
+    readFailed(reader, "bad code length");
+    return false;
+  }
+  uint8_t* code = readBytes(reader, codeLength);
+  uint32_t lineCount = readU32(reader);
+  if (lineCount > codeLength) {
+    readFailed(reader, "bad line table");
+    return false;
+  }
+  uint8_t* lines = readBytes(reader, sizeof(LineStart) * lineCount);
+  if (reader->failed) return false;
+
+  // the code and line runs stay in the mapped file
+  chunk->mapped = true;
+  chunk->code = code;
+  chunk->count = (int)codeLength;
+  chunk->capacity = (int)codeLength;
+  chunk->lines = (LineStart*)lines;
+  chunk->lineCount = (int)lineCount;
+  chunk->lineCapacity = (int)lineCount;
+
+  for (int i = 0; i < chunk->lineCount; i++) {
+    int offset = chunk->lines[i].offset;
+    int previous = i == 0 ? -1 : chunk->lines[i - 1].offset;
+    if (offset <= previous || offset >= chunk->count ||
+        (i == 0 && offset != 0)) {
+      readFailed(reader, "bad line table");
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef struct {
+  Reader reader;
+  ObjFunction** functions;
+  int functionCount;
+  int globalCount;
+  uint16_t* globals; // slot in this vm for every global of the file
+} Loader;
+
+static bool readConstant(Loader* loader, int owner, Chunk* chunk) {
+  Reader* reader = &loader->reader;
+  Value value;
+  switch (readU32(reader)) {
+  case CONST_NIL:       value = NIL_VAL; break;
+  case CONST_FALSE:     value = BOOL_VAL(false); break;
+  case CONST_TRUE:      value = BOOL_VAL(true); break;
+  case CONST_UNDEFINED: value = UNDEFINED_VAL; break;
+  case CONST_NUMBER: {
+    double number;
+    uint8_t* bytes = readBytes(reader, sizeof(number));
+    if (bytes == NULL) return false;
+    memcpy(&number, bytes, sizeof(number));
+    // any other nan could pass for a boxed pointer
+    if (isnan(number)) number = NAN;
+    value = NUMBER_VAL(number);
+    break;
+  }
+  case CONST_STRING: {
+    ObjString* string = readString(reader);
+    if (string == NULL) return false;
+    value = OBJ_VAL(string);
+    break;
+  }
+  case CONST_FUNCTION: {
+    // every function but the script is created here, by the one
+    // function that holds it, so the functions form a tree.
+    uint32_t index = readU32(reader);
+    if (reader->failed) return false;
+    if (index <= (uint32_t)owner || index >= (uint32_t)loader->functionCount ||
+        loader->functions[index] != NULL) {
+      readFailed(reader, "bad function constant");
+      return false;
+    }
+    ObjFunction* function = newFunction();
+    loader->functions[index] = function;
+    value = OBJ_VAL(function);
+    break;
+  }
+  default:
+    readFailed(reader, "unknown constant");
+    return false;
+  }
+  if (reader->failed) return false;
+  addConstant(chunk, value);
+  writeBarrier((Obj*)loader->functions[owner], value);
+  return true;
+}
+
+static bool readFunction(Loader* loader, int index) {
+  Reader* reader = &loader->reader;
+  ObjFunction* function = loader->functions[index];
+  Chunk* chunk = &function->chunk;
+
+  uint32_t arity = readU32(reader);
+  uint32_t upvalueCount = readU32(reader);
+  uint32_t frameSize = readU32(reader);
+  uint32_t cacheCount = readU32(reader);
+  if (reader->failed) return false;
+  if (arity > UINT8_MAX || upvalueCount > UINT8_MAX ||
+      frameSize > MAX_FRAME_SIZE || cacheCount > UINT16_COUNT ||
+      (index == 0 && (arity != 0 || upvalueCount != 0))) {
+    readFailed(reader, "bad function header");
+    return false;
+  }
+  function->arity = (int)arity;
+  function->upvalueCount = (int)upvalueCount;
+  function->frameSize = (int)frameSize;
+  for (uint32_t i = 0; i < cacheCount; i++) addInlineCache(chunk);
+
+  size_t nameStart = reader->offset;
+  if (readU32(reader) != NO_NAME) {
+    reader->offset = nameStart;
+    function->name = readString(reader);
+    objectBarrier((Obj*)function, (Obj*)function->name);
+  }
+
+  uint32_t constantCount = readU32(reader);
+  if (constantCount > MAX_CONSTANTS) {
+    readFailed(reader, "too many constants");
+    return false;
+  }
+  for (uint32_t i = 0; i < constantCount; i++) {
+    if (!readConstant(loader, index, chunk)) return false;
+  }
+
+  return readCode(reader, chunk);
+}
+
+typedef struct {
+  const uint16_t* globals;
+  int globalCount;
+  ObjFunction* function;
+  Chunk* chunk;
+} Verifier;
+
+// a value an instruction may push. functions only become closures.
+static bool isConstant(Chunk* chunk, int index) {
+  if (index >= chunk->constants.count) return false;
+  Value value = chunk->constants.values[index];
+  return !IS_UNDEFINED(value) && !IS_FUNCTION(value);
+}
+
+static bool isString(Chunk* chunk, int index) {
+  return index < chunk->constants.count &&
+    IS_STRING(chunk->constants.values[index]);
+}
+
+static int readShort(uint8_t* code) {
+  return (code[0] << 8) | code[1];
+}
+
+// checks the operands that don't depend on the stack, and points the
+// global slots at this vm's. the size of the instruction, 0 when it is
+// invalid.
+static int checkOperands(Verifier* v, int offset) {
+  Chunk* chunk = v->chunk;
+  uint8_t* code = &chunk->code[offset];
+  int left = chunk->count - offset;
+  if (code[0] >= OPCODE_COUNT) return 0;
+  // where the operands after a name or closure constant start
+  int width = constantWidth(code[0]);
+
+  if (code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) {
+    if (left < 1 + width) return 0;
+    int index = constantIndex(code);
+    Value constant = index < chunk->constants.count
+      ? chunk->constants.values[index] : NIL_VAL;
+    if (!IS_FUNCTION(constant)) return 0;
+  }
+  int size = instructionSize(chunk, offset);
+  if (size > left) return 0;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    return isConstant(chunk, code[1]) ? size : 0;
+  case OP_CONSTANT_LONG:
+    return isConstant(chunk, (code[1] << 16) | readShort(&code[2]))
+      ? size : 0;
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return isConstant(chunk, code[2]) ? size : 0;
+  case OP_GET_SUPER:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_SUPER_INVOKE:
+  case OP_SUPER_INVOKE_LONG:
+    return isString(chunk, constantIndex(code)) ? size : 0;
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+    return isString(chunk, constantIndex(code)) &&
+      readShort(&code[1 + width]) < chunk->cacheCount ? size : 0;
+  case OP_INVOKE:
+  case OP_INVOKE_LONG:
+    return isString(chunk, constantIndex(code)) &&
+      readShort(&code[2 + width]) < chunk->cacheCount ? size : 0;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    return code[1] < v->function->upvalueCount ? size : 0;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL: {
+    int slot = readShort(&code[1]);
+    if (slot >= v->globalCount) return 0;
+    uint16_t global = v->globals[slot];
+    // the private mapping only copies the pages that change
+    if (global != slot) {
+      code[1] = (global >> 8) & 0xff;
+      code[2] = global & 0xff;
+    }
+    return size;
+  }
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    ObjFunction* inner =
+      AS_FUNCTION(chunk->constants.values[constantIndex(code)]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      uint8_t isLocal = code[1 + width + i * 2];
+      uint8_t index = code[2 + width + i * 2];
+      if (isLocal > 1) return 0;
+      if (!isLocal && index >= v->function->upvalueCount) return 0;
+    }
+    return size;
+  }
+  default:
+    return size;
+  }
+}
+
+bool verifyFunction(ObjFunction* function, const uint16_t* globals,
+    int globalCount) {
+  Chunk* chunk = &function->chunk;
+  Verifier v;
+  v.globals = globals;
+  v.globalCount = globalCount;
+  v.function = function;
+  v.chunk = chunk;
+
+  int last = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    int size = checkOperands(&v, offset);
+    if (size == 0) return false;
+    last = offset;
+    offset += size;
+  }
+  // nothing may run off the end of the code
+  uint8_t op = chunk->code[last];
+  if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) return false;
+
+  // the operands are sound, so the same walk the compiler sizes frames
+  // with also checks the stack. the file's frame size is only trusted
+  // as far as it covers the measured one.
+  int slots = frameSlots(function);
+  if (slots < 0 || slots > MAX_FRAME_SIZE) return false;
+  if (slots > function->frameSize) function->frameSize = slots;
+  return true;
+}
+
+static bool readFile(Loader* loader) {
+  Reader* reader = &loader->reader;
+  uint8_t* magic = readBytes(reader, 4);
+  if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) {
+    readFailed(reader, "not a bytecode file");
+    return false;
+  }
+  uint32_t version = readU32(reader);
+  uint32_t byteOrder = readU32(reader);
+  uint32_t opcodeCount = readU32(reader);
+  uint32_t globalCount = readU32(reader);
+  uint32_t functionCount = readU32(reader);
+  if (reader->failed) return false;
+  if (version != BYTECODE_VERSION || byteOrder != BYTE_ORDER_MARK ||
+      opcodeCount != OPCODE_COUNT) {
+    readFailed(reader, "written by another version of clox");
+    return false;
+  }
+  if (globalCount > UINT16_COUNT || functionCount == 0 ||
+      functionCount > reader->size / 4) {
+    readFailed(reader, "bad header");
+    return false;
+  }
+
+  loader->globalCount = (int)globalCount;
+  loader->globals = ALLOCATE(uint16_t, globalCount);
+  for (uint32_t i = 0; i < globalCount; i++) {
+    ObjString* name = readString(reader);
+    if (name == NULL) return false;
+    int slot = globalSlot(name);
+    if (slot > UINT16_MAX) {
+      readFailed(reader, "too many global variables");
+      return false;
+    }
+    loader->globals[i] = (uint16_t)slot;
+  }
+
+  loader->functionCount = (int)functionCount;
+  loader->functions = ALLOCATE(ObjFunction*, functionCount);
+  for (uint32_t i = 0; i < functionCount; i++) loader->functions[i] = NULL;
+  // the script keeps the rest reachable while the collector runs
+  loader->functions[0] = newFunction();
+  push(OBJ_VAL(loader->functions[0]));
+
+  for (int i = 0; i < loader->functionCount; i++) {
+    if (loader->functions[i] == NULL) {
+      readFailed(reader, "function without a closure");
+      return false;
+    }
+    if (!readFunction(loader, i)) return false;
+  }
+  if (reader->offset != reader->size) {
+    readFailed(reader, "trailing bytes");
+    return false;
+  }
+  for (int i = 0; i < loader->functionCount; i++) {
+    if (!verifyFunction(loader->functions[i], loader->globals,
+                        loader->globalCount)) {
+      readFailed(reader, "malformed code");
+      return false;
+    }
+  }
+  return true;
+}
+
+ObjFunction* loadBytecode(const char* path) {
+  Loader loader;
+  if (!openReader(&loader.reader, path, "bytecode file")) return NULL;
+  loader.functions = NULL;
+  loader.functionCount = 0;
+  loader.globals = NULL;
+  loader.globalCount = 0;
+
+  // a file that fails stays mapped, the chunks already pointing into it
+  // are garbage and never free their code
+  Value* stackTop = vm.stackTop;
+  bool loaded = readFile(&loader);
+  ObjFunction* script = loaded ? loader.functions[0] : NULL;
+
+  FREE_ARRAY(ObjFunction*, loader.functions, loader.functionCount);
+  FREE_ARRAY(uint16_t, loader.globals, loader.globalCount);
+  vm.stackTop = stackTop;
+  return script;
+}
+
+void freeBytecodeFiles() {
+  while (mappedFiles != NULL) {
+    MappedFile* next = mappedFiles->next;
+    munmap(mappedFiles->start, mappedFiles->size);
+    FREE(MappedFile, mappedFiles);
+    mappedFiles = next;
+  }
+}
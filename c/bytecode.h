@@ -0,0 +1,84 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// compiled scripts on disk. `clox --compile script.lox` writes
+// script.loxc, and `clox script.loxc` runs it without the compiler.
+//
+// the file is the global names the code refers to, then every function
+// of the script, the script itself first and each nested function after
+// the one that creates its closure. all numbers are 32-bit in the
+// writer's byte order, variable length parts are padded to 4 bytes:
+//
+//   header     "loxc", version, byte order mark, opcode count,
+//              global count, function count
+//   global     string
+//   function   arity, upvalue count, frame size, cache count,
+//              name (a string, length ~0 for the script),
+//              constant count, constants,
+//              code length, code, line run count, LineStart runs
+//   constant   tag, then a double for numbers, 0/1 for booleans,
+//              a string, or the index of a function
+//   string     length, bytes
+//
+// the loader maps the file and points each chunk's code and line table
+// into it, mapped privately so quickening can still patch the code.
+// before anything runs every function is checked: operands in range,
+// jumps landing on instructions, a stack height that never goes below
+// the frame or past its size and is the same on every path, and locals
+// only read below the top of the stack.
+#define BYTECODE_VERSION 1
+// the last opcode, files written with a different instruction set are
+// turned away.
+#define OPCODE_COUNT (OP_LESS_NUM + 1)
+#define MAX_FRAME_SIZE (UINT16_COUNT + UINT8_COUNT)
+
+// false when the script holds a constant the format can't store.
+bool writeBytecode(ObjFunction* script, FILE* out);
+// true when path starts with the "loxc" magic.
+bool isBytecodeFile(const char* path);
+// the script function, NULL after reporting an unreadable or invalid
+// file.
+ObjFunction* loadBytecode(const char* path);
+// unmaps the loaded files, after every function in them was freed.
+void freeBytecodeFiles();
+
+// the pieces heap snapshots (snapshot.h) are built from.
+void writeU32(FILE* out, uint32_t value);
+void writePadded(FILE* out, const void* bytes, size_t length);
+void writeString(FILE* out, ObjString* string);
+// the code and line runs of a chunk.
+void writeCode(FILE* out, Chunk* chunk);
+
+// reads a file mapped by openReader(), which stays mapped until
+// freeBytecodeFiles(). every read is bounds checked, the first failure
+// is reported and the reads after it come back NULL or 0.
+typedef struct {
+  const char* path;
+  const char* kind; // what the file should be, for the error message
+  uint8_t* start;
+  size_t size;
+  size_t offset;
+  bool failed;
+} Reader;
+
+bool openReader(Reader* reader, const char* path, const char* kind);
+void readFailed(Reader* reader, const char* message);
+// the next length bytes in place, NULL past the end of the file.
+uint8_t* readBytes(Reader* reader, size_t length);
+uint32_t readU32(Reader* reader);
+ObjString* readString(Reader* reader);
+// points the chunk's code and line runs into the file.
+bool readCode(Reader* reader, Chunk* chunk);
+
+// the checks above for one loaded function, whose constants and nested
+// functions are all in place. globals maps the file's global slots to
+// this vm's, global operands are rewritten through it.
+bool verifyFunction(ObjFunction* function, const uint16_t* globals,
+    int globalCount);
+
+#endif
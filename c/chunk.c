@@ -8,14 +8,23 @@ void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity= 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->mapped = false;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  if (!chunk->mapped) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -27,14 +36,61 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, 
         oldCapacity, chunk->capacity);
-    // write-chunk-line
-    chunk->lines = GROW_ARRAY(int, chunk->lines,
-        oldCapacity, chunk->capacity);
   }
   
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+#ifndef NO_LINE_INFO
+  // still on the same line, the current run covers it
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart* start = &chunk->lines[chunk->lineCount++];
+  start->offset = chunk->count - 1;
+  start->line = line;
+#else
+  (void)line;
+#endif
+}
+
+// drops the code from count on, with the line runs that started there.
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+// the source line of the byte at offset, 0 when the chunk has no line
+// info. a binary search over the runs, only for error reporting, the
+// disassembler and the rewriters.
+int getLine(Chunk* chunk, int offset) {
+  int start = 0;
+  int end = chunk->lineCount - 1;
+  int line = 0;
+
+  while (start <= end) {
+    int mid = (start + end) / 2;
+    LineStart* run = &chunk->lines[mid];
+    if (run->offset <= offset) {
+      line = run->line;
+      start = mid + 1;
+    } else {
+      end = mid - 1;
+    }
+  }
+  return line;
 }
 
 int addConstant(Chunk* chunk, Value value) {
@@ -43,3 +99,80 @@ int addConstant(Chunk* chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->count = 0;
+  cache->megamorphic = false;
+  cache->remembered = false;
+  return chunk->cacheCount++;
+}
+
+// number of bytes taken by the instruction at offset, operands included
+int instructionSize(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_LIST:
+  case OP_LIST_APPEND:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL:
+  case OP_SET_LOCAL_POP:
+  case OP_POPN:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SUPER_INVOKE:
+  case OP_ADD_LOCALS:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+    return 4;
+  case OP_INVOKE:
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+  case OP_LESS_LOCAL_CONST_JUMP:
+  case OP_SUPER_INVOKE_LONG:
+    return 5;
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+    return 6;
+  case OP_INVOKE_LONG:
+    return 7;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    uint8_t* code = &chunk->code[offset];
+    ObjFunction* function = AS_FUNCTION(
+      chunk->constants.values[constantIndex(code)]);
+    return 1 + constantWidth(code[0]) + function->upvalueCount * 2;
+  }
+  default:
+    return 1;
+  }
+}
@@ -6,6 +6,7 @@
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG, // 24 bit index, for constants past the first 256
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
@@ -13,6 +14,8 @@ typedef enum {
   OP_DUP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
+  OP_GET_LOCAL_LONG, // 16 bit slot, for locals past the first 256
+  OP_SET_LOCAL_LONG,
   OP_GET_GLOBAL,
   OP_DEFINE_GLOBAL,
   OP_GET_INDEX,
@@ -23,7 +26,10 @@ typedef enum {
   OP_SET_UPVALUE,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
+  OP_GET_PROPERTY_LONG, // the name past the first 256 constants
+  OP_SET_PROPERTY_LONG,
   OP_GET_SUPER,
+  OP_GET_SUPER_LONG,
   OP_EQUAL,
   OP_GREATER,
   OP_INC,
@@ -40,30 +46,127 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
   OP_CLOSURE,
+  OP_CLOSURE_LONG,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
   OP_LIST,
+  OP_LIST_APPEND, // long list literals are built 255 elements at a time
   OP_MAP_INIT,
   OP_MAP_DATA,
   OP_CLASS,
+  OP_CLASS_LONG,
   OP_INHERIT,
   OP_METHOD,
+  OP_METHOD_LONG,
+  // counting loops, only produced by forStatement() for
+  // `for (...; i < limit; i++)`. both carry the counter and limit slots.
+  OP_FOR_PREP,  // jumps forward past the loop unless i < limit
+  OP_FOR_LOOP,  // i += 1, jumps back to the body while i < limit
+  // superinstructions, only produced by fuseSuperinstructions()
+  OP_ADD_LOCALS,
+  OP_LESS_LOCAL_CONST_JUMP,
+  OP_INC_LOCAL,
+  OP_DEC_LOCAL,
+  OP_SET_LOCAL_POP,
+  // peephole forms, only produced by optimizePeephole()
+  OP_POPN,
+  OP_NOT_EQUAL,
+  OP_LESS_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_POP_JUMP_IF_FALSE,
+  // quickened forms, a generic instruction rewrites itself into one of
+  // these the first time it runs and back when its type guard fails
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_EQUAL_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
 } OpCode;
 
+// receiver classes remembered by one property access site before it
+// gives up and goes megamorphic.
+#define IC_WAYS 4
+
+typedef struct {
+  Obj* key;     // receiver shape, or the class for lists
+  int index;    // field slot, -1 for a method
+  Value value;  // the method, or for stores the shape after the field
+                // was added, nil when it already existed
+} ICEntry;
+
+// OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE carry a 16-bit index
+// into the chunk's caches.
+typedef struct {
+  int count;
+  bool megamorphic;
+  bool remembered; // in vm.youngCaches, see rememberCache()
+  ICEntry entries[IC_WAYS];
+} InlineCache;
+
+// the line table is run length encoded, one entry for each run of
+// bytes compiled from the same line. the run starts at `offset` and
+// lasts until the next entry's.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
+  bool mapped; // code and lines point into a loaded file, see bytecode.h
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
+// every instruction naming a constant has a _LONG form for the constants
+// past the first 256. a 24 bit index takes the place of the byte and the
+// other operands follow it.
+static inline int constantWidth(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT_LONG:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+    return 3;
+  default:
+    return 1;
+  }
+}
+
+// the constant named by the instruction at code
+static inline int constantIndex(uint8_t* code) {
+  if (constantWidth(code[0]) == 1) return code[1];
+  return (code[1] << 16) | (code[2] << 8) | code[3];
+}
+
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
+int instructionSize(Chunk* chunk, int offset);
+int getLine(Chunk* chunk, int offset);
 
 #endif
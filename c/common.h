@@ -10,13 +10,47 @@
 
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+// check before each minor collection that the write barriers
+// remembered every old object pointing at a young one
+#define DEBUG_VERIFY_GC
+
+// print the vm's quickening, inline cache, jit and collector counters
+// when it shuts down
+#define DEBUG_PRINT_STATS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #define MAX_BREAKS_PER_SCOPE 256
 
+// chunks keep a line table for runtime errors and the disassembler,
+// build with -DNO_LINE_INFO to leave it out. errors then only name the
+// functions on the stack.
+
+// run() dispatches through a labels-as-values table on gcc/clang,
+// build with -DNO_COMPUTED_GOTO to get the portable switch back.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// the baseline jit (clox --jit) emits x86-64 for NaN boxed values,
+// build with -DNO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// the scanner skips whitespace, comments, strings and names with sse2,
+// or avx2 when built with -mavx2, build with -DNO_SIMD_SCANNER to scan
+// them a byte at a time.
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(NO_SIMD_SCANNER)
+#define SIMD_SCANNER
+#endif
+
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
+#undef DEBUG_VERIFY_GC
+#undef DEBUG_PRINT_STATS
 
 #endif
@@ -5,8 +5,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "regcode.h"
 #include "scanner.h"
 #include "utf8.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -70,10 +73,25 @@ typedef struct Compiler {
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals; // grows as locals are declared, up to UINT16_COUNT
   int localCount;
+  int localCapacity;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int callEnd; // offset just past the latest OP_CALL
+  // the latest offset a forward jump lands on. backward jumps only
+  // land on statement starts, no folding reaches across those.
+  int lastTarget;
+  // the latest constant pushed and where its instruction is, so
+  // binary() and unary() can fold it.
+  int constStart;
+  int constEnd;
+  Value constValue;
+  Table strings; // string constants -> their index
+  bool unreachable; // the latest statement never falls through
+  // set while compiling a skimmed body, whose upvalues were resolved
+  // when it was skimmed and are looked up by name
+  LazyBody* lazy;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -82,6 +100,17 @@ typedef struct ClassCompiler {
   Token name;
 } ClassCompiler;
 
+// a function body left for its first call, see compiler.h
+struct LazyBody {
+  char* source; // from the parameter list through the closing brace
+  int length;
+  int line;     // of the parameter list
+  FunctionType type;
+  bool inClass;
+  bool hasSuperclass;
+  ValueArray captures; // the name of each upvalue, in order
+};
+
 Parser parser;
 
 // local variables current-compiler
@@ -103,6 +132,9 @@ int innermostBreakScopeDepth = 0;
 int* innermostBreakJumps = NULL;
 int innermostBreakJumpCount = 0;
 
+// resolving the names of a body that is only skimmed
+bool skimming = false;
+
 // dumping chunks for debuging when compiling has done
 Chunk* compilingChunk;
 
@@ -200,18 +232,102 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
-    error("too many constants in one chunk");
+// the same constant, numbers by their bits so 0 and -0 stay apart.
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+}
+
+// strings are found through the compiler's table, anything else only
+// among the first 256 constants. those literals are not shared.
+static int findConstant(Value value) {
+  if (IS_STRING(value)) {
+    Value index;
+    if (!tableGet(&current->strings, AS_STRING(value), &index)) return -1;
+    return (int)AS_NUMBER(index);
+  }
+
+  ValueArray* constants = &currentChunk()->constants;
+  int count = constants->count < UINT8_COUNT
+    ? constants->count : UINT8_COUNT;
+  for (int i = 0; i < count; i++) {
+    if (sameConstant(constants->values[i], value)) return i;
+  }
+  return -1;
+}
+
+#define CONSTANT_LONG_MAX 0xffffff
+
+static int makeConstant(Value value) {
+  int constant = findConstant(value);
+  if (constant >= 0) return constant;
+
+  Chunk* chunk = currentChunk();
+  if (chunk->constants.count > CONSTANT_LONG_MAX) {
+    error("too many constants in one chunk.");
     return 0;
   }
+  constant = addConstant(chunk, value);
+  if (IS_STRING(value)) {
+    tableSet(&current->strings, AS_STRING(value), NUMBER_VAL(constant));
+  }
+  return constant;
+}
 
-  return (uint8_t)constant;
+// an instruction naming a constant, its _LONG form past the first 256.
+static void emitConstantOp(uint8_t op, uint8_t longOp, int constant) {
+  if (constant <= UINT8_MAX) {
+    emitBytes(op, (uint8_t)constant);
+  } else {
+    emitBytes(longOp, (constant >> 16) & 0xff);
+    emitBytes((constant >> 8) & 0xff, constant & 0xff);
+  }
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int start = currentChunk()->count;
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstantOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+  }
+  current->constStart = start;
+  current->constEnd = currentChunk()->count;
+  current->constValue = value;
+}
+
+// the code since offset only pushes a constant, nothing jumps into it.
+static bool constantSince(int offset, Value* value) {
+  if (current->constStart != offset ||
+      current->constEnd != currentChunk()->count ||
+      current->lastTarget > offset) {
+    return false;
+  }
+  *value = current->constValue;
+  return true;
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// drops the code from offset on, it can never run.
+static void discardCode(int offset) {
+  truncateChunk(currentChunk(), offset);
+  if (current->callEnd > offset) current->callEnd = -1;
+  current->lastTarget = offset;
+  current->constEnd = -1;
+  // breaks in the dropped code no longer need patching
+  while (innermostBreakJumpCount > 0 &&
+         innermostBreakJumps[innermostBreakJumpCount - 1] >= offset) {
+    innermostBreakJumpCount--;
+  }
 }
 
 static void patchJump(int offset) {
@@ -224,26 +340,38 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->lastTarget = currentChunk()->count;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+static Local* newLocal(Compiler* compiler) {
+  if (compiler->localCapacity < compiler->localCount + 1) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(Local, compiler->locals,
+      oldCapacity, compiler->localCapacity);
+  }
+
+  return &compiler->locals[compiler->localCount++];
+}
+
+static void startCompiler(Compiler* compiler, FunctionType type,
+    ObjFunction* function) {
   compiler->enclosing = current;
-  compiler->function = NULL;
+  compiler->function = function;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->callEnd = -1;
+  compiler->lastTarget = 0;
+  compiler->constEnd = -1;
+  initTable(&compiler->strings);
+  compiler->unreachable = false;
+  compiler->lazy = NULL;
   current = compiler;
 
-  if (type == TYPE_LAMBDA) {
-    current->function->name = copyString("lambda", 6);
-  } else if (type != TYPE_SCRIPT) {
-    // 函数名字是贯穿运行时的,所以在堆上分配
-    current->function->name = copyString(parser.previous.start,
-      parser.previous.length);
-  }
-
-  Local* local = &current->locals[current->localCount++];
+  Local* local = newLocal(current);
   local->depth = 0;
   local->isCaptured = false;
   if (type != TYPE_FUNCTION) { 
@@ -255,17 +383,50 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
+static void initCompiler(Compiler* compiler, FunctionType type) {
+  startCompiler(compiler, type, newFunction());
+
+  if (type == TYPE_LAMBDA) {
+    current->function->name = copyString("lambda", 6);
+  } else if (type != TYPE_SCRIPT) {
+    // 函数名字是贯穿运行时的,所以在堆上分配
+    current->function->name = copyString(parser.previous.start,
+      parser.previous.length);
+  }
+}
+
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current->function;
 
+  if (!parser.hadError) {
+    fuseSuperinstructions(currentChunk());
+    optimizePeephole(currentChunk());
+    // the locals and every temporary on top of them, call() makes
+    // this much room
+    function->frameSize = frameSlots(function);
+    if (function->frameSize < 0) error("stack height differs between paths.");
+  }
+  if (!parser.hadError && vm.registers) {
+    function->registers = compileRegisters(function);
+    if (function->registers != NULL) function->compiled = runRegisters;
+  }
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
       ? function->name->chars : "<script>");
+    if (function->registers != NULL) {
+      disassembleRegisters(function->registers, function->name != NULL
+        ? function->name->chars : "<script>");
+    }
   }
 #endif
 
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  freeTable(&current->strings);
+  // filled in without write barriers, see markCompilerRoots()
+  rememberObject((Obj*)function);
   // 将控制权交给上一个函数
   current = current->enclosing;
   return function;
@@ -299,11 +460,20 @@ static void function(FunctionType type);
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
   return makeConstant(
       OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t identifierGlobal(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -314,6 +484,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
+        // a skimmed body may declare a name of its own that shadows it
+        if (skimming) continue;
         error("can't read local variable in its own initializer.");
       }
       return i;
@@ -343,11 +515,29 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++;
 }
 
+// the upvalue of a skimmed body that was resolved to name.
+static int resolveCapture(Compiler* compiler, Token* name) {
+  if (compiler->lazy == NULL) return -1;
+  ValueArray* captures = &compiler->lazy->captures;
+  for (int i = 0; i < captures->count; i++) {
+    ObjString* capture = AS_STRING(captures->values[i]);
+    if (capture->length == name->length &&
+        memcmp(capture->chars, name->start, name->length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  if (compiler->enclosing == NULL) return resolveCapture(compiler, name);
 
   // 在前一个enclosing环境查找
   int local = resolveLocal(compiler->enclosing, name);
+  if (local > UINT8_MAX) {
+    error("can only capture the first 256 locals of a function.");
+    return -1;
+  }
   if (local != -1) {
     // 将变量标记为被闭包捕足
     compiler->enclosing->locals[local].isCaptured = true;
@@ -364,12 +554,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = newLocal(current);
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
@@ -393,13 +583,13 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
-  // 如是是本地变量, 需将变量的名称填充到常表中, 返回虚拟索引
+  // 如是是本地变量, 返回虚拟索引, 全局变量返回它的slot
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -407,12 +597,26 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void emitVariable(uint8_t op, int arg) {
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL ||
+      op == OP_DEFINE_GLOBAL) {
+    emitByte(op);
+    emitBytes((arg >> 8) & 0xff, arg & 0xff);
+  } else if (arg > UINT8_MAX) {
+    // only locals get that far
+    emitByte(op == OP_GET_LOCAL ? OP_GET_LOCAL_LONG : OP_SET_LOCAL_LONG);
+    emitBytes((arg >> 8) & 0xff, arg & 0xff);
+  } else {
+    emitBytes(op, (uint8_t)arg);
+  }
+}
+
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitVariable(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -439,14 +643,74 @@ static void and_(bool canAssign) {
   patchJump(endJump);
 }
 
+// what the instructions binary() emits would leave for two constants,
+// false when they would fail at runtime.
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+  switch (operatorType) {
+  case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+  case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+  case TOKEN_PLUS:
+    if (IS_STRING(a) && IS_STRING(b)) {
+      ObjString* x = AS_STRING(a);
+      ObjString* y = AS_STRING(b);
+      int length = x->length + y->length;
+      char* chars = ALLOCATE(char, length + 1);
+      memcpy(chars, x->chars, x->length);
+      memcpy(chars + x->length, y->chars, y->length);
+      chars[length] = '\0';
+      *result = OBJ_VAL(takeString(chars, length));
+      return true;
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operatorType) {
+  case TOKEN_GREATER:       *result = BOOL_VAL(x > y); break;
+  case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break;
+  case TOKEN_LESS:          *result = BOOL_VAL(x < y); break;
+  case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); break;
+  case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); break;
+  case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); break;
+  case TOKEN_STAR:          *result = NUMBER_VAL(x * y); break;
+  case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); break;
+  default:                  return false;
+  }
+  return true;
+}
+
 static void binary(bool canAssign) {
   // remember the operator.
   TokenType operatorType = parser.previous.type;
 
+  // a constant left operand, if it is one
+  int leftStart = -1;
+  Value left = current->constValue;
+  if (current->constEnd == currentChunk()->count) {
+    leftStart = current->constStart;
+  }
+  int rightStart = currentChunk()->count;
+
   // compile the right operand.
   ParseRule* rule = getRule(operatorType); 
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  // both constant, push the result instead.
+  Value right;
+  Value result;
+  if (leftStart != -1 && current->lastTarget <= leftStart &&
+      constantSince(rightStart, &right) &&
+      foldBinary(operatorType, left, right, &result)) {
+    truncateChunk(currentChunk(), leftStart);
+    emitConstant(result);
+    return;
+  }
+
   // emit the operator instruction
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
@@ -495,29 +759,42 @@ static void subscript(bool canAssign) {
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
   emitBytes(OP_CALL, argCount);
+  current->callEnd = currentChunk()->count;
+}
+
+// the inline cache slot operand of a property access.
+static void emitCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("too many property accesses in one function.");
+  }
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) { 
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitConstantOp(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+    emitCache();
   } else if (match(TOKEN_LEFT_PAREN)) { 
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitConstantOp(OP_INVOKE, OP_INVOKE_LONG, name);
     emitByte(argCount);
+    emitCache();
   } else { 
-    emitBytes(OP_GET_PROPERTY, name);
+    emitConstantOp(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+    emitCache();
   }
 }
 
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
-  case TOKEN_FALSE: emitByte(OP_FALSE); break;
-  case TOKEN_NIL:   emitByte(OP_NIL); break;
-  case TOKEN_TRUE:  emitByte(OP_TRUE); break;
+  case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+  case TOKEN_NIL:   emitConstant(NIL_VAL); break;
+  case TOKEN_TRUE:  emitConstant(BOOL_VAL(true)); break;
   default:          return; // unreachable
   }
 }
@@ -530,21 +807,37 @@ static void grouping(bool canAssign) {
 // a list literal
 static void list(bool canAssign) {
   int length = 0;
+  bool made = false;
   do {
     // stopif we hit the end of the list.
     if (check(TOKEN_RIGHT_BRACKET)) break;
 
+    // a nested list or map would sit on top of everything pending
+    // here, hand those over first so each level keeps one value.
+    if (length > 0 &&
+        (check(TOKEN_LEFT_BRACKET) || check(TOKEN_LEFT_BRACE))) {
+      emitBytes(made ? OP_LIST_APPEND : OP_LIST, length);
+      made = true;
+      length = 0;
+    }
+
     // the element.
     expression();
     length++;
-    if (length > 255) { //因为指令栈的限制, 可以将OP_LIST分为两个指令OP_LIST_INIT和OP_LIST_DATA解除这个限制
-      error("the list constant can not have more than 255 elements.");
-      return;
+    // 因为指令栈的限制, 每255个元素生成一次, 之后的追加到列表中
+    if (length == UINT8_MAX) {
+      emitBytes(made ? OP_LIST_APPEND : OP_LIST, length);
+      made = true;
+      length = 0;
     }
   } while (match(TOKEN_COMMA));
 
   consume(TOKEN_RIGHT_BRACKET, "expect ']' after list elements.");
-  emitBytes(OP_LIST, length);
+  if (!made) {
+    emitBytes(OP_LIST, length);
+  } else if (length > 0) {
+    emitBytes(OP_LIST_APPEND, length);
+  }
 }
 
 // static void list_(bool canAssign) {
@@ -572,8 +865,8 @@ static void map(bool canAssign) {
       consume(TOKEN_RIGHT_BRACKET, "expect ']' after expression.");
     } else {
       consume(TOKEN_IDENTIFIER, "expect identifier or '['.");
-      uint8_t constant = identifierConstant(&parser.previous);
-      emitBytes(OP_CONSTANT, constant);
+      emitConstant(OBJ_VAL(copyString(parser.previous.start,
+        parser.previous.length)));
     }
     consume(TOKEN_COLON, "expect ':' after map key.");
 
@@ -671,31 +964,31 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else { //最后就是全局变量
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
   if (!canAssign) {
-    emitBytes(getOp, (uint8_t)arg);
+    emitVariable(getOp, arg);
     return;
   }
 
   if (match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitVariable(setOp, arg);
   } else if (match(TOKEN_PLUS_PLUS)) {
-    emitBytes(getOp, (uint8_t)arg);
+    emitVariable(getOp, arg);
     emitByte(OP_INC);
-    emitBytes(setOp, (uint8_t)arg);
+    emitVariable(setOp, arg);
     emitByte(OP_DEC);
   } else if (match(TOKEN_MINUS_MINUS)) {
-    emitBytes(getOp, (uint8_t)arg);
+    emitVariable(getOp, arg);
     emitByte(OP_DEC);
-    emitBytes(setOp, (uint8_t)arg);
+    emitVariable(setOp, arg);
     emitByte(OP_INC);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitVariable(getOp, arg);
   }
 }
 
@@ -719,18 +1012,18 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
 
   if (match(TOKEN_LEFT_PAREN)) { 
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitConstantOp(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitConstantOp(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
 }
 
@@ -748,10 +1041,26 @@ static void lambda(bool canAssign) {
 
 static void unary(bool canAssign) {
   TokenType operatoType = parser.previous.type;
+  int start = currentChunk()->count;
 
   // compile the operand.
   parsePrecedence(PREC_UNARY);
 
+  // fold a constant operand.
+  Value value;
+  if (constantSince(start, &value)) {
+    if (operatoType == TOKEN_BANG) {
+      truncateChunk(currentChunk(), start);
+      emitConstant(BOOL_VAL(isFalsey(value)));
+      return;
+    }
+    if (operatoType == TOKEN_MINUS && IS_NUMBER(value)) {
+      truncateChunk(currentChunk(), start);
+      emitConstant(NUMBER_VAL(-AS_NUMBER(value)));
+      return;
+    }
+  }
+
   // emit the operator instruction.
   switch (operatoType) {
   case TOKEN_BANG:  emitByte(OP_NOT);    break;
@@ -842,17 +1151,23 @@ static void expression() {
 }
 
 static void block() {
+  int deadStart = -1;
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
     declaration();
+    if (current->unreachable && deadStart == -1) {
+      deadStart = currentChunk()->count;
+    }
   }
   consume(TOKEN_RIGHT_BRACE, "expect '}' after block.");
+
+  // nothing after a return, break or continue runs.
+  if (deadStart != -1) {
+    discardCode(deadStart);
+    current->unreachable = true;
+  }
 }
 
-static void function(FunctionType type) { 
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
-  
+static void parameters() {
   // compiler the parameter list.
   consume(TOKEN_LEFT_PAREN, "expect '(' after function name.");
   // handle parameters.
@@ -869,14 +1184,121 @@ static void function(FunctionType type) {
     } while(match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "expect ')' after parameters.");
-
-  // the body.
   consume(TOKEN_LEFT_BRACE, "expect '{' before function body.");
-  block();
+}
+
+static void captureName(Token name) {
+  if (resolveLocal(current, &name) != -1) return;
+  LazyBody* lazy = current->function->lazy;
+  int upvalue = resolveUpvalue(current, &name);
+  if (upvalue != lazy->captures.count) return;
+
+  push(OBJ_VAL(copyString(name.start, name.length))); // for collector
+  writeValueArray(&lazy->captures, vm.stackTop[-1]);
+  pop();
+}
+
+// the parameters and the tokens up to the closing brace, with every
+// name the body uses resolved against the enclosing functions. a name
+// the body declares itself may capture an outer variable it shadows,
+// the body then just never reads that upvalue.
+static ObjFunction* skimFunction(FunctionType type) {
+  LazyBody* lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = NULL;
+  lazy->type = type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  initValueArray(&lazy->captures);
+  current->function->lazy = lazy;
+
+  // the body is copied in one piece, even from a streamed source
+  markSource(parser.current.start);
+  lazy->line = parser.current.line;
+  parameters();
+
+  skimming = true;
+  int depth = 1;
+  int length = 0;
+  TokenType last = TOKEN_LEFT_BRACE;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    // measured before scanning the token after it can move the mark
+    length = (int)(parser.current.start + parser.current.length -
+      sourceMark());
+    advance();
+    switch (parser.previous.type) {
+    case TOKEN_LEFT_BRACE:  depth++; break;
+    case TOKEN_RIGHT_BRACE: depth--; break;
+    case TOKEN_IDENTIFIER:
+      // not a property name
+      if (last != TOKEN_DOT) captureName(parser.previous);
+      break;
+    case TOKEN_SUPER:
+      captureName(syntheticToken("super"));
+      captureName(syntheticToken("this"));
+      break;
+    case TOKEN_THIS:
+      captureName(syntheticToken("this"));
+      break;
+    default:
+      break;
+    }
+    last = parser.previous.type;
+  }
+  skimming = false;
+  if (depth > 0) errorAtCurrent("expect '}' after block.");
+
+  lazy->length = length;
+  lazy->source = ALLOCATE(char, lazy->length + 1);
+  memcpy(lazy->source, sourceMark(), lazy->length);
+  markSource(NULL);
+  lazy->source[lazy->length] = '\0';
+
+  ObjFunction* function = current->function;
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  freeTable(&current->strings);
+  current = current->enclosing;
+  return function;
+}
+
+static void function(FunctionType type) { 
+  // the loops and switches around it are in another chunk, its body
+  // can't continue or break them
+  int surroundingLoopStart = innermostLoopStart;
+  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
+  int surroundingBreakScopeStart = innermostBreakScopeStart;
+  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
+  int* surroundingBreakJumps = innermostBreakJumps;
+  int surroundingBreakJumpCount = innermostBreakJumpCount;
+  innermostLoopStart = -1;
+  innermostLoopScopeDepth = 0;
+  innermostBreakScopeStart = -1;
+  innermostBreakScopeDepth = 0;
+  innermostBreakJumps = NULL;
+  innermostBreakJumpCount = 0;
+
+  Compiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+
+  ObjFunction* function;
+  if (vm.lazy) {
+    function = skimFunction(type);
+  } else {
+    parameters();
+    block();
+    function = endCompiler();
+  }
+
+  innermostLoopStart = surroundingLoopStart;
+  innermostLoopScopeDepth = surroundingLoopScopeDepth;
+  innermostBreakScopeStart = surroundingBreakScopeStart;
+  innermostBreakScopeDepth = surroundingBreakScopeDepth;
+  innermostBreakJumps = surroundingBreakJumps;
+  innermostBreakJumpCount = surroundingBreakJumpCount;
 
   // create the function object.
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitConstantOp(OP_CLOSURE, OP_CLOSURE_LONG,
+    makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
@@ -886,7 +1308,7 @@ static void function(FunctionType type) {
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
@@ -894,18 +1316,19 @@ static void method() {
     type = TYPE_INITIALIZER;
   }
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitConstantOp(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "expect class name.");
   // 类有可能会在局部作用域声明
   Token className = parser.previous; // capture the name of the class
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitConstantOp(OP_CLASS, OP_CLASS_LONG, nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 :
+    identifierGlobal(&className));
 
   ClassCompiler classCompiler;
   classCompiler.name = parser.previous;
@@ -946,14 +1369,14 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("expect function name.");
+  uint16_t global = parseVariable("expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
 }
 
 static void varDeclaration() {
-  uint8_t global;
+  uint16_t global;
 decl:
   global = parseVariable(parser.previous.type == TOKEN_COMMA ? 
     "expect ';' after declaration." : "expect variable name." );
@@ -978,48 +1401,103 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
-static void forStatement() {
-  // if a for statement declares a variable, 
-  // that variable should be scoped to loop body
-  beginScope();
+// the slots a counting loop runs on.
+typedef struct {
+  int counter;
+  int limit;
+  int line; // of the increment, where a bad counter is reported
+} RangeLoop;
+
+// looks ahead for `i < limit; i++)` with i a local and the limit a local
+// or a number. on a match the clauses are consumed and a number is kept
+// in a hidden local of its own, popped with the loop's scope.
+static bool rangeCondition(RangeLoop* range) {
+  if (!check(TOKEN_IDENTIFIER)) return false;
+
+  Token tokens[6];
+  Scanner saved = saveScanner();
+  for (int i = 0; i < 6; i++) tokens[i] = scanToken();
+  restoreScanner(saved);
+
+  Token name = parser.current;
+  Token bound = tokens[1];
+  if (tokens[0].type != TOKEN_LESS ||
+      (bound.type != TOKEN_NUMBER && bound.type != TOKEN_IDENTIFIER) ||
+      tokens[2].type != TOKEN_SEMICOLON ||
+      tokens[3].type != TOKEN_IDENTIFIER ||
+      !identifiersEqual(&name, &tokens[3]) ||
+      tokens[4].type != TOKEN_PLUS_PLUS ||
+      tokens[5].type != TOKEN_RIGHT_PAREN) {
+    return false;
+  }
 
-  consume(TOKEN_LEFT_PAREN, "expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
-    // no initializer
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
-  } else {
-    expressionStatement();
+  // the opcodes have one byte slots
+  range->counter = resolveLocal(current, &name);
+  if (range->counter == -1 || range->counter > UINT8_MAX) return false;
+  if (bound.type == TOKEN_IDENTIFIER) {
+    range->limit = resolveLocal(current, &bound);
+    if (range->limit == -1 || range->limit > UINT8_MAX) return false;
+  } else if (current->localCount > UINT8_MAX) {
+    return false;
   }
-  
-  // save points
-  int surroundingLoopStart = innermostLoopStart;
-  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
-  // starting point
-  innermostLoopStart = currentChunk()->count;
-  innermostLoopScopeDepth = current->scopeDepth;
+  range->line = tokens[3].line;
 
-  // for 'break'
-  int surroundingBreakScopeStart = innermostBreakScopeStart;
-  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
-  int* surroundingBreakJumps = innermostBreakJumps;
-  int surroundingBreakJumpCount = innermostBreakJumpCount;
+  for (int i = 0; i < 7; i++) advance();
+  if (bound.type == TOKEN_NUMBER) {
+    emitConstant(NUMBER_VAL(strtod(bound.start, NULL)));
+    addLocal(syntheticToken(""));
+    markInitialized();
+    range->limit = current->localCount - 1;
+  }
+  return true;
+}
 
-  innermostBreakScopeStart = currentChunk()->count;
-  innermostBreakScopeDepth = current->scopeDepth;
-  innermostBreakJumps = ALLOCATE(int, MAX_BREAKS_PER_SCOPE);
-  innermostBreakJumpCount = 0;
+// FOR_PREP tests the first pass, FOR_LOOP counts and tests the rest.
+// both work on the slots, so a captured or reassigned counter still
+// behaves as the generic loop would.
+static void rangeLoop(RangeLoop* range) {
+  emitBytes(OP_FOR_PREP, (uint8_t)range->counter);
+  emitByte((uint8_t)range->limit);
+  emitBytes(0xff, 0xff);
+  int exitJump = currentChunk()->count - 2;
+  int bodyStart = currentChunk()->count;
+
+  statement();
+
+  uint8_t loop[] = { OP_FOR_LOOP, (uint8_t)range->counter,
+                     (uint8_t)range->limit, 0, 0 };
+  int offset = currentChunk()->count + 5 - bodyStart;
+  if (offset > UINT16_MAX) error("loop body too large.");
+  loop[3] = (offset >> 8) & 0xff;
+  loop[4] = offset & 0xff;
+  for (int i = 0; i < 5; i++) {
+    writeChunk(currentChunk(), loop[i], range->line);
+  }
+
+  patchJump(exitJump);
+  current->unreachable = false;
+}
 
+// the condition and increment clauses as written, and the body.
+static void clauseLoop() {
   int loopStart = currentChunk()->count;
 
   int exitJump = -1;
+  bool never = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "expect ';' after loop condition.");
 
-    // jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // condition
+    Value condition;
+    if (constantSince(loopStart, &condition)) {
+      // a known condition needs no test.
+      discardCode(loopStart);
+      never = isFalsey(condition);
+    } else {
+      // jump out of the loop if the condition is false.
+      exitJump = emitJump(OP_JUMP_IF_FALSE);
+      emitByte(OP_POP); // condition
+    }
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) { 
@@ -1043,6 +1521,53 @@ static void forStatement() {
     emitByte(OP_POP); // condition.
   } 
 
+  // the loop never runs, only its initializer is left.
+  if (never) discardCode(innermostLoopStart);
+  current->unreachable = exitJump == -1 && !never &&
+                         innermostBreakJumpCount == 0;
+}
+
+static void forStatement() {
+  // if a for statement declares a variable, 
+  // that variable should be scoped to loop body
+  beginScope();
+
+  consume(TOKEN_LEFT_PAREN, "expect '(' after 'for'.");
+  if (match(TOKEN_SEMICOLON)) {
+    // no initializer
+  } else if (match(TOKEN_VAR)) {
+    varDeclaration();
+  } else {
+    expressionStatement();
+  }
+
+  RangeLoop range = {0};
+  bool counting = rangeCondition(&range);
+  
+  // save points
+  int surroundingLoopStart = innermostLoopStart;
+  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
+  // starting point
+  innermostLoopStart = currentChunk()->count;
+  innermostLoopScopeDepth = current->scopeDepth;
+
+  // for 'break'
+  int surroundingBreakScopeStart = innermostBreakScopeStart;
+  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
+  int* surroundingBreakJumps = innermostBreakJumps;
+  int surroundingBreakJumpCount = innermostBreakJumpCount;
+
+  innermostBreakScopeStart = currentChunk()->count;
+  innermostBreakScopeDepth = current->scopeDepth;
+  innermostBreakJumps = ALLOCATE(int, MAX_BREAKS_PER_SCOPE);
+  innermostBreakJumpCount = 0;
+
+  if (counting) {
+    rangeLoop(&range);
+  } else {
+    clauseLoop();
+  }
+
   // restore points (for continue)
   innermostLoopStart = surroundingLoopStart;
   innermostLoopScopeDepth = surroundingLoopScopeDepth;
@@ -1069,8 +1594,9 @@ static void forStatement() {
 static void breakStatement() {
   if (innermostBreakScopeStart == -1) {
     error("can't use 'break' outside of a loop or switch.");
+    return;
   }
-  consume(TOKEN_SEMICOLON, "expect ';' after 'continue'.");
+  consume(TOKEN_SEMICOLON, "expect ';' after 'break'.");
 
   for (int i = current->localCount - 1;
        i >= 0 && current->locals[i].depth > innermostBreakScopeDepth;
@@ -1079,11 +1605,13 @@ static void breakStatement() {
   }
 
   innermostBreakJumps[innermostBreakJumpCount++] = emitJump(OP_JUMP);
+  current->unreachable = true;
 }
 
 static void continueStatement() {
   if (innermostLoopStart == -1) {
     error("can't use 'continue' outside of a loop.");
+    return;
   }
   consume(TOKEN_SEMICOLON, "expect ';' after 'continue'.");
 
@@ -1096,24 +1624,53 @@ static void continueStatement() {
   
   // jump to top of current innermost loop.
   emitLoop(innermostLoopStart);
+  current->unreachable = true;
 }
 
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "expect '(' after 'if'.");
+  int conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "expect ')' after condition.");
 
+  // a known condition keeps one branch, the other is parsed and dropped.
+  Value condition;
+  if (constantSince(conditionStart, &condition)) {
+    discardCode(conditionStart);
+    bool taken = !isFalsey(condition);
+
+    statement();
+    bool thenEnds = current->unreachable;
+    if (!taken) discardCode(conditionStart);
+
+    bool elseEnds = false;
+    if (match(TOKEN_ELSE)) {
+      int elseStart = currentChunk()->count;
+      statement();
+      elseEnds = current->unreachable;
+      if (taken) discardCode(elseStart);
+    }
+    current->unreachable = taken ? thenEnds : elseEnds;
+    return;
+  }
+
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP); //将判断表达式的值弹出
   statement();
+  bool thenEnds = current->unreachable;
 
   int elseJump = emitJump(OP_JUMP); // elseJump结束边界 
 
   patchJump(thenJump); 
   emitByte(OP_POP);
 
-  if (match(TOKEN_ELSE)) statement(); 
+  bool elseEnds = false;
+  if (match(TOKEN_ELSE)) {
+    statement();
+    elseEnds = current->unreachable;
+  }
   patchJump(elseJump);
+  current->unreachable = thenEnds && elseEnds;
 }
 
 static void printStatement() {
@@ -1134,8 +1691,15 @@ static void returnStatement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "expect ';' after return value.");
+    // the call is the last thing the expression does, it can take
+    // over this frame. the OP_RETURN stays for natives and classes
+    // and for jumps that land after the call.
+    if (current->callEnd == currentChunk()->count) {
+      currentChunk()->code[current->callEnd - 2] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
+  current->unreachable = true;
 }
 
 static void switchStatement() {
@@ -1242,6 +1806,7 @@ static void switchStatement() {
 
   emitByte(OP_POP); // the switch value.
   endScope();
+  current->unreachable = false;
 }
 
 static void whileStatement() {
@@ -1269,15 +1834,30 @@ static void whileStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-
-  emitByte(OP_POP);
+  int exitJump = -1;
+  bool never = false;
+  Value condition;
+  if (constantSince(loopStart, &condition)) {
+    // a known condition needs no test.
+    discardCode(loopStart);
+    never = isFalsey(condition);
+  } else {
+    exitJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+  }
   statement();
 
   emitLoop(loopStart);
 
-  patchJump(exitJump);
-  emitByte(OP_POP); //无论是否跳转, 判断条件的值最后会留在栈上
+  if (exitJump != -1) {
+    patchJump(exitJump);
+    emitByte(OP_POP); //无论是否跳转, 判断条件的值最后会留在栈上
+  }
+
+  // the body never runs
+  if (never) discardCode(loopStart);
+  current->unreachable = exitJump == -1 && !never &&
+                         innermostBreakJumpCount == 0;
 
   // restore points (for continue)
   innermostLoopStart = surroundingLoopStart;
@@ -1325,6 +1905,7 @@ static void synchronize() {
 }
 
 static void declaration() {
+  current->unreachable = false;
   if (match(TOKEN_CLASS)) { 
     classDeclaration();
   } else if(match(TOKEN_FUN)) {
@@ -1338,6 +1919,7 @@ static void declaration() {
 }
 
 static void statement() {
+  current->unreachable = false;
   if (match(TOKEN_PRINT)) {
     printStatement();
   } else if (match(TOKEN_BREAK)) { 
@@ -1364,8 +1946,7 @@ static void statement() {
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
+static ObjFunction* compileScript() {
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
 
@@ -1376,16 +1957,81 @@ ObjFunction* compile(const char* source) {
 
   while (!match(TOKEN_EOF)) {
     declaration();
+    // nothing refers to the source of a finished declaration
+    releaseSource(parser.previous.start);
   } 
 
   ObjFunction* function = endCompiler();
   return parser.hadError ? NULL : function;
 }
 
+ObjFunction* compile(const char* source) {
+  initScanner(source);
+  return compileScript();
+}
+
+ObjFunction* compileStream(FILE* file) {
+  initStreamScanner(file);
+  ObjFunction* function = compileScript();
+  freeStreamScanner();
+  return function;
+}
+
+bool compileLazy(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  restoreScanner((Scanner){lazy->source, lazy->source, lazy->line});
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  // only whether there was a class matters, for 'this' and 'super'
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = lazy->hasSuperclass;
+  classCompiler.name = syntheticToken("");
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  Compiler compiler;
+  startCompiler(&compiler, lazy->type, function);
+  compiler.lazy = lazy;
+  function->arity = 0;
+  beginScope();
+
+  advance();
+  parameters();
+  block();
+  consume(TOKEN_EOF, "expect end of function body.");
+  endCompiler();
+  currentClass = NULL;
+
+  if (parser.hadError) {
+    // left as it was, the next call reports the errors again
+    freeChunk(&function->chunk);
+    initChunk(&function->chunk);
+    return false;
+  }
+  function->lazy = NULL;
+  freeLazyBody(lazy);
+  return true;
+}
+
+void markLazyBody(LazyBody* lazy) {
+  for (int i = 0; i < lazy->captures.count; i++) {
+    markValue(lazy->captures.values[i]);
+  }
+}
+
+void freeLazyBody(LazyBody* lazy) {
+  if (lazy->source != NULL) FREE_ARRAY(char, lazy->source, lazy->length + 1);
+  freeValueArray(&lazy->captures);
+  FREE(LazyBody, lazy);
+}
+
 void markCompilerRoots() {
   Compiler* compiler = current;
   while (compiler != NULL) {
     markObject((Obj*)compiler->function);
+    // the compiler fills its function in without write barriers
+    rememberObject((Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
 }
@@ -1,11 +1,25 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 
+#include <stdio.h>
+
 #include "object.h"
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+// compiles the source as it's read, for clox - and pipes. see
+// initStreamScanner() in scanner.h.
+ObjFunction* compileStream(FILE* file);
 void markCompilerRoots();
 
-#endif
+// clox --lazy. the compiler only skims the body of a function: it finds
+// the closing brace and resolves every name in it against the enclosing
+// functions, which gives the upvalues the closure captures. the source of
+// the parameters and body is kept with the names of those upvalues, and
+// call() compiles it the first time the function runs. errors in a body
+// are reported then, and a body that never runs is never checked.
+bool compileLazy(ObjFunction* function);
+void markLazyBody(LazyBody* lazy);
+void freeLazyBody(LazyBody* lazy);
 
+#endif
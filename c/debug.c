@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -12,22 +13,67 @@ void disassembleChunk(Chunk* chunk, const char* name) {
   }
 }
 
+// the short and _LONG forms alike, width is the size of the index
 static int constantInstruction(const char* name, Chunk* chunk,
     int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+  int constant = constantIndex(&chunk->code[offset]);
+  int width = constantWidth(chunk->code[offset]);
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 2;
+  return offset + 1 + width;
+}
+
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk,
     int offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t argCount = chunk->code[offset + 2];
+  int constant = constantIndex(&chunk->code[offset]);
+  offset += 1 + constantWidth(chunk->code[offset]);
+  uint8_t argCount = chunk->code[offset];
   printf("%-16s    (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
+  return offset + 1;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  int constant = constantIndex(&chunk->code[offset]);
+  offset += 1 + constantWidth(chunk->code[offset]);
+  uint16_t cache = (uint16_t)(chunk->code[offset] << 8);
+  cache |= chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 2;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  int constant = constantIndex(&chunk->code[offset]);
+  offset += 1 + constantWidth(chunk->code[offset]);
+  uint8_t argCount = chunk->code[offset];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 1] << 8);
+  cache |= chunk->code[offset + 2];
+  printf("%-16s    (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
   return offset + 3;
 }
 
@@ -43,6 +89,37 @@ static int byteInstruction(const char* name, Chunk* chunk,
   return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int localConstJumpInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' %d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
+static int forInstruction(const char* name, int sign, Chunk* chunk,
+    int offset) {
+  uint8_t counter = chunk->code[offset + 1];
+  uint8_t limit = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d %d -> %d\n", name, counter, limit, offset,
+    offset + 5 + sign * jump);
+  return offset + 5;
+}
+
 static int jumpInstruction(const char* name, int sign, 
     Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
@@ -54,17 +131,19 @@ static int jumpInstruction(const char* name, int sign,
 
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 &&
-      chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_NIL:
     return simpleInstruction("OP_NIL", offset);
   case OP_TRUE:
@@ -77,14 +156,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_DUP", offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_GET_LOCAL_LONG:
+    return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_INDEX:
     return simpleInstruction("OP_GET_INDEX", offset);
   case OP_SET_INDEX:
@@ -96,11 +179,17 @@ int disassembleInstruction(Chunk* chunk, int offset) {
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return propertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return propertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
   case OP_GET_SUPER:
     return constantInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_GET_SUPER_LONG:
+    return constantInstruction("OP_GET_SUPER_LONG", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -133,14 +222,23 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL: 
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
+  case OP_INVOKE_LONG:
+    return cachedInvokeInstruction("OP_INVOKE_LONG", chunk, offset);
+  case OP_SUPER_INVOKE_LONG:
+    return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    const char* name = chunk->code[offset] == OP_CLOSURE
+      ? "OP_CLOSURE" : "OP_CLOSURE_LONG";
+    int constant = constantIndex(&chunk->code[offset]);
+    offset += 1 + constantWidth(chunk->code[offset]);
+    printf("%-16s %4d ", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("\n");
 
@@ -161,19 +259,141 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_RETURN", offset);
   case OP_LIST:
     return byteInstruction("OP_LIST", chunk, offset);
+  case OP_LIST_APPEND:
+    return byteInstruction("OP_LIST_APPEND", chunk, offset);
   case OP_MAP_INIT:
     return simpleInstruction("OP_MAP_INIT", offset);
   case OP_MAP_DATA:
     return simpleInstruction("OP_MAP_DATA", offset);
   case OP_CLASS:
     return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_CLASS_LONG:
+    return constantInstruction("OP_CLASS_LONG", chunk, offset);
   case OP_INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_METHOD_LONG:
+    return constantInstruction("OP_METHOD_LONG", chunk, offset);
+  case OP_ADD_LOCALS:
+    return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_FOR_PREP:
+    return forInstruction("OP_FOR_PREP", 1, chunk, offset);
+  case OP_FOR_LOOP:
+    return forInstruction("OP_FOR_LOOP", -1, chunk, offset);
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return localConstJumpInstruction("OP_LESS_LOCAL_CONST_JUMP", chunk,
+      offset);
+  case OP_INC_LOCAL:
+    return byteInstruction("OP_INC_LOCAL", chunk, offset);
+  case OP_DEC_LOCAL:
+    return byteInstruction("OP_DEC_LOCAL", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_POPN:
+    return byteInstruction("OP_POPN", chunk, offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_EQUAL_NUM:
+    return simpleInstruction("OP_EQUAL_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
   default:
     printf("unknow opcode %d\n", instruction);
     return offset + 1;
   }
 }
 
+
+static const char* regOpNames[] = {
+  [R_MOVE]          = "R_MOVE",
+  [R_LOADK]         = "R_LOADK",
+  [R_NIL]           = "R_NIL",
+  [R_TRUE]          = "R_TRUE",
+  [R_FALSE]         = "R_FALSE",
+  [R_GET_GLOBAL]    = "R_GET_GLOBAL",
+  [R_SET_GLOBAL]    = "R_SET_GLOBAL",
+  [R_DEFINE_GLOBAL] = "R_DEFINE_GLOBAL",
+  [R_GET_UPVALUE]   = "R_GET_UPVALUE",
+  [R_SET_UPVALUE]   = "R_SET_UPVALUE",
+  [R_GET_PROPERTY]  = "R_GET_PROPERTY",
+  [R_SET_PROPERTY]  = "R_SET_PROPERTY",
+  [R_GET_INDEX]     = "R_GET_INDEX",
+  [R_SET_INDEX]     = "R_SET_INDEX",
+  [R_ADD]           = "R_ADD",
+  [R_SUBTRACT]      = "R_SUBTRACT",
+  [R_MULTIPLY]      = "R_MULTIPLY",
+  [R_DIVIDE]        = "R_DIVIDE",
+  [R_EQUAL]         = "R_EQUAL",
+  [R_GREATER]       = "R_GREATER",
+  [R_LESS]          = "R_LESS",
+  [R_ADD_K]         = "R_ADD_K",
+  [R_SUBTRACT_K]    = "R_SUBTRACT_K",
+  [R_MULTIPLY_K]    = "R_MULTIPLY_K",
+  [R_DIVIDE_K]      = "R_DIVIDE_K",
+  [R_EQUAL_K]       = "R_EQUAL_K",
+  [R_GREATER_K]     = "R_GREATER_K",
+  [R_LESS_K]        = "R_LESS_K",
+  [R_INC]           = "R_INC",
+  [R_DEC]           = "R_DEC",
+  [R_NOT]           = "R_NOT",
+  [R_NEGATE]        = "R_NEGATE",
+  [R_PRINT]         = "R_PRINT",
+  [R_JUMP]          = "R_JUMP",
+  [R_JUMP_IF_FALSE] = "R_JUMP_IF_FALSE",
+  [R_CALL]          = "R_CALL",
+  [R_INVOKE]        = "R_INVOKE",
+  [R_RETURN]        = "R_RETURN",
+  [R_EXIT]          = "R_EXIT",
+};
+
+// pc, the stack offset it came from, then the fields: A B C, or A Bx
+// for the instructions that have one.
+void disassembleRegisters(RegCode* code, const char* name) {
+  printf("== %s registers ==\n", name);
+
+  for (int pc = 0; pc < code->count; pc++) {
+    uint32_t word = code->code[pc];
+    printf("%04d %04d %-16s %4d ", pc, code->sites[pc].offset,
+      regOpNames[REG_OP(word)], REG_A(word));
+    switch (REG_OP(word)) {
+    case R_LOADK:
+    case R_GET_GLOBAL:
+    case R_SET_GLOBAL:
+    case R_DEFINE_GLOBAL:
+    case R_JUMP:
+    case R_JUMP_IF_FALSE:
+    case R_EXIT:
+      printf("%4d\n", REG_BX(word));
+      break;
+    case R_GET_PROPERTY:
+    case R_SET_PROPERTY:
+    case R_INVOKE:
+      printf("%4d %4d  name %d cache %d\n", REG_B(word), REG_C(word),
+        code->code[pc + 1] & 0xff, code->code[pc + 1] >> 8);
+      pc++;
+      break;
+    default:
+      printf("%4d %4d\n", REG_B(word), REG_C(word));
+      break;
+    }
+  }
+}
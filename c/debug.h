@@ -6,9 +6,11 @@
 #define DEBUG_TRACE_EXECUTION
 
 #include "chunk.h"
+#include "regcode.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleRegisters(RegCode* code, const char* name);
 
 #undef DEBUG_TRACE_EXECUTION
 
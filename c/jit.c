@@ -0,0 +1,2069 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT
+
+// a template jit: every instruction becomes a fixed piece of x86-64.
+// numbers are handled inline, anything else leaves through a side exit
+// that stores ip and the stack top and returns to the interpreter,
+// which runs the instruction the slow way. calls, returns and property
+// access go through helpers in vm.c; a callee runs natively as well
+// once it is hot, else on a nested run().
+//
+// registers while in native code:
+//   rbx  stack top (one past the top value, as vm.stackTop)
+//   r12  frame->slots
+//   r14  the CallFrame
+//   r15  QNAN, for the number checks
+// all callee saved, so helpers can be called without spilling.
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+#define STACK_TOP RBX
+#define SLOTS     R12
+#define FRAME     R14
+#define QNAN_REG  R15
+
+// condition codes
+#define CC_B  0x2
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_AE 0x3
+#define CC_A  0x7
+#define CC_P  0xA
+
+// x86 alu opcodes, `op r/m64, r64` form
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+// sse2 scalar double opcodes
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+typedef enum {
+  JUMP_BYTECODE, // target is an instruction offset
+  JUMP_EXIT,     // target is the instruction to hand back
+  JUMP_ERROR,
+  JUMP_RETURN,
+} JumpKind;
+
+typedef struct {
+  int at;        // position of the rel32
+  JumpKind kind;
+  int target;
+} JitJump;
+
+typedef struct {
+  ObjFunction* function;
+  Chunk* chunk;
+  uint8_t* buf;
+  int count;
+  int capacity;
+  JitJump* jumps;
+  int jumpCount;
+  int jumpCapacity;
+  uint32_t* entries;
+  bool* needsExit;
+} Assembler;
+
+typedef int (*JitEntry)(uint8_t* target, CallFrame* frame);
+
+static void emit8(Assembler* a, uint8_t byte) {
+  if (a->capacity < a->count + 1) {
+    a->capacity = GROW_CAPACITY(a->capacity);
+    a->buf = realloc(a->buf, a->capacity);
+    if (a->buf == NULL) exit(1);
+  }
+  a->buf[a->count++] = byte;
+}
+
+static void emit32(Assembler* a, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit8(a, (value >> (i * 8)) & 0xff);
+}
+
+static void emit64(Assembler* a, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit8(a, (value >> (i * 8)) & 0xff);
+}
+
+// the index of an OP_CONSTANT_LONG
+static int longConstant(uint8_t* code) {
+  return (code[1] << 16) | (code[2] << 8) | code[3];
+}
+
+static void rex(Assembler* a, int reg, int base) {
+  emit8(a, 0x48 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+}
+
+// [base + disp32]
+static void modrmMem(Assembler* a, int reg, int base, int32_t disp) {
+  emit8(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit8(a, 0x24); // rsp and r12 need a sib
+  emit32(a, (uint32_t)disp);
+}
+
+static void modrmReg(Assembler* a, int reg, int rm) {
+  emit8(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void movLoad(Assembler* a, int dst, int base, int32_t disp) {
+  rex(a, dst, base);
+  emit8(a, 0x8B);
+  modrmMem(a, dst, base, disp);
+}
+
+static void movStore(Assembler* a, int base, int32_t disp, int src) {
+  rex(a, src, base);
+  emit8(a, 0x89);
+  modrmMem(a, src, base, disp);
+}
+
+static void movImm(Assembler* a, int dst, uint64_t imm) {
+  rex(a, 0, dst);
+  emit8(a, 0xB8 + (dst & 7));
+  emit64(a, imm);
+}
+
+static void movReg(Assembler* a, int dst, int src) {
+  rex(a, src, dst);
+  emit8(a, 0x89);
+  modrmReg(a, src, dst);
+}
+
+static void alu(Assembler* a, uint8_t op, int dst, int src) {
+  rex(a, src, dst);
+  emit8(a, op);
+  modrmReg(a, src, dst);
+}
+
+static void addImm(Assembler* a, int dst, int32_t imm) {
+  rex(a, 0, dst);
+  emit8(a, 0x81);
+  modrmReg(a, imm < 0 ? 5 : 0, dst); // sub or add
+  emit32(a, (uint32_t)(imm < 0 ? -imm : imm));
+}
+
+static void movqToXmm(Assembler* a, int xmm, int gpr) {
+  emit8(a, 0x66);
+  rex(a, xmm, gpr);
+  emit8(a, 0x0F);
+  emit8(a, 0x6E);
+  modrmReg(a, xmm, gpr);
+}
+
+static void movqFromXmm(Assembler* a, int gpr, int xmm) {
+  emit8(a, 0x66);
+  rex(a, xmm, gpr);
+  emit8(a, 0x0F);
+  emit8(a, 0x7E);
+  modrmReg(a, xmm, gpr);
+}
+
+// rex without W, only needed to reach xmm8-15 or r8-r15.
+static void rexOptional(Assembler* a, int reg, int rm) {
+  if ((reg | rm) & 8) {
+    emit8(a, 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+  }
+}
+
+static void sse(Assembler* a, uint8_t op, int dst, int src) {
+  emit8(a, 0xF2);
+  rexOptional(a, dst, src);
+  emit8(a, 0x0F);
+  emit8(a, op);
+  modrmReg(a, dst, src);
+}
+
+static void ucomisd(Assembler* a, int x, int y) {
+  emit8(a, 0x66);
+  rexOptional(a, x, y);
+  emit8(a, 0x0F);
+  emit8(a, 0x2E);
+  modrmReg(a, x, y);
+}
+
+// movapd rather than movsd: it writes the whole register, so copies
+// don't chain on whatever was in dst before.
+static void movapd(Assembler* a, int dst, int src) {
+  if (dst == src) return;
+  emit8(a, 0x66);
+  rexOptional(a, dst, src);
+  emit8(a, 0x0F);
+  emit8(a, 0x28);
+  modrmReg(a, dst, src);
+}
+
+static void xorpd(Assembler* a, int dst, int src) {
+  emit8(a, 0x66);
+  rexOptional(a, dst, src);
+  emit8(a, 0x0F);
+  emit8(a, 0x57);
+  modrmReg(a, dst, src);
+}
+
+// gpr = (int64_t)xmm, truncating
+static void cvttsd2si(Assembler* a, int gpr, int xmm) {
+  emit8(a, 0xF2);
+  rex(a, gpr, xmm);
+  emit8(a, 0x0F);
+  emit8(a, 0x2C);
+  modrmReg(a, gpr, xmm);
+}
+
+// zero extending 32 bit load
+static void movLoad32(Assembler* a, int dst, int base, int32_t disp) {
+  rexOptional(a, dst, base);
+  emit8(a, 0x8B);
+  modrmMem(a, dst, base, disp);
+}
+
+// cmp dword [base + disp], imm
+static void cmpMem32(Assembler* a, int base, int32_t disp, int32_t imm) {
+  rexOptional(a, 0, base);
+  emit8(a, 0x81);
+  modrmMem(a, 7, base, disp);
+  emit32(a, (uint32_t)imm);
+}
+
+// cmp byte [base + disp], imm
+static void cmpMem8(Assembler* a, int base, int32_t disp, uint8_t imm) {
+  rexOptional(a, 0, base);
+  emit8(a, 0x80);
+  modrmMem(a, 7, base, disp);
+  emit8(a, imm);
+}
+
+// dst = src * imm
+static void imulImm(Assembler* a, int dst, int src, int32_t imm) {
+  rex(a, dst, src);
+  emit8(a, 0x69);
+  modrmReg(a, dst, src);
+  emit32(a, (uint32_t)imm);
+}
+
+static void shlImm(Assembler* a, int reg, uint8_t bits) {
+  rex(a, 0, reg);
+  emit8(a, 0xC1);
+  modrmReg(a, 4, reg);
+  emit8(a, bits);
+}
+
+static void pushReg(Assembler* a, int reg) {
+  if (reg & 8) emit8(a, 0x41);
+  emit8(a, 0x50 + (reg & 7));
+}
+
+static void popReg(Assembler* a, int reg) {
+  if (reg & 8) emit8(a, 0x41);
+  emit8(a, 0x58 + (reg & 7));
+}
+
+static void callAbsolute(Assembler* a, void* fn) {
+  movImm(a, RAX, (uint64_t)(uintptr_t)fn);
+  emit8(a, 0xFF);
+  emit8(a, 0xD0); // call rax
+}
+
+// a forward jump inside one template, patched with patchHere().
+static int jccLocal(Assembler* a, int cc) {
+  emit8(a, 0x0F);
+  emit8(a, 0x80 | cc);
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static int jmpLocal(Assembler* a) {
+  emit8(a, 0xE9);
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static void patchAt(Assembler* a, int at, int to) {
+  int32_t rel = to - (at + 4);
+  memcpy(&a->buf[at], &rel, sizeof(rel));
+}
+
+static void patchHere(Assembler* a, int at) {
+  patchAt(a, at, a->count);
+}
+
+static void addJump(Assembler* a, JumpKind kind, int target) {
+  if (a->jumpCapacity < a->jumpCount + 1) {
+    a->jumpCapacity = GROW_CAPACITY(a->jumpCapacity);
+    a->jumps = realloc(a->jumps, sizeof(JitJump) * a->jumpCapacity);
+    if (a->jumps == NULL) exit(1);
+  }
+  a->jumps[a->jumpCount].at = a->count - 4;
+  a->jumps[a->jumpCount].kind = kind;
+  a->jumps[a->jumpCount].target = target;
+  a->jumpCount++;
+  if (kind == JUMP_EXIT) a->needsExit[target] = true;
+}
+
+static void jmpTo(Assembler* a, JumpKind kind, int target) {
+  emit8(a, 0xE9);
+  emit32(a, 0);
+  addJump(a, kind, target);
+}
+
+static void jccTo(Assembler* a, int cc, JumpKind kind, int target) {
+  emit8(a, 0x0F);
+  emit8(a, 0x80 | cc);
+  emit32(a, 0);
+  addJump(a, kind, target);
+}
+
+static void pushValue(Assembler* a, int reg) {
+  movStore(a, STACK_TOP, 0, reg);
+  addImm(a, STACK_TOP, 8);
+}
+
+// leave through the side exit of the instruction at offset unless reg
+// holds a number. clobbers rcx.
+static void checkNumber(Assembler* a, int reg, int offset) {
+  movReg(a, RCX, reg);
+  alu(a, ALU_AND, RCX, QNAN_REG);
+  alu(a, ALU_CMP, RCX, QNAN_REG);
+  jccTo(a, CC_E, JUMP_EXIT, offset);
+}
+
+// rax = cc ? true : false, the flags are still those of the compare.
+static void boolFromFlags(Assembler* a, int falseCC) {
+  movImm(a, RAX, FALSE_VAL);
+  int skip = jccLocal(a, falseCC);
+  movImm(a, RAX, TRUE_VAL);
+  patchHere(a, skip);
+}
+
+// frame->ip and vm.stackTop have to be right before any helper runs,
+// it may report an error or collect garbage.
+static void storeState(Assembler* a, int ipOffset) {
+  movImm(a, RAX, (uint64_t)(uintptr_t)&a->chunk->code[ipOffset]);
+  movStore(a, FRAME, offsetof(CallFrame, ip), RAX);
+  movImm(a, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  movStore(a, RAX, 0, STACK_TOP);
+}
+
+// a helper may have grown vm.frames and the stack, so the frame is
+// found again by its index, the top one.
+static void reloadState(Assembler* a) {
+  movImm(a, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+  movLoad32(a, RCX, RCX, 0);
+  imulImm(a, RCX, RCX, (int32_t)sizeof(CallFrame));
+  movImm(a, FRAME, (uint64_t)(uintptr_t)&vm.frames);
+  movLoad(a, FRAME, FRAME, 0);
+  alu(a, 0x01, FRAME, RCX); // add
+  addImm(a, FRAME, -(int32_t)sizeof(CallFrame));
+  movImm(a, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+  movLoad(a, STACK_TOP, RCX, 0);
+  movLoad(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+static void checkHelperResult(Assembler* a) {
+  emit8(a, 0x84);
+  emit8(a, 0xC0); // test al, al
+  jccTo(a, CC_E, JUMP_ERROR, 0);
+}
+
+static void addNativeDepth(Assembler* a, int by) {
+  movImm(a, RCX, (uint64_t)(uintptr_t)&vm.nativeDepth);
+  emit8(a, 0xFF);
+  emit8(a, by > 0 ? 0x01 : 0x09); // inc or dec dword [rcx]
+}
+
+// rax is the callee's code from vmCallEntry() or vmInvokeEntry(), its
+// frame already pushed: call it directly, the way it would return to
+// jitEnter(). NULL falls through to the generic call, the returned
+// jump skips it.
+static int callJitted(Assembler* a) {
+  emit8(a, 0x48);
+  emit8(a, 0x85);
+  emit8(a, 0xC0); // test rax, rax
+  int generic = jccLocal(a, CC_E);
+  reloadState(a);
+  addNativeDepth(a, 1);
+  addImm(a, RSP, -8); // keep calls 16 byte aligned
+  emit8(a, 0xFF);
+  emit8(a, 0xD0); // call rax
+  addImm(a, RSP, 8);
+  addNativeDepth(a, -1);
+  emit8(a, 0x3D);
+  emit32(a, CODE_RETURNED); // cmp eax, CODE_RETURNED
+  int returned = jccLocal(a, CC_E);
+  // an error, or the callee's frame left for the interpreter
+  movReg(a, RDI, RAX);
+  callAbsolute(a, (void*)vmFinishJitted);
+  checkHelperResult(a);
+  patchHere(a, returned);
+  int done = jmpLocal(a);
+  patchHere(a, generic);
+  return done;
+}
+
+static void loadGlobals(Assembler* a, int reg) {
+  movImm(a, reg, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  movLoad(a, reg, reg, 0);
+}
+
+static void loadUpvalueLocation(Assembler* a, int reg, int index) {
+  movLoad(a, reg, FRAME, offsetof(CallFrame, closure));
+  movLoad(a, reg, reg, offsetof(ObjClosure, upvalues));
+  movLoad(a, reg, reg, index * (int)sizeof(ObjUpvalue*));
+  movLoad(a, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+static void arithmetic(Assembler* a, int offset, uint8_t op) {
+  movLoad(a, RAX, STACK_TOP, -16);
+  movLoad(a, RDX, STACK_TOP, -8);
+  checkNumber(a, RAX, offset);
+  checkNumber(a, RDX, offset);
+  movqToXmm(a, 0, RAX);
+  movqToXmm(a, 1, RDX);
+  sse(a, op, 0, 1);
+  movqFromXmm(a, RAX, 0);
+  movStore(a, STACK_TOP, -16, RAX);
+  addImm(a, STACK_TOP, -8);
+}
+
+// ucomisd sets "above" only for ordered operands, so NaN compares false,
+// and true once negated.
+static void comparison(Assembler* a, int offset, bool less, bool negated) {
+  movLoad(a, RAX, STACK_TOP, -16);
+  movLoad(a, RDX, STACK_TOP, -8);
+  checkNumber(a, RAX, offset);
+  checkNumber(a, RDX, offset);
+  movqToXmm(a, 0, RAX);
+  movqToXmm(a, 1, RDX);
+  if (less) {
+    ucomisd(a, 1, 0);
+  } else {
+    ucomisd(a, 0, 1);
+  }
+  boolFromFlags(a, negated ? CC_A : CC_BE);
+  movStore(a, STACK_TOP, -16, RAX);
+  addImm(a, STACK_TOP, -8);
+}
+
+// rax = valuesEqual(rax, rdx): numbers compare as doubles, everything
+// else by bits. clobbers rcx, rdx, xmm0 and xmm1.
+static void equalValues(Assembler* a) {
+  movReg(a, RCX, RAX);
+  alu(a, ALU_AND, RCX, QNAN_REG);
+  alu(a, ALU_CMP, RCX, QNAN_REG);
+  int bits1 = jccLocal(a, CC_E);
+  movReg(a, RCX, RDX);
+  alu(a, ALU_AND, RCX, QNAN_REG);
+  alu(a, ALU_CMP, RCX, QNAN_REG);
+  int bits2 = jccLocal(a, CC_E);
+
+  movqToXmm(a, 0, RAX);
+  movqToXmm(a, 1, RDX);
+  ucomisd(a, 0, 1);
+  movImm(a, RAX, FALSE_VAL);
+  int unordered = jccLocal(a, CC_P);
+  int notEqual = jccLocal(a, CC_NE);
+  movImm(a, RAX, TRUE_VAL);
+  int done = jmpLocal(a);
+
+  patchHere(a, bits1);
+  patchHere(a, bits2);
+  alu(a, ALU_CMP, RAX, RDX);
+  boolFromFlags(a, CC_NE);
+
+  patchHere(a, unordered);
+  patchHere(a, notEqual);
+  patchHere(a, done);
+}
+
+static void equal(Assembler* a) {
+  movLoad(a, RAX, STACK_TOP, -16);
+  movLoad(a, RDX, STACK_TOP, -8);
+  equalValues(a);
+  movStore(a, STACK_TOP, -16, RAX);
+  addImm(a, STACK_TOP, -8);
+}
+
+static void notTop(Assembler* a) {
+  movLoad(a, RAX, STACK_TOP, -8);
+  movImm(a, RDX, TRUE_VAL);
+  movImm(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, RAX, RCX);
+  int isNil = jccLocal(a, CC_E);
+  movImm(a, RCX, FALSE_VAL);
+  alu(a, ALU_CMP, RAX, RCX);
+  int isFalse = jccLocal(a, CC_E);
+  movImm(a, RDX, FALSE_VAL);
+  patchHere(a, isNil);
+  patchHere(a, isFalse);
+  movStore(a, STACK_TOP, -8, RDX);
+}
+
+// jumps to target when the value in rax is nil or false.
+static void jumpIfFalsey(Assembler* a, JumpKind kind, int target) {
+  movImm(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, RAX, RCX);
+  jccTo(a, CC_E, kind, target);
+  movImm(a, RCX, FALSE_VAL);
+  alu(a, ALU_CMP, RAX, RCX);
+  jccTo(a, CC_E, kind, target);
+}
+
+static void addOne(Assembler* a, int reg, int offset, uint8_t op) {
+  checkNumber(a, reg, offset);
+  movqToXmm(a, 0, reg);
+  movImm(a, RCX, NUMBER_VAL(1));
+  movqToXmm(a, 1, RCX);
+  sse(a, op, 0, 1);
+  movqFromXmm(a, reg, 0);
+}
+
+static Trace* findTrace(ObjFunction* function, int header);
+static uint8_t* traceFromNative(Trace* trace, CallFrame* frame);
+
+// a backward jump, into the loop's trace when it has one.
+static void loopBack(Assembler* a, int header) {
+  Trace* trace = findTrace(a->function, header);
+  if (trace != NULL && trace->code != NULL) {
+    // run the loop's trace, then go on wherever it left the frame
+    storeState(a, header);
+    movImm(a, RDI, (uint64_t)(uintptr_t)trace);
+    movReg(a, RSI, FRAME);
+    callAbsolute(a, (void*)traceFromNative);
+    reloadState(a);
+    emit8(a, 0xFF);
+    emit8(a, 0xE0); // jmp rax
+    return;
+  }
+  jmpTo(a, JUMP_BYTECODE, header);
+}
+
+static void compileInstruction(Assembler* a, int offset) {
+  Chunk* chunk = a->chunk;
+  uint8_t* code = &chunk->code[offset];
+  int size = instructionSize(chunk, offset);
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    movImm(a, RAX, chunk->constants.values[code[1]]);
+    pushValue(a, RAX);
+    break;
+  case OP_CONSTANT_LONG:
+    movImm(a, RAX, chunk->constants.values[longConstant(code)]);
+    pushValue(a, RAX);
+    break;
+  case OP_NIL:   movImm(a, RAX, NIL_VAL); pushValue(a, RAX); break;
+  case OP_TRUE:  movImm(a, RAX, TRUE_VAL); pushValue(a, RAX); break;
+  case OP_FALSE: movImm(a, RAX, FALSE_VAL); pushValue(a, RAX); break;
+  case OP_POP:
+    addImm(a, STACK_TOP, -8);
+    break;
+  case OP_POPN:
+    addImm(a, STACK_TOP, -8 * code[1]);
+    break;
+  case OP_DUP:
+    movLoad(a, RAX, STACK_TOP, -8);
+    pushValue(a, RAX);
+    break;
+  case OP_GET_LOCAL:
+    movLoad(a, RAX, SLOTS, code[1] * 8);
+    pushValue(a, RAX);
+    break;
+  case OP_SET_LOCAL:
+    movLoad(a, RAX, STACK_TOP, -8);
+    movStore(a, SLOTS, code[1] * 8, RAX);
+    break;
+  case OP_GET_LOCAL_LONG:
+    movLoad(a, RAX, SLOTS, ((code[1] << 8) | code[2]) * 8);
+    pushValue(a, RAX);
+    break;
+  case OP_SET_LOCAL_LONG:
+    movLoad(a, RAX, STACK_TOP, -8);
+    movStore(a, SLOTS, ((code[1] << 8) | code[2]) * 8, RAX);
+    break;
+  case OP_GET_GLOBAL: {
+    int slot = (code[1] << 8) | code[2];
+    loadGlobals(a, RCX);
+    movLoad(a, RAX, RCX, slot * 8);
+    movImm(a, RDX, UNDEFINED_VAL);
+    alu(a, ALU_CMP, RAX, RDX);
+    jccTo(a, CC_E, JUMP_EXIT, offset);
+    pushValue(a, RAX);
+    break;
+  }
+  case OP_DEFINE_GLOBAL: {
+    int slot = (code[1] << 8) | code[2];
+    loadGlobals(a, RCX);
+    addImm(a, STACK_TOP, -8);
+    movLoad(a, RAX, STACK_TOP, 0);
+    movStore(a, RCX, slot * 8, RAX);
+    break;
+  }
+  case OP_SET_GLOBAL: {
+    int slot = (code[1] << 8) | code[2];
+    loadGlobals(a, RCX);
+    movLoad(a, RAX, RCX, slot * 8);
+    movImm(a, RDX, UNDEFINED_VAL);
+    alu(a, ALU_CMP, RAX, RDX);
+    jccTo(a, CC_E, JUMP_EXIT, offset);
+    movLoad(a, RAX, STACK_TOP, -8);
+    movStore(a, RCX, slot * 8, RAX);
+    break;
+  }
+  case OP_GET_UPVALUE:
+    loadUpvalueLocation(a, RCX, code[1]);
+    movLoad(a, RAX, RCX, 0);
+    pushValue(a, RAX);
+    break;
+  case OP_SET_UPVALUE:
+    loadUpvalueLocation(a, RCX, code[1]);
+    movLoad(a, RAX, STACK_TOP, -8);
+    movStore(a, RCX, 0, RAX);
+    break;
+  case OP_EQUAL:
+  case OP_EQUAL_NUM:
+    equal(a);
+    break;
+  case OP_NOT_EQUAL:
+    equal(a);
+    notTop(a);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    comparison(a, offset, false, false);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    comparison(a, offset, true, false);
+    break;
+  case OP_LESS_EQUAL:
+    comparison(a, offset, false, true);
+    break;
+  case OP_GREATER_EQUAL:
+    comparison(a, offset, true, true);
+    break;
+  case OP_INC:
+  case OP_DEC:
+    movLoad(a, RAX, STACK_TOP, -8);
+    addOne(a, RAX, offset, code[0] == OP_INC ? SSE_ADD : SSE_SUB);
+    movStore(a, STACK_TOP, -8, RAX);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:      arithmetic(a, offset, SSE_ADD); break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM: arithmetic(a, offset, SSE_SUB); break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM: arithmetic(a, offset, SSE_MUL); break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:   arithmetic(a, offset, SSE_DIV); break;
+  case OP_NOT:
+    notTop(a);
+    break;
+  case OP_NEGATE:
+    movLoad(a, RAX, STACK_TOP, -8);
+    checkNumber(a, RAX, offset);
+    movImm(a, RCX, SIGN_BIT);
+    alu(a, ALU_XOR, RAX, RCX);
+    movStore(a, STACK_TOP, -8, RAX);
+    break;
+  case OP_PRINT:
+    addImm(a, STACK_TOP, -8);
+    storeState(a, offset + size);
+    movLoad(a, RDI, STACK_TOP, 0);
+    callAbsolute(a, (void*)vmPrint);
+    break;
+  case OP_JUMP:
+    jmpTo(a, JUMP_BYTECODE, offset + size + ((code[1] << 8) | code[2]));
+    break;
+  case OP_JUMP_IF_FALSE:
+    movLoad(a, RAX, STACK_TOP, -8);
+    jumpIfFalsey(a, JUMP_BYTECODE,
+      offset + size + ((code[1] << 8) | code[2]));
+    break;
+  case OP_POP_JUMP_IF_FALSE:
+    movLoad(a, RAX, STACK_TOP, -8);
+    addImm(a, STACK_TOP, -8);
+    jumpIfFalsey(a, JUMP_BYTECODE,
+      offset + size + ((code[1] << 8) | code[2]));
+    break;
+  case OP_LOOP:
+    loopBack(a, offset + size - ((code[1] << 8) | code[2]));
+    break;
+  case OP_CALL: {
+    storeState(a, offset + size);
+    movImm(a, RDI, code[1]);
+    callAbsolute(a, (void*)vmCallEntry);
+    int slow = callJitted(a);
+    movImm(a, RDI, code[1]);
+    callAbsolute(a, (void*)vmCall);
+    checkHelperResult(a);
+    patchHere(a, slow);
+    reloadState(a);
+    break;
+  }
+  case OP_INVOKE:
+  case OP_INVOKE_LONG: {
+    uint8_t* operands = code + constantWidth(code[0]);
+    int cache = (operands[2] << 8) | operands[3];
+    storeState(a, offset + size);
+    movImm(a, RDI, (uint64_t)(uintptr_t)&chunk->caches[cache]);
+    movImm(a, RSI, operands[1]);
+    callAbsolute(a, (void*)vmInvokeEntry);
+    int slow = callJitted(a);
+    movImm(a, RDI, (uint64_t)(uintptr_t)AS_OBJ(chunk->constants.values[constantIndex(code)]));
+    movImm(a, RSI, operands[1]);
+    movImm(a, RDX, (uint64_t)(uintptr_t)&chunk->caches[cache]);
+    callAbsolute(a, (void*)vmInvoke);
+    checkHelperResult(a);
+    patchHere(a, slow);
+    reloadState(a);
+    break;
+  }
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG: {
+    // the cache follows the name, one byte or three
+    uint8_t* operands = code + constantWidth(code[0]);
+    int cache = (operands[1] << 8) | operands[2];
+    storeState(a, offset + size);
+    movImm(a, RDI, (uint64_t)(uintptr_t)AS_OBJ(chunk->constants.values[constantIndex(code)]));
+    movImm(a, RSI, (uint64_t)(uintptr_t)&chunk->caches[cache]);
+    bool get = code[0] == OP_GET_PROPERTY || code[0] == OP_GET_PROPERTY_LONG;
+    callAbsolute(a, get ?
+      (void*)vmGetProperty : (void*)vmSetProperty);
+    checkHelperResult(a);
+    reloadState(a);
+    break;
+  }
+  case OP_RETURN:
+    storeState(a, offset + size);
+    callAbsolute(a, (void*)vmReturn);
+    jmpTo(a, JUMP_RETURN, 0);
+    break;
+  case OP_ADD_LOCALS:
+    movLoad(a, RAX, SLOTS, code[1] * 8);
+    movLoad(a, RDX, SLOTS, code[2] * 8);
+    checkNumber(a, RAX, offset);
+    checkNumber(a, RDX, offset);
+    movqToXmm(a, 0, RAX);
+    movqToXmm(a, 1, RDX);
+    sse(a, SSE_ADD, 0, 1);
+    movqFromXmm(a, RAX, 0);
+    pushValue(a, RAX);
+    break;
+  case OP_LESS_LOCAL_CONST_JUMP: {
+    Value limit = chunk->constants.values[code[2]];
+    if (!IS_NUMBER(limit)) {
+      jmpTo(a, JUMP_EXIT, offset);
+      break;
+    }
+    movLoad(a, RAX, SLOTS, code[1] * 8);
+    checkNumber(a, RAX, offset);
+    movqToXmm(a, 0, RAX);
+    movImm(a, RCX, limit);
+    movqToXmm(a, 1, RCX);
+    ucomisd(a, 1, 0); // limit above local, i.e. local < limit
+    jccTo(a, CC_BE, JUMP_BYTECODE,
+      offset + size + ((code[3] << 8) | code[4]));
+    break;
+  }
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    // both checked before the counter moves, the interpreter reports
+    // the error
+    movLoad(a, RAX, SLOTS, code[1] * 8);
+    movLoad(a, RDX, SLOTS, code[2] * 8);
+    checkNumber(a, RAX, offset);
+    checkNumber(a, RDX, offset);
+    if (code[0] == OP_FOR_LOOP) {
+      addOne(a, RAX, offset, SSE_ADD);
+      movStore(a, SLOTS, code[1] * 8, RAX);
+    }
+    movqToXmm(a, 0, RAX);
+    movqToXmm(a, 1, RDX);
+    ucomisd(a, 1, 0); // limit above counter, i.e. counter < limit
+    if (code[0] == OP_FOR_PREP) {
+      jccTo(a, CC_BE, JUMP_BYTECODE,
+        offset + size + ((code[3] << 8) | code[4]));
+    } else {
+      jccTo(a, CC_BE, JUMP_BYTECODE, offset + size);
+      loopBack(a, offset + size - ((code[3] << 8) | code[4]));
+    }
+    break;
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL:
+    movLoad(a, RAX, SLOTS, code[1] * 8);
+    addOne(a, RAX, offset, code[0] == OP_INC_LOCAL ? SSE_ADD : SSE_SUB);
+    movStore(a, SLOTS, code[1] * 8, RAX);
+    break;
+  case OP_SET_LOCAL_POP:
+    addImm(a, STACK_TOP, -8);
+    movLoad(a, RAX, STACK_TOP, 0);
+    movStore(a, SLOTS, code[1] * 8, RAX);
+    break;
+  default:
+    // closures, classes, super calls and the rest are left to the
+    // interpreter.
+    jmpTo(a, JUMP_EXIT, offset);
+    break;
+  }
+}
+
+static void pushRegisters(Assembler* a) {
+  pushReg(a, RBX);
+  pushReg(a, RBP);
+  pushReg(a, R12);
+  pushReg(a, R13);
+  pushReg(a, R14);
+  pushReg(a, R15);
+}
+
+static void popRegisters(Assembler* a) {
+  popReg(a, R15);
+  popReg(a, R14);
+  popReg(a, R13);
+  popReg(a, R12);
+  popReg(a, RBP);
+  popReg(a, RBX);
+}
+
+static void saveRegisters(Assembler* a) {
+  pushRegisters(a);
+  addImm(a, RSP, -8); // keep calls 16 byte aligned
+}
+
+static void emitEpilogue(Assembler* a) {
+  addImm(a, RSP, 8);
+  popRegisters(a);
+  emit8(a, 0xC3); // ret
+}
+
+// the body is called, not jumped to, so its stubs just return and
+// jitted callers can call a body directly.
+static void emitPrologue(Assembler* a) {
+  pushRegisters(a);
+  movReg(a, FRAME, RSI);
+  movLoad(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+  movImm(a, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+  movLoad(a, STACK_TOP, RCX, 0);
+  movImm(a, QNAN_REG, QNAN);
+  emit8(a, 0xFF);
+  emit8(a, 0xD7); // call rdi
+  popRegisters(a);
+  emit8(a, 0xC3); // ret
+}
+
+// copy the assembled code to fresh pages and make them executable,
+// NULL when either fails.
+static uint8_t* commitCode(Assembler* a, size_t* size) {
+  *size = ((size_t)a->count + 4095) & ~(size_t)4095;
+  uint8_t* code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) return NULL;
+  memcpy(code, a->buf, a->count);
+  // code that can't be made executable is dropped, the function stays
+  // with the interpreter
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+}
+
+NativeCode* jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler a;
+  a.function = function;
+  a.chunk = chunk;
+  a.buf = NULL;
+  a.count = 0;
+  a.capacity = 0;
+  a.jumps = NULL;
+  a.jumpCount = 0;
+  a.jumpCapacity = 0;
+  a.entries = calloc(chunk->count, sizeof(uint32_t));
+  a.needsExit = calloc(chunk->count, sizeof(bool));
+  uint32_t* exits = calloc(chunk->count, sizeof(uint32_t));
+  if (a.entries == NULL || a.needsExit == NULL || exits == NULL) exit(1);
+
+  emitPrologue(&a);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    a.entries[offset] = a.count;
+    compileInstruction(&a, offset);
+  }
+
+  // side exits, rax carries the ip to resume at
+  int exitStub = -1;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (!a.needsExit[offset]) continue;
+    exits[offset] = a.count;
+    movImm(&a, RAX, (uint64_t)(uintptr_t)&chunk->code[offset]);
+    if (exitStub < 0) {
+      exitStub = a.count;
+      movStore(&a, FRAME, offsetof(CallFrame, ip), RAX);
+      movImm(&a, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+      movStore(&a, RCX, 0, STACK_TOP);
+      emit8(&a, 0x31);
+      emit8(&a, 0xC0); // xor eax, eax: CODE_EXIT
+      emit8(&a, 0xC3); // ret
+    } else {
+      emit8(&a, 0xE9);
+      emit32(&a, 0);
+      patchAt(&a, a.count - 4, exitStub);
+    }
+  }
+
+  // a helper already reported the error, just unwind
+  int errorStub = a.count;
+  emit8(&a, 0xB8);
+  emit32(&a, CODE_ERROR); // mov eax, CODE_ERROR
+  emit8(&a, 0xC3); // ret
+
+  // vmReturn() already popped the frame
+  int returnStub = a.count;
+  emit8(&a, 0xB8);
+  emit32(&a, CODE_RETURNED);
+  emit8(&a, 0xC3); // ret
+
+  for (int i = 0; i < a.jumpCount; i++) {
+    JitJump* jump = &a.jumps[i];
+    switch (jump->kind) {
+    case JUMP_BYTECODE: patchAt(&a, jump->at, a.entries[jump->target]); break;
+    case JUMP_EXIT:     patchAt(&a, jump->at, exits[jump->target]); break;
+    case JUMP_ERROR:    patchAt(&a, jump->at, errorStub); break;
+    case JUMP_RETURN:   patchAt(&a, jump->at, returnStub); break;
+    }
+  }
+
+  size_t size;
+  uint8_t* code = commitCode(&a, &size);
+  NativeCode* native = NULL;
+  if (code != NULL) {
+    native = ALLOCATE(NativeCode, 1);
+    native->code = code;
+    native->size = size;
+    native->count = chunk->count;
+    native->entries = ALLOCATE(uint32_t, chunk->count);
+    memcpy(native->entries, a.entries, sizeof(uint32_t) * chunk->count);
+    vm.jitCompiled++;
+    vm.jitBytes += a.count;
+  }
+
+  free(a.buf);
+  free(a.jumps);
+  free(a.entries);
+  free(a.needsExit);
+  free(exits);
+  return native;
+}
+
+void jitFree(NativeCode* native) {
+  munmap(native->code, native->size);
+  FREE_ARRAY(uint32_t, native->entries, native->count);
+  FREE(NativeCode, native);
+}
+
+int jitEnter(CallFrame* frame) {
+  NativeCode* native = frame->closure->function->native;
+  int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+  JitEntry entry = (JitEntry)(void*)native->code;
+  return entry(native->code + native->entries[offset], frame);
+}
+
+// traces
+//
+// a loop header that keeps coming around gets a trace. the recorder
+// runs one iteration itself, noting every instruction and the way each
+// branch went, and that iteration is compiled to straight line code
+// jumping back to its own start. type checks and the branches the
+// recording didn't take become guards, which rebuild the frame for the
+// instruction to resume at and leave to the interpreter.
+//
+// the stack is kept abstract while compiling: a temporary is a constant,
+// an unboxed number in an xmm register or a boxed value in a general
+// register, and only gets written out when a guard leaves. constants
+// fold, and a value checked to be a number stays known as one. numeric
+// variables the loop carries around live in xmm8-15 for the whole trace,
+// checked once on entry.
+//
+// registers in a trace:
+//   rbx        vm.globalValues.values
+//   r12        frame->slots
+//   r14        the CallFrame
+//   r15        QNAN
+//   xmm2-7     number temporaries, by stack depth
+//   rsi, rdi, r8-r11  boxed temporaries, by stack depth
+//   xmm8-15    variables
+
+#define TRACE_THRESHOLD 64   // iterations before a loop is recorded
+#define MAX_TRACE_ABORTS 4   // failed recordings before a loop is left alone
+#define MAX_TRACE_LENGTH 256 // instructions in a trace
+#define MAX_TRACE_TEMPS 6
+#define MAX_TRACE_VARS 32
+#define TRACE_VAR_REGS 8
+
+#define GLOBALS RBX
+#define TEMP_XMM(depth) (2 + (depth))
+
+static const int boxRegs[MAX_TRACE_TEMPS] = { RSI, RDI, R8, R9, R10, R11 };
+
+typedef struct {
+  int offset;
+  bool taken; // which way a branch went
+} TraceStep;
+
+typedef enum {
+  TEMP_CONST,  // known while compiling
+  TEMP_NUMBER, // unboxed in its xmm register
+  TEMP_BOXED,  // in its general register
+} TempKind;
+
+typedef struct {
+  TempKind kind;
+  Value value; // TEMP_CONST
+  int var;     // the variable it was read from and still equals, or -1
+} Temp;
+
+typedef struct {
+  bool global;
+  int index;
+  int reg;    // xmm register holding it for the whole trace, or -1
+  bool known; // its memory holds a number, checked this iteration
+  bool mixed; // assigned something that may not be a number
+} TraceVar;
+
+typedef struct {
+  int at;     // rel32 of the jump to the exit
+  int offset; // instruction to resume at, -1 when leaving from the entry
+  int depth;
+  Temp stack[MAX_TRACE_TEMPS];
+} TraceExit;
+
+typedef struct {
+  Assembler a;
+  int height; // stack slots the frame uses at the loop header
+  int base;   // depth when the current instruction started
+  int depth;
+  Temp stack[MAX_TRACE_TEMPS];
+  TraceVar vars[MAX_TRACE_VARS];
+  int varCount;
+  TraceExit* exits;
+  int exitCount;
+  int exitCapacity;
+  bool failed;
+} TraceCompiler;
+
+typedef int (*TraceEntry)(CallFrame* frame);
+
+static bool isFalseyValue(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// run instructions from the loop header the way run() would, noting
+// each, until the loop comes back around. stops before anything the
+// trace compiler can't handle or that would fail, with the frame ready
+// for the interpreter to go on from there.
+static bool recordTrace(CallFrame* frame, int header, int height,
+    TraceStep* steps, int* count) {
+  Chunk* chunk = &frame->closure->function->chunk;
+  Value* slots = frame->slots;
+  Value* constants = chunk->constants.values;
+  Value* globals = vm.globalValues.values;
+  *count = 0;
+
+#define BOTH_NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))
+#define RECORD_BINARY(valueType, op) do { \
+    if (!BOTH_NUMBERS(top[-2], top[-1])) return false; \
+    top[-2] = valueType(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1])); \
+    vm.stackTop--; \
+  } while (false)
+#define RECORD_NEGATED(op) do { \
+    if (!BOTH_NUMBERS(top[-2], top[-1])) return false; \
+    top[-2] = BOOL_VAL(!(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1]))); \
+    vm.stackTop--; \
+  } while (false)
+
+  for (;;) {
+    uint8_t* code = frame->ip;
+    int offset = (int)(code - chunk->code);
+    int size = instructionSize(chunk, offset);
+    Value* top = vm.stackTop;
+    int depth = (int)(top - slots) - height;
+    bool taken = false;
+
+    // an instruction pushes at most two temporaries while compiled
+    if (*count == MAX_TRACE_LENGTH) return false;
+    if (depth < 0 || depth > MAX_TRACE_TEMPS - 2) return false;
+
+    switch (code[0]) {
+    case OP_CONSTANT: *vm.stackTop++ = constants[code[1]]; break;
+    case OP_CONSTANT_LONG:
+      *vm.stackTop++ = constants[longConstant(code)];
+      break;
+    case OP_NIL:      *vm.stackTop++ = NIL_VAL; break;
+    case OP_TRUE:     *vm.stackTop++ = TRUE_VAL; break;
+    case OP_FALSE:    *vm.stackTop++ = FALSE_VAL; break;
+    case OP_POP:      vm.stackTop--; break;
+    case OP_POPN:     vm.stackTop -= code[1]; break;
+    case OP_DUP:      *vm.stackTop++ = top[-1]; break;
+    case OP_GET_LOCAL: *vm.stackTop++ = slots[code[1]]; break;
+    case OP_SET_LOCAL: slots[code[1]] = top[-1]; break;
+    case OP_GET_LOCAL_LONG:
+      *vm.stackTop++ = slots[(code[1] << 8) | code[2]];
+      break;
+    case OP_SET_LOCAL_LONG: slots[(code[1] << 8) | code[2]] = top[-1]; break;
+    case OP_GET_GLOBAL: {
+      Value value = globals[(code[1] << 8) | code[2]];
+      if (IS_UNDEFINED(value)) return false;
+      *vm.stackTop++ = value;
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      Value* global = &globals[(code[1] << 8) | code[2]];
+      if (IS_UNDEFINED(*global)) return false;
+      *global = top[-1];
+      break;
+    }
+    case OP_GET_UPVALUE:
+      *vm.stackTop++ = *frame->closure->upvalues[code[1]]->location;
+      break;
+    case OP_SET_UPVALUE:
+      *frame->closure->upvalues[code[1]]->location = top[-1];
+      break;
+    case OP_GET_INDEX:
+    case OP_SET_INDEX: {
+      Value* operands = code[0] == OP_GET_INDEX ? &top[-2] : &top[-3];
+      if (!IS_LIST(operands[0]) || !IS_NUMBER(operands[1])) return false;
+      ObjList* list = AS_LIST(operands[0]);
+      int index = (int)AS_NUMBER(operands[1]);
+      if (index < 0 || index >= list->array.count) return false;
+      if (code[0] == OP_GET_INDEX) {
+        top[-2] = list->array.values[index];
+        vm.stackTop--;
+      } else {
+        list->array.values[index] = top[-1];
+        writeBarrier((Obj*)list, top[-1]);
+        vm.stackTop -= 2;
+      }
+      break;
+    }
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+      top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]));
+      vm.stackTop--;
+      break;
+    case OP_NOT_EQUAL:
+      top[-2] = BOOL_VAL(!valuesEqual(top[-2], top[-1]));
+      vm.stackTop--;
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:  RECORD_BINARY(BOOL_VAL, >); break;
+    case OP_LESS:
+    case OP_LESS_NUM:     RECORD_BINARY(BOOL_VAL, <); break;
+    case OP_LESS_EQUAL:   RECORD_NEGATED(>); break;
+    case OP_GREATER_EQUAL: RECORD_NEGATED(<); break;
+    case OP_ADD:
+    case OP_ADD_NUM:      RECORD_BINARY(NUMBER_VAL, +); break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM: RECORD_BINARY(NUMBER_VAL, -); break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM: RECORD_BINARY(NUMBER_VAL, *); break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:   RECORD_BINARY(NUMBER_VAL, /); break;
+    case OP_INC:
+    case OP_DEC:
+      if (!IS_NUMBER(top[-1])) return false;
+      top[-1] = NUMBER_VAL(code[0] == OP_INC ?
+        AS_NUMBER(top[-1]) + 1 : AS_NUMBER(top[-1]) - 1);
+      break;
+    case OP_NOT:
+      top[-1] = BOOL_VAL(isFalseyValue(top[-1]));
+      break;
+    case OP_NEGATE:
+      if (!IS_NUMBER(top[-1])) return false;
+      top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));
+      break;
+    case OP_JUMP:
+      size += (code[1] << 8) | code[2];
+      break;
+    case OP_JUMP_IF_FALSE:
+      taken = isFalseyValue(top[-1]);
+      if (taken) size += (code[1] << 8) | code[2];
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      taken = isFalseyValue(top[-1]);
+      vm.stackTop--;
+      if (taken) size += (code[1] << 8) | code[2];
+      break;
+    case OP_LOOP:
+      // a for loop's body jumps back to the increment, which jumps back
+      // to the condition. only coming back to header closes the trace.
+      size -= (code[1] << 8) | code[2];
+      if (offset + size == header) {
+        steps[(*count)++] = (TraceStep){ offset, false };
+        frame->ip = &chunk->code[header];
+        return true;
+      }
+      break;
+    case OP_ADD_LOCALS: {
+      Value a = slots[code[1]];
+      Value b = slots[code[2]];
+      if (!BOTH_NUMBERS(a, b)) return false;
+      *vm.stackTop++ = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      break;
+    }
+    case OP_LESS_LOCAL_CONST_JUMP: {
+      Value a = slots[code[1]];
+      Value b = constants[code[2]];
+      if (!BOTH_NUMBERS(a, b)) return false;
+      taken = !(AS_NUMBER(a) < AS_NUMBER(b));
+      if (taken) size += (code[3] << 8) | code[4];
+      break;
+    }
+    case OP_FOR_PREP: {
+      Value a = slots[code[1]];
+      Value b = slots[code[2]];
+      if (!BOTH_NUMBERS(a, b)) return false;
+      taken = !(AS_NUMBER(a) < AS_NUMBER(b));
+      if (taken) size += (code[3] << 8) | code[4];
+      break;
+    }
+    case OP_FOR_LOOP: {
+      Value* slot = &slots[code[1]];
+      Value limit = slots[code[2]];
+      if (!BOTH_NUMBERS(*slot, limit)) return false;
+      *slot = NUMBER_VAL(AS_NUMBER(*slot) + 1);
+      taken = AS_NUMBER(*slot) < AS_NUMBER(limit);
+      if (taken) size -= (code[3] << 8) | code[4];
+      if (taken && offset + size == header) {
+        steps[(*count)++] = (TraceStep){ offset, true };
+        frame->ip = &chunk->code[header];
+        return true;
+      }
+      break;
+    }
+    case OP_INC_LOCAL:
+    case OP_DEC_LOCAL: {
+      Value* slot = &slots[code[1]];
+      if (!IS_NUMBER(*slot)) return false;
+      *slot = NUMBER_VAL(code[0] == OP_INC_LOCAL ?
+        AS_NUMBER(*slot) + 1 : AS_NUMBER(*slot) - 1);
+      break;
+    }
+    case OP_SET_LOCAL_POP:
+      slots[code[1]] = *--vm.stackTop;
+      break;
+    default:
+      return false;
+    }
+
+    steps[(*count)++] = (TraceStep){ offset, taken };
+    frame->ip = code + size;
+  }
+
+#undef BOTH_NUMBERS
+#undef RECORD_BINARY
+#undef RECORD_NEGATED
+}
+
+static void initTraceCompiler(TraceCompiler* tc, Chunk* chunk,
+    int height) {
+  tc->a.function = NULL;
+  tc->a.chunk = chunk;
+  tc->a.buf = NULL;
+  tc->a.count = 0;
+  tc->a.capacity = 0;
+  tc->a.jumps = NULL;
+  tc->a.jumpCount = 0;
+  tc->a.jumpCapacity = 0;
+  tc->a.entries = NULL;
+  tc->a.needsExit = NULL;
+  tc->height = height;
+  tc->base = 0;
+  tc->depth = 0;
+  tc->varCount = 0;
+  tc->exits = NULL;
+  tc->exitCount = 0;
+  tc->exitCapacity = 0;
+  tc->failed = false;
+}
+
+static void freeTraceCompiler(TraceCompiler* tc) {
+  free(tc->a.buf);
+  free(tc->exits);
+}
+
+// leave for offset when cc holds (always for cc < 0), with the stack as
+// it was before the current instruction.
+static void guard(TraceCompiler* tc, int cc, int offset) {
+  int at = cc < 0 ? jmpLocal(&tc->a) : jccLocal(&tc->a, cc);
+  if (tc->exitCapacity < tc->exitCount + 1) {
+    tc->exitCapacity = GROW_CAPACITY(tc->exitCapacity);
+    tc->exits = realloc(tc->exits, sizeof(TraceExit) * tc->exitCapacity);
+    if (tc->exits == NULL) exit(1);
+  }
+  TraceExit* exit = &tc->exits[tc->exitCount++];
+  exit->at = at;
+  exit->offset = offset;
+  exit->depth = tc->base;
+  memcpy(exit->stack, tc->stack, sizeof(Temp) * tc->base);
+}
+
+static void guardNumber(TraceCompiler* tc, int reg, int offset) {
+  movReg(&tc->a, RCX, reg);
+  alu(&tc->a, ALU_AND, RCX, QNAN_REG);
+  alu(&tc->a, ALU_CMP, RCX, QNAN_REG);
+  guard(tc, CC_E, offset);
+}
+
+static bool isNumeric(Temp* temp) {
+  return temp->kind == TEMP_NUMBER ||
+    (temp->kind == TEMP_CONST && IS_NUMBER(temp->value));
+}
+
+static void pushTemp(TraceCompiler* tc, TempKind kind, Value value,
+    int var) {
+  if (tc->depth == MAX_TRACE_TEMPS) {
+    tc->failed = true;
+    return;
+  }
+  tc->stack[tc->depth++] = (Temp){ kind, value, var };
+}
+
+// boxed temp at depth into gpr
+static void boxTemp(Assembler* a, Temp* temp, int depth, int gpr) {
+  switch (temp->kind) {
+  case TEMP_CONST:  movImm(a, gpr, temp->value); break;
+  case TEMP_NUMBER: movqFromXmm(a, gpr, TEMP_XMM(depth)); break;
+  case TEMP_BOXED:
+    if (gpr != boxRegs[depth]) movReg(a, gpr, boxRegs[depth]);
+    break;
+  }
+}
+
+// the number in temp i into xmm, leaving if it is something else.
+static void numberTo(TraceCompiler* tc, int i, int xmm, int offset) {
+  Temp* temp = &tc->stack[i];
+  switch (temp->kind) {
+  case TEMP_CONST:
+    if (!IS_NUMBER(temp->value)) {
+      tc->failed = true;
+      return;
+    }
+    movImm(&tc->a, RAX, temp->value);
+    movqToXmm(&tc->a, xmm, RAX);
+    break;
+  case TEMP_NUMBER:
+    movapd(&tc->a, xmm, TEMP_XMM(i));
+    break;
+  case TEMP_BOXED:
+    guardNumber(tc, boxRegs[i], offset);
+    movqToXmm(&tc->a, xmm, boxRegs[i]);
+    if (temp->var >= 0) tc->vars[temp->var].known = true;
+    break;
+  }
+}
+
+// copy temp from to temp to, which may be a new one on top.
+static void copyTemp(TraceCompiler* tc, int to, int from) {
+  Temp temp = tc->stack[from];
+  if (temp.kind == TEMP_NUMBER) movapd(&tc->a, TEMP_XMM(to), TEMP_XMM(from));
+  if (temp.kind == TEMP_BOXED) movReg(&tc->a, boxRegs[to], boxRegs[from]);
+  if (to == tc->depth) {
+    pushTemp(tc, temp.kind, temp.value, temp.var);
+  } else {
+    tc->stack[to] = temp;
+  }
+}
+
+static int traceVar(TraceCompiler* tc, bool global, int index) {
+  for (int i = 0; i < tc->varCount; i++) {
+    if (tc->vars[i].global == global && tc->vars[i].index == index) {
+      return i;
+    }
+  }
+  if (tc->varCount == MAX_TRACE_VARS) {
+    tc->failed = true;
+    return 0;
+  }
+  tc->vars[tc->varCount] = (TraceVar){ global, index, -1, false, false };
+  return tc->varCount++;
+}
+
+static int varBase(TraceVar* var) {
+  return var->global ? GLOBALS : SLOTS;
+}
+
+static void readVar(TraceCompiler* tc, int v) {
+  TraceVar* var = &tc->vars[v];
+  int depth = tc->depth;
+  if (tc->failed) return;
+  if (var->reg >= 0) {
+    movapd(&tc->a, TEMP_XMM(depth), var->reg);
+    pushTemp(tc, TEMP_NUMBER, NIL_VAL, v);
+    return;
+  }
+
+  // globals were checked to be defined on entry
+  movLoad(&tc->a, RAX, varBase(var), var->index * 8);
+  if (var->known) {
+    movqToXmm(&tc->a, TEMP_XMM(depth), RAX);
+    pushTemp(tc, TEMP_NUMBER, NIL_VAL, v);
+  } else {
+    movReg(&tc->a, boxRegs[depth], RAX);
+    pushTemp(tc, TEMP_BOXED, NIL_VAL, v);
+  }
+}
+
+// assign temp i to variable v. like the instructions, this leaves the
+// temp where it is.
+static void writeVar(TraceCompiler* tc, int v, int i, int offset) {
+  TraceVar* var = &tc->vars[v];
+  Temp* temp = &tc->stack[i];
+  if (tc->failed) return;
+  if (!isNumeric(temp)) var->mixed = true;
+
+  if (var->reg >= 0) {
+    // anything but a number sends compileTrace() round again with v
+    // back in memory, the code just has to stay well formed until then
+    if (temp->kind == TEMP_BOXED) {
+      guardNumber(tc, boxRegs[i], offset);
+      movqToXmm(&tc->a, var->reg, boxRegs[i]);
+    } else if (isNumeric(temp)) {
+      numberTo(tc, i, var->reg, offset);
+    }
+  } else {
+    boxTemp(&tc->a, temp, i, RAX);
+    movStore(&tc->a, varBase(var), var->index * 8, RAX);
+    var->known = isNumeric(temp);
+  }
+
+  for (int j = 0; j < tc->depth; j++) {
+    if (j != i && tc->stack[j].var == v) tc->stack[j].var = -1;
+  }
+  temp->var = v;
+}
+
+// slots below the height at the loop header are variables, the ones
+// above are the temporaries of block scoped locals.
+static void readSlot(TraceCompiler* tc, int slot) {
+  if (slot < tc->height) {
+    readVar(tc, traceVar(tc, false, slot));
+  } else {
+    copyTemp(tc, tc->depth, slot - tc->height);
+  }
+}
+
+static void writeSlot(TraceCompiler* tc, int slot, int offset) {
+  if (slot < tc->height) {
+    writeVar(tc, traceVar(tc, false, slot), tc->depth - 1, offset);
+  } else {
+    copyTemp(tc, slot - tc->height, tc->depth - 1);
+  }
+}
+
+static void arithmeticTemps(TraceCompiler* tc, uint8_t op, int offset) {
+  int i = tc->depth - 2;
+  Temp* x = &tc->stack[i];
+  Temp* y = &tc->stack[i + 1];
+  if (x->kind == TEMP_CONST && y->kind == TEMP_CONST &&
+      IS_NUMBER(x->value) && IS_NUMBER(y->value)) {
+    double a = AS_NUMBER(x->value);
+    double b = AS_NUMBER(y->value);
+    double result = op == SSE_ADD ? a + b : op == SSE_SUB ? a - b :
+      op == SSE_MUL ? a * b : a / b;
+    *x = (Temp){ TEMP_CONST, NUMBER_VAL(result), -1 };
+    tc->depth--;
+    return;
+  }
+
+  // in place, y first so that x is still intact if y's guard leaves
+  int src = TEMP_XMM(i + 1);
+  if (y->kind != TEMP_NUMBER) {
+    numberTo(tc, i + 1, 1, offset);
+    src = 1;
+  }
+  if (x->kind != TEMP_NUMBER) numberTo(tc, i, TEMP_XMM(i), offset);
+  sse(&tc->a, op, TEMP_XMM(i), src);
+  *x = (Temp){ TEMP_NUMBER, NIL_VAL, -1 };
+  tc->depth--;
+}
+
+static void compareTemps(TraceCompiler* tc, bool less, bool negated,
+    int offset) {
+  int i = tc->depth - 2;
+  Temp* x = &tc->stack[i];
+  Temp* y = &tc->stack[i + 1];
+  if (x->kind == TEMP_CONST && y->kind == TEMP_CONST &&
+      IS_NUMBER(x->value) && IS_NUMBER(y->value)) {
+    double a = AS_NUMBER(x->value);
+    double b = AS_NUMBER(y->value);
+    bool result = less ? a < b : a > b;
+    *x = (Temp){ TEMP_CONST, BOOL_VAL(negated ? !result : result), -1 };
+    tc->depth--;
+    return;
+  }
+
+  numberTo(tc, i, 0, offset);
+  numberTo(tc, i + 1, 1, offset);
+  if (less) {
+    ucomisd(&tc->a, 1, 0);
+  } else {
+    ucomisd(&tc->a, 0, 1);
+  }
+  boolFromFlags(&tc->a, negated ? CC_A : CC_BE);
+  movReg(&tc->a, boxRegs[i], RAX);
+  *x = (Temp){ TEMP_BOXED, NIL_VAL, -1 };
+  tc->depth--;
+}
+
+static void equalTemps(TraceCompiler* tc) {
+  int i = tc->depth - 2;
+  Temp* x = &tc->stack[i];
+  Temp* y = &tc->stack[i + 1];
+  if (x->kind == TEMP_CONST && y->kind == TEMP_CONST) {
+    *x = (Temp){ TEMP_CONST, BOOL_VAL(valuesEqual(x->value, y->value)), -1 };
+    tc->depth--;
+    return;
+  }
+
+  boxTemp(&tc->a, x, i, RAX);
+  boxTemp(&tc->a, y, i + 1, RDX);
+  equalValues(&tc->a);
+  movReg(&tc->a, boxRegs[i], RAX);
+  *x = (Temp){ TEMP_BOXED, NIL_VAL, -1 };
+  tc->depth--;
+}
+
+static void notTemp(TraceCompiler* tc) {
+  int i = tc->depth - 1;
+  Temp* x = &tc->stack[i];
+  if (x->kind != TEMP_BOXED) {
+    // numbers are never falsey
+    bool falsey = x->kind == TEMP_CONST && isFalseyValue(x->value);
+    *x = (Temp){ TEMP_CONST, BOOL_VAL(falsey), -1 };
+    return;
+  }
+
+  Assembler* a = &tc->a;
+  movImm(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, boxRegs[i], RCX);
+  int isNil = jccLocal(a, CC_E);
+  movImm(a, RCX, FALSE_VAL);
+  alu(a, ALU_CMP, boxRegs[i], RCX);
+  int isFalse = jccLocal(a, CC_E);
+  movImm(a, boxRegs[i], FALSE_VAL);
+  int done = jmpLocal(a);
+  patchHere(a, isNil);
+  patchHere(a, isFalse);
+  movImm(a, boxRegs[i], TRUE_VAL);
+  patchHere(a, done);
+  x->var = -1;
+}
+
+static void negateTemp(TraceCompiler* tc, int offset) {
+  int i = tc->depth - 1;
+  Temp* x = &tc->stack[i];
+  if (x->kind == TEMP_CONST && IS_NUMBER(x->value)) {
+    x->value = NUMBER_VAL(-AS_NUMBER(x->value));
+    x->var = -1;
+    return;
+  }
+
+  numberTo(tc, i, 0, offset);
+  movImm(&tc->a, RAX, SIGN_BIT);
+  movqToXmm(&tc->a, 1, RAX);
+  xorpd(&tc->a, 0, 1);
+  movapd(&tc->a, TEMP_XMM(i), 0);
+  *x = (Temp){ TEMP_NUMBER, NIL_VAL, -1 };
+}
+
+// the recording went one way on the truthiness of temp i, leave for
+// other when it would go the other way.
+static void branchOn(TraceCompiler* tc, int i, bool taken, int other) {
+  Temp* x = &tc->stack[i];
+  if (x->kind != TEMP_BOXED) {
+    bool falsey = x->kind == TEMP_CONST && isFalseyValue(x->value);
+    if (falsey != taken) tc->failed = true;
+    return;
+  }
+
+  Assembler* a = &tc->a;
+  movImm(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, boxRegs[i], RCX);
+  if (!taken) {
+    guard(tc, CC_E, other);
+    movImm(a, RCX, FALSE_VAL);
+    alu(a, ALU_CMP, boxRegs[i], RCX);
+    guard(tc, CC_E, other);
+  } else {
+    int isNil = jccLocal(a, CC_E);
+    movImm(a, RCX, FALSE_VAL);
+    alu(a, ALU_CMP, boxRegs[i], RCX);
+    int isFalse = jccLocal(a, CC_E);
+    guard(tc, -1, other);
+    patchHere(a, isNil);
+    patchHere(a, isFalse);
+  }
+}
+
+// rcx = the address of the element of list temp i at the index in xmm0,
+// leaving unless it is a list and the index is in range.
+static void listElement(TraceCompiler* tc, int i, int offset) {
+  Assembler* a = &tc->a;
+  if (tc->stack[i].kind != TEMP_BOXED) {
+    tc->failed = true;
+    return;
+  }
+
+  movReg(a, RCX, boxRegs[i]);
+  movImm(a, RDX, SIGN_BIT | QNAN);
+  alu(a, ALU_AND, RCX, RDX);
+  alu(a, ALU_CMP, RCX, RDX);
+  guard(tc, CC_NE, offset);
+  movReg(a, RCX, boxRegs[i]);
+  movImm(a, RDX, ~(SIGN_BIT | QNAN));
+  alu(a, ALU_AND, RCX, RDX);
+  cmpMem32(a, RCX, offsetof(Obj, type), OBJ_LIST);
+  guard(tc, CC_NE, offset);
+
+  // negative indexes wrap around to above the count
+  cvttsd2si(a, RAX, 0);
+  movLoad32(a, RDX, RCX,
+    offsetof(ObjList, array) + offsetof(ValueArray, count));
+  alu(a, ALU_CMP, RAX, RDX);
+  guard(tc, CC_AE, offset);
+  movLoad(a, RCX, RCX,
+    offsetof(ObjList, array) + offsetof(ValueArray, values));
+  shlImm(a, RAX, 3);
+  alu(a, ALU_ADD, RCX, RAX);
+}
+
+// leaves before a young object is stored into list temp i when the
+// list is old, run() then does the store and remembers the list. the
+// value is in rax afterwards.
+static void listBarrier(TraceCompiler* tc, int i, Temp* value, int depth,
+    int offset) {
+  Assembler* a = &tc->a;
+  if (isNumeric(value) ||
+      (value->kind == TEMP_CONST && !IS_OBJ(value->value))) {
+    boxTemp(a, value, depth, RAX);
+    return;
+  }
+
+  movImm(a, RDX, ~(SIGN_BIT | QNAN));
+  alu(a, ALU_AND, RDX, boxRegs[i]);
+  cmpMem8(a, RDX, offsetof(Obj, generation), GEN_OLD);
+  int notOld = jccLocal(a, CC_NE);
+  boxTemp(a, value, depth, RAX);
+  movImm(a, RDX, SIGN_BIT | QNAN);
+  alu(a, ALU_AND, RAX, RDX);
+  alu(a, ALU_CMP, RAX, RDX);
+  int notObject = jccLocal(a, CC_NE);
+  boxTemp(a, value, depth, RAX);
+  movImm(a, RDX, ~(SIGN_BIT | QNAN));
+  alu(a, ALU_AND, RAX, RDX);
+  cmpMem8(a, RAX, offsetof(Obj, generation), GEN_YOUNG);
+  guard(tc, CC_E, offset);
+  patchHere(a, notOld);
+  patchHere(a, notObject);
+  boxTemp(a, value, depth, RAX);
+}
+
+static void compileStep(TraceCompiler* tc, TraceStep* step) {
+  Chunk* chunk = tc->a.chunk;
+  int offset = step->offset;
+  uint8_t* code = &chunk->code[offset];
+  int size = instructionSize(chunk, offset);
+  Value* constants = chunk->constants.values;
+  tc->base = tc->depth;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    pushTemp(tc, TEMP_CONST, constants[code[1]], -1);
+    break;
+  case OP_NIL:   pushTemp(tc, TEMP_CONST, NIL_VAL, -1); break;
+  case OP_TRUE:  pushTemp(tc, TEMP_CONST, TRUE_VAL, -1); break;
+  case OP_FALSE: pushTemp(tc, TEMP_CONST, FALSE_VAL, -1); break;
+  case OP_POP:   tc->depth--; break;
+  case OP_POPN:  tc->depth -= code[1]; break;
+  case OP_DUP:   copyTemp(tc, tc->depth, tc->depth - 1); break;
+  case OP_GET_LOCAL: readSlot(tc, code[1]); break;
+  case OP_SET_LOCAL: writeSlot(tc, code[1], offset); break;
+  case OP_CONSTANT_LONG:
+    pushTemp(tc, TEMP_CONST, constants[longConstant(code)], -1);
+    break;
+  case OP_GET_LOCAL_LONG: readSlot(tc, (code[1] << 8) | code[2]); break;
+  case OP_SET_LOCAL_LONG:
+    writeSlot(tc, (code[1] << 8) | code[2], offset);
+    break;
+  case OP_GET_GLOBAL:
+    readVar(tc, traceVar(tc, true, (code[1] << 8) | code[2]));
+    break;
+  case OP_SET_GLOBAL:
+    writeVar(tc, traceVar(tc, true, (code[1] << 8) | code[2]),
+      tc->depth - 1, offset);
+    break;
+  case OP_GET_UPVALUE:
+    loadUpvalueLocation(&tc->a, RCX, code[1]);
+    movLoad(&tc->a, boxRegs[tc->depth], RCX, 0);
+    pushTemp(tc, TEMP_BOXED, NIL_VAL, -1);
+    break;
+  case OP_SET_UPVALUE:
+    boxTemp(&tc->a, &tc->stack[tc->depth - 1], tc->depth - 1, RAX);
+    loadUpvalueLocation(&tc->a, RCX, code[1]);
+    movStore(&tc->a, RCX, 0, RAX);
+    break;
+  case OP_GET_INDEX: {
+    int i = tc->depth - 2;
+    numberTo(tc, i + 1, 0, offset);
+    listElement(tc, i, offset);
+    movLoad(&tc->a, boxRegs[i], RCX, 0);
+    tc->stack[i] = (Temp){ TEMP_BOXED, NIL_VAL, -1 };
+    tc->depth--;
+    break;
+  }
+  case OP_SET_INDEX: {
+    // leaves the list, as run() does
+    int i = tc->depth - 3;
+    numberTo(tc, i + 1, 0, offset);
+    listElement(tc, i, offset);
+    listBarrier(tc, i, &tc->stack[i + 2], i + 2, offset);
+    movStore(&tc->a, RCX, 0, RAX);
+    tc->depth -= 2;
+    break;
+  }
+  case OP_EQUAL:
+  case OP_EQUAL_NUM:    equalTemps(tc); break;
+  case OP_NOT_EQUAL:
+    equalTemps(tc);
+    notTemp(tc);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:  compareTemps(tc, false, false, offset); break;
+  case OP_LESS:
+  case OP_LESS_NUM:     compareTemps(tc, true, false, offset); break;
+  case OP_LESS_EQUAL:   compareTemps(tc, false, true, offset); break;
+  case OP_GREATER_EQUAL: compareTemps(tc, true, true, offset); break;
+  case OP_INC:
+  case OP_DEC:
+    pushTemp(tc, TEMP_CONST, NUMBER_VAL(1), -1);
+    arithmeticTemps(tc, code[0] == OP_INC ? SSE_ADD : SSE_SUB, offset);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:      arithmeticTemps(tc, SSE_ADD, offset); break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM: arithmeticTemps(tc, SSE_SUB, offset); break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM: arithmeticTemps(tc, SSE_MUL, offset); break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:   arithmeticTemps(tc, SSE_DIV, offset); break;
+  case OP_NOT:          notTemp(tc); break;
+  case OP_NEGATE:       negateTemp(tc, offset); break;
+  case OP_JUMP:
+  case OP_LOOP:
+    break;
+  case OP_JUMP_IF_FALSE: {
+    int jump = (code[1] << 8) | code[2];
+    branchOn(tc, tc->depth - 1, step->taken,
+      step->taken ? offset + size : offset + size + jump);
+    break;
+  }
+  case OP_POP_JUMP_IF_FALSE: {
+    // the exits leave with the condition popped, as the instruction does
+    int jump = (code[1] << 8) | code[2];
+    tc->base = --tc->depth;
+    branchOn(tc, tc->depth, step->taken,
+      step->taken ? offset + size : offset + size + jump);
+    break;
+  }
+  case OP_ADD_LOCALS:
+    readSlot(tc, code[1]);
+    readSlot(tc, code[2]);
+    arithmeticTemps(tc, SSE_ADD, offset);
+    break;
+  case OP_LESS_LOCAL_CONST_JUMP: {
+    int jump = (code[3] << 8) | code[4];
+    readSlot(tc, code[1]);
+    pushTemp(tc, TEMP_CONST, constants[code[2]], -1);
+    if (tc->failed) break;
+    numberTo(tc, tc->depth - 2, 0, offset);
+    numberTo(tc, tc->depth - 1, 1, offset);
+    ucomisd(&tc->a, 1, 0); // above when the local is less
+    if (step->taken) {
+      guard(tc, CC_A, offset + size);
+    } else {
+      guard(tc, CC_BE, offset + size + jump);
+    }
+    tc->depth -= 2;
+    break;
+  }
+  case OP_FOR_PREP: {
+    int jump = (code[3] << 8) | code[4];
+    readSlot(tc, code[1]);
+    readSlot(tc, code[2]);
+    if (tc->failed) break;
+    numberTo(tc, tc->depth - 2, 0, offset);
+    numberTo(tc, tc->depth - 1, 1, offset);
+    ucomisd(&tc->a, 1, 0); // above when the counter is less
+    if (step->taken) {
+      guard(tc, CC_A, offset + size);
+    } else {
+      guard(tc, CC_BE, offset + size + jump);
+    }
+    tc->depth -= 2;
+    break;
+  }
+  case OP_FOR_LOOP: {
+    // the limit is checked before the counter is written, the guards
+    // after that only test what is already known to be a number
+    int jump = (code[3] << 8) | code[4];
+    int limit = tc->depth;
+    readSlot(tc, code[2]);
+    if (tc->failed) break;
+    numberTo(tc, limit, 0, offset);
+    readSlot(tc, code[1]);
+    pushTemp(tc, TEMP_CONST, NUMBER_VAL(1), -1);
+    arithmeticTemps(tc, SSE_ADD, offset);
+    writeSlot(tc, code[1], offset);
+    if (tc->failed) break;
+    numberTo(tc, limit + 1, 0, offset);
+    numberTo(tc, limit, 1, offset);
+    ucomisd(&tc->a, 1, 0);
+    if (step->taken) {
+      guard(tc, CC_BE, offset + size);
+    } else {
+      guard(tc, CC_A, offset + size - jump);
+    }
+    tc->depth -= 2;
+    break;
+  }
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL:
+    readSlot(tc, code[1]);
+    pushTemp(tc, TEMP_CONST, NUMBER_VAL(1), -1);
+    arithmeticTemps(tc, code[0] == OP_INC_LOCAL ? SSE_ADD : SSE_SUB,
+      offset);
+    writeSlot(tc, code[1], offset);
+    tc->depth--;
+    break;
+  case OP_SET_LOCAL_POP:
+    writeSlot(tc, code[1], offset);
+    tc->depth--;
+    break;
+  default:
+    tc->failed = true;
+    break;
+  }
+}
+
+static void compileTraceCode(TraceCompiler* tc, TraceStep* steps,
+    int count) {
+  Assembler* a = &tc->a;
+  Chunk* chunk = a->chunk;
+
+  saveRegisters(a);
+  movReg(a, FRAME, RDI);
+  movLoad(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+  movImm(a, QNAN_REG, QNAN);
+  loadGlobals(a, GLOBALS);
+
+  // loop invariant checks: variables kept in registers are numbers and
+  // globals are defined
+  for (int i = 0; i < tc->varCount; i++) {
+    TraceVar* var = &tc->vars[i];
+    movLoad(a, RAX, varBase(var), var->index * 8);
+    if (var->reg >= 0) {
+      guardNumber(tc, RAX, -1);
+      movqToXmm(a, var->reg, RAX);
+    } else if (var->global) {
+      movImm(a, RCX, UNDEFINED_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      guard(tc, CC_E, -1);
+    }
+  }
+
+  int loop = a->count;
+  // the last step jumps back to the header, a FOR_LOOP tests first
+  for (int i = 0; i < count && !tc->failed; i++) {
+    compileStep(tc, &steps[i]);
+  }
+  if (tc->depth != 0) tc->failed = true;
+  patchAt(a, jmpLocal(a), loop);
+
+  int leave = a->count;
+  emit8(a, 0x31);
+  emit8(a, 0xC0); // xor eax, eax: CODE_EXIT
+  emitEpilogue(a);
+
+  for (int i = 0; i < tc->exitCount; i++) {
+    TraceExit* exit = &tc->exits[i];
+    if (exit->offset < 0) {
+      patchAt(a, exit->at, leave); // nothing changed yet
+      continue;
+    }
+
+    patchHere(a, exit->at);
+    for (int j = 0; j < tc->varCount; j++) {
+      TraceVar* var = &tc->vars[j];
+      if (var->reg < 0) continue;
+      movqFromXmm(a, RAX, var->reg);
+      movStore(a, varBase(var), var->index * 8, RAX);
+    }
+    for (int j = 0; j < exit->depth; j++) {
+      boxTemp(a, &exit->stack[j], j, RAX);
+      movStore(a, SLOTS, (tc->height + j) * 8, RAX);
+    }
+    movReg(a, RAX, SLOTS);
+    addImm(a, RAX, (tc->height + exit->depth) * 8);
+    movImm(a, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    movStore(a, RCX, 0, RAX);
+    movImm(a, RAX, (uint64_t)(uintptr_t)&chunk->code[exit->offset]);
+    movStore(a, FRAME, offsetof(CallFrame, ip), RAX);
+    patchAt(a, jmpLocal(a), leave);
+  }
+}
+
+static Value varValue(CallFrame* frame, TraceVar* var) {
+  return var->global ? vm.globalValues.values[var->index]
+    : frame->slots[var->index];
+}
+
+// compile the recorded iteration. variables start out optimistically in
+// registers when they hold numbers right now, and drop back to memory
+// when the loop turns out to assign them anything else.
+static bool compileTrace(Trace* trace, CallFrame* frame, TraceStep* steps,
+    int count) {
+  Chunk* chunk = &frame->closure->function->chunk;
+  TraceVar vars[MAX_TRACE_VARS];
+  int varCount = 0;
+  bool first = true;
+
+  for (;;) {
+    TraceCompiler tc;
+    initTraceCompiler(&tc, chunk, trace->height);
+    memcpy(tc.vars, vars, sizeof(TraceVar) * varCount);
+    tc.varCount = varCount;
+    compileTraceCode(&tc, steps, count);
+    if (tc.failed) {
+      freeTraceCompiler(&tc);
+      return false;
+    }
+
+    bool retry = first;
+    int regs = 0;
+    for (int i = 0; i < tc.varCount; i++) {
+      TraceVar* var = &tc.vars[i];
+      if (first) {
+        // the first round only finds the variables
+        var->reg = -1;
+        if (IS_NUMBER(varValue(frame, var)) && regs < TRACE_VAR_REGS) {
+          var->reg = 8 + regs++; // xmm8 on
+        }
+      } else if (var->reg >= 0 && var->mixed) {
+        var->reg = -1;
+        retry = true;
+      }
+      var->known = false;
+      var->mixed = false;
+    }
+    memcpy(vars, tc.vars, sizeof(TraceVar) * tc.varCount);
+    varCount = tc.varCount;
+    first = false;
+
+    if (!retry) {
+      trace->code = commitCode(&tc.a, &trace->size);
+      if (trace->code != NULL) {
+        vm.jitTraces++;
+        vm.jitBytes += tc.a.count;
+      }
+      freeTraceCompiler(&tc);
+      return trace->code != NULL;
+    }
+    freeTraceCompiler(&tc);
+  }
+}
+
+static Trace* findTrace(ObjFunction* function, int header) {
+  for (Trace* trace = function->traces; trace != NULL;
+       trace = trace->next) {
+    if (trace->header == header) return trace;
+  }
+  return NULL;
+}
+
+static void runTrace(Trace* trace, CallFrame* frame) {
+  if (vm.stackTop - frame->slots != trace->height) return;
+  ((TraceEntry)(void*)trace->code)(frame);
+}
+
+// a native loop back edge with a trace: run it, then go on natively
+// wherever it left the frame.
+static uint8_t* traceFromNative(Trace* trace, CallFrame* frame) {
+  runTrace(trace, frame);
+  ObjFunction* function = frame->closure->function;
+  int offset = (int)(frame->ip - function->chunk.code);
+  return function->native->code + function->native->entries[offset];
+}
+
+void jitLoop(CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  int header = (int)(frame->ip - function->chunk.code);
+  Trace* trace = findTrace(function, header);
+  if (trace == NULL) {
+    trace = ALLOCATE(Trace, 1);
+    trace->header = header;
+    trace->height = 0;
+    trace->hotness = 0;
+    trace->aborts = 0;
+    trace->code = NULL;
+    trace->size = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+  }
+
+  if (trace->code == NULL) {
+    if (trace->aborts >= MAX_TRACE_ABORTS) return;
+    if (++trace->hotness < TRACE_THRESHOLD) return;
+    trace->hotness = 0;
+
+    TraceStep steps[MAX_TRACE_LENGTH];
+    int count;
+    trace->height = (int)(vm.stackTop - frame->slots);
+    if (!recordTrace(frame, header, trace->height, steps, &count) ||
+        !compileTrace(trace, frame, steps, count)) {
+      // the frame is wherever the recorder stopped
+      trace->aborts++;
+      vm.jitTraceAborts++;
+      return;
+    }
+  }
+  runTrace(trace, frame);
+}
+
+void jitFreeTraces(Trace* trace) {
+  while (trace != NULL) {
+    Trace* next = trace->next;
+    if (trace->code != NULL) munmap(trace->code, trace->size);
+    FREE(Trace, trace);
+    trace = next;
+  }
+}
+
+#endif
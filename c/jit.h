@@ -0,0 +1,45 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// machine code for one function. entries maps the offset of every
+// instruction in the chunk to the native code doing the same thing, so
+// the interpreter can hand over at calls, returns and loop back edges.
+struct NativeCode {
+  uint8_t* code;
+  size_t size;
+  uint32_t* entries;
+  int count;
+};
+
+// a loop the tracer counts iterations of, by the offset of its header.
+struct Trace {
+  int header;
+  int height;  // stack slots in use at the header
+  int hotness;
+  int aborts;  // recordings that gave up
+  uint8_t* code; // NULL until recorded
+  size_t size;
+  struct Trace* next;
+};
+
+NativeCode* jitCompile(ObjFunction* function);
+void jitFree(NativeCode* native);
+// run frame natively from frame->ip until it returns or reaches an
+// instruction the jit leaves to the interpreter. returns a CodeStatus,
+// the function's compiled entry once it has native code.
+int jitEnter(CallFrame* frame);
+// the interpreter is at a loop header, frame->ip. counts the iteration,
+// records and compiles the loop once it is hot and runs its trace. the
+// frame is left wherever the interpreter has to go on.
+void jitLoop(CallFrame* frame);
+void jitFreeTraces(Trace* trace);
+
+#endif
+
+#endif
@@ -1,10 +1,20 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "aot.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl() {
@@ -21,39 +31,86 @@ static void repl() {
   }
 }
 
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
+// sources are mapped rather than read into a copy. the scanner needs a
+// '\0' after the last byte: the mapping is one byte longer than the file,
+// and its last page is anonymous when the file fills the one before.
+// NULL when path isn't a regular file, which is read as a stream.
+static char* mapFile(const char* path, size_t* mapped) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, "could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return NULL;
+  }
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "not enough memory to read \"%s\".\n", path);
-    exit(74);
+  size_t fileSize = (size_t)info.st_size;
+  char* source = mmap(NULL, fileSize + 1, PROT_READ,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (source != MAP_FAILED && fileSize > 0 &&
+      mmap(source, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+    munmap(source, fileSize + 1);
+    source = MAP_FAILED;
   }
+  close(fd);
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
+  if (source == MAP_FAILED) {
     fprintf(stderr, "could not read file \"%s\".\n", path);
     exit(74);
   }
+  *mapped = fileSize + 1;
+  return source;
+}
 
-  buffer[bytesRead] = '\0';
+// --emit-c and --compile need the whole source.
+static char* readFile(const char* path, size_t* mapped) {
+  char* source = mapFile(path, mapped);
+  if (source == NULL) {
+    fprintf(stderr, "\"%s\" isn't a regular file.\n", path);
+    exit(74);
+  }
+  return source;
+}
 
-  fclose(file);
-  return buffer;
+static InterpretResult runStream(FILE* file, const char* path) {
+  ObjFunction* function = compileStream(file);
+  if (ferror(file)) {
+    fprintf(stderr, "could not read file \"%s\".\n", path);
+    exit(74);
+  }
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(function);
 }
 
+// path "-" is stdin.
 static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result =interpret(source);
-  free(source);
+  InterpretResult result;
+  size_t mapped;
+  char* source;
+  if (strcmp(path, "-") == 0) {
+    result = runStream(stdin, path);
+  } else if ((source = mapFile(path, &mapped)) == NULL) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+      fprintf(stderr, "could not open file \"%s\".\n", path);
+      exit(74);
+    }
+    result = runStream(file, path);
+    fclose(file);
+  } else if (isBytecodeFile(path)) {
+    munmap(source, mapped);
+    ObjFunction* function = loadBytecode(path);
+    if (function == NULL) exit(65);
+    result = interpretFunction(function);
+  } else {
+    result = interpret(source);
+    munmap(source, mapped);
+  }
 
   if (result == INTERPRET_COMPILE_ERROR) {
     exit(65);
@@ -63,16 +120,123 @@ static void runFile(const char* path) {
   }
 }
 
+// clox --emit-c path, the c goes to stdout.
+static void emitFile(const char* path) {
+  size_t mapped;
+  char* source = readFile(path, &mapped);
+  bool emitted = emitC(source, path, stdout);
+  munmap(source, mapped);
+
+  if (!emitted) {
+    exit(65);
+  }
+}
+
+// clox --compile script.lox writes script.loxc next to it.
+static void compileFile(const char* path) {
+  size_t mapped;
+  char* source = readFile(path, &mapped);
+  ObjFunction* function = compile(source);
+  munmap(source, mapped);
+  if (function == NULL) exit(65);
+  push(OBJ_VAL(function)); // for collector
+
+  size_t length = strlen(path);
+  if (length > 4 && strcmp(path + length - 4, ".lox") == 0) length -= 4;
+  char* outPath = (char*)malloc(length + 6);
+  memcpy(outPath, path, length);
+  strcpy(outPath + length, ".loxc");
+
+  FILE* out = fopen(outPath, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "could not open file \"%s\".\n", outPath);
+    exit(74);
+  }
+  bool written = writeBytecode(function, out);
+  if (fclose(out) != 0 || !written) {
+    fprintf(stderr, "could not write \"%s\".\n", outPath);
+    remove(outPath);
+    exit(74);
+  }
+  free(outPath);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: clox [--jit | --reg] [--lazy] [--max-frames n] "
+    "[--image img] [path | -]\n");
+  fprintf(stderr, "       clox --emit-c path\n");
+  fprintf(stderr, "       clox --compile path\n");
+  fprintf(stderr, "       clox [--image img] --snapshot out.img path\n");
+  exit(64);
+}
+
 int main(int argc, const char *argv[]) {
   initVM();
 
-  if (argc == 1) {
+  const char* path = NULL;
+  bool emit = false;
+  bool compileOnly = false;
+  const char* image = NULL;
+  const char* snapshot = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--jit") == 0) {
+#ifdef JIT
+      vm.jit = true;
+      vm.compiledCode = true;
+#else
+      fprintf(stderr, "clox: built without the jit, ignoring --jit.\n");
+#endif
+    } else if (strcmp(argv[i], "--reg") == 0) {
+      vm.registers = true;
+      vm.compiledCode = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      vm.lazy = true;
+    } else if (strcmp(argv[i], "--max-frames") == 0) {
+      if (i + 1 == argc || atoi(argv[i + 1]) <= 0) usage();
+      vm.maxFrames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      emit = true;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "--image") == 0) {
+      if (i + 1 == argc) usage();
+      image = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0) {
+      if (i + 1 == argc) usage();
+      snapshot = argv[++i];
+    } else if ((argv[i][0] == '-' && strcmp(argv[i], "-") != 0) ||
+        path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  // the image's globals are there before anything else runs
+  if (image != NULL && !emit && !compileOnly && !loadSnapshot(image)) {
+    exit(65);
+  }
+
+  if (emit || compileOnly) {
+    // everything is compiled ahead of time there
+    vm.lazy = false;
+  }
+
+  if (emit) {
+    if (path == NULL) usage();
+    emitFile(path);
+  } else if (compileOnly) {
+    if (path == NULL) usage();
+    compileFile(path);
+  } else if (snapshot != NULL) {
+    // clox --snapshot out.img prelude.lox, the prelude's heap is saved
+    if (path == NULL) usage();
+    runFile(path);
+    if (!writeSnapshot(snapshot)) exit(74);
+  } else if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "usage: clox [path]\n");
-    exit(64);
+    runFile(path);
   }
 
   freeVM();
@@ -2,7 +2,9 @@
 #include <stdio.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "regcode.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -15,11 +17,23 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
 
   if (newSize > oldSize) {
+    vm.nurseryBytes += newSize - oldSize;
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
-#endif
-    if (vm.bytesAllocated > vm.nextGC) {
+    static int stress = 0;
+    if (++stress % 16 == 0) {
       collectGarbage();
+    } else {
+      collectNursery();
+    }
+#endif
+    // the old generation only grows by promotion, so it is looked at
+    // when the nursery fills up
+    if (vm.nurseryBytes > NURSERY_SIZE) {
+      if (vm.bytesAllocated > vm.nextGC + vm.nurseryBytes) {
+        collectGarbage();
+      } else {
+        collectNursery();
+      }
     }
   }
   if (newSize == 0) {
@@ -36,9 +50,25 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+#ifdef DEBUG_VERIFY_GC
+static Obj* verifying = NULL;
+#endif
+
 void markObject(Obj* object) {
   if (object == NULL) return;
+#ifdef DEBUG_VERIFY_GC
+  if (verifying != NULL) {
+    if (object->generation == GEN_YOUNG) {
+      fprintf(stderr, "old %p points at young %p without a barrier\n",
+        (void*)verifying, (void*)object);
+      abort();
+    }
+    return;
+  }
+#endif
   if (object->isMarked) return; //解决存在闭环的问题
+  // a minor collection leaves the old generation alone
+  if (vm.minorGC && object->generation != GEN_YOUNG) return;
 
 #ifdef DEBUG_LOG_GC
   char buf[128]={0};
@@ -68,6 +98,41 @@ void markValue(Value value) {
   markObject(AS_OBJ(value));
 }
 
+static void* growRoots(void* roots, int* capacity, int count) {
+  if (*capacity >= count + 1) return roots;
+  *capacity = GROW_CAPACITY(*capacity);
+  // not reallocate(), this mustn't start a collection
+  roots = realloc(roots, sizeof(void*) * *capacity);
+  if (roots == NULL) exit(1);
+  return roots;
+}
+
+void rememberObject(Obj* object) {
+  if (object->generation != GEN_OLD) return;
+  object->generation = GEN_REMEMBERED;
+  vm.remembered = growRoots(vm.remembered, &vm.rememberedCapacity,
+    vm.rememberedCount);
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+// caches aren't objects, and they are filled in from every backend. so
+// instead of a barrier on the function, a cache that takes a young key
+// or value is a root of the next minor collection.
+void rememberCache(InlineCache* cache) {
+  if (cache->remembered) return;
+  cache->remembered = true;
+  vm.youngCaches = growRoots(vm.youngCaches, &vm.youngCacheCapacity,
+    vm.youngCacheCount);
+  vm.youngCaches[vm.youngCacheCount++] = cache;
+}
+
+static void markCache(InlineCache* cache) {
+  for (int j = 0; j < cache->count; j++) {
+    markObject(cache->entries[j].key);
+    markValue(cache->entries[j].value);
+  }
+}
+
 static void markArray(ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
     markValue(array->values[i]);
@@ -92,6 +157,7 @@ static void blackenObject(Obj* object) {
     ObjClass* klass = (ObjClass*)object;
     markObject((Obj*)klass->name);
     markTable(&klass->methods);
+    markObject((Obj*)klass->shape);
     break;
   }
   case OBJ_CLOSURE: {
@@ -106,12 +172,33 @@ static void blackenObject(Obj* object) {
     ObjFunction* function = (ObjFunction*)object;
     markObject((Obj*)function->name);
     markArray(&function->chunk.constants);
+    if (function->lazy != NULL) markLazyBody(function->lazy);
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+      InlineCache* cache = &function->chunk.caches[i];
+      // marked from vm.youngCaches
+      if (cache->remembered) continue;
+      markCache(cache);
+    }
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance* instance = (ObjInstance*)object;
     markObject((Obj*)instance->klass);
-    markTable(&instance->fields);
+    if (instance->shape != NULL) {
+      markObject((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
+    }
+    if (instance->dict != NULL) {
+      markTable(instance->dict);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape* shape = (ObjShape*)object;
+    markTable(&shape->slots);
+    markTable(&shape->transitions);
     break;
   }
   case OBJ_UPVALUE:
@@ -160,13 +247,23 @@ static void freeObject(Obj* object) {
   }
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+    if (function->native != NULL) jitFree(function->native);
+    jitFreeTraces(function->traces);
+#endif
+    if (function->registers != NULL) freeRegCode(function->registers);
+    if (function->lazy != NULL) freeLazyBody(function->lazy);
     freeChunk(&function->chunk);
     FREE(ObjFunction, object);
     break;
   }
   case OBJ_INSTANCE: { 
     ObjInstance* instance = (ObjInstance*)object;
-    freeTable(&instance->fields);
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+    if (instance->dict != NULL) {
+      freeTable(instance->dict);
+      FREE(Table, instance->dict);
+    }
     FREE(ObjInstance, object);
     break;
   }
@@ -179,6 +276,13 @@ static void freeObject(Obj* object) {
     FREE(ObjString, object);
     break;
   }
+  case OBJ_SHAPE: {
+    ObjShape* shape = (ObjShape*)object;
+    freeTable(&shape->slots);
+    freeTable(&shape->transitions);
+    FREE(ObjShape, object);
+    break;
+  }
   case OBJ_UPVALUE:
     FREE(ObjUpvalue, object);
     break;
@@ -186,6 +290,7 @@ static void freeObject(Obj* object) {
     ObjList* list = (ObjList*)object;
     freeValueArray(&list->array);
     FREE(ObjList, list);
+    break;
   }
   case OBJ_MAP: {
     ObjMap* map = (ObjMap*)object;
@@ -210,10 +315,58 @@ static void markRoots() {
     markObject((Obj*)upvalue);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
   markCompilerRoots();
   markObject((Obj*)vm.initString);
+  markObject((Obj*)vm.listClass);
+}
+
+// once an upvalue is closed, OP_SET_UPVALUE writes it from all the
+// backends without a barrier. so an old one stays remembered.
+static bool isClosedUpvalue(Obj* object) {
+  if (object->type != OBJ_UPVALUE) return false;
+  ObjUpvalue* upvalue = (ObjUpvalue*)object;
+  return upvalue->location == &upvalue->closed;
+}
+
+static void promote(Obj* object) {
+  object->generation = GEN_OLD;
+  if (isClosedUpvalue(object)) rememberObject(object);
+}
+
+// after a collection nothing is young any more, only the closed upvalues
+// stay remembered. called before the sweep frees the dead ones.
+static void forgetRemembered() {
+  int kept = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    if (isClosedUpvalue(object)) {
+      vm.remembered[kept++] = object;
+    } else {
+      object->generation = GEN_OLD;
+    }
+  }
+  vm.rememberedCount = kept;
+
+  for (int i = 0; i < vm.youngCacheCount; i++) {
+    vm.youngCaches[i]->remembered = false;
+  }
+  vm.youngCacheCount = 0;
+}
+
+#ifdef DEBUG_VERIFY_GC
+// every old object outside vm.remembered must only point at old ones.
+static void verifyRemembered() {
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    if (object->generation != GEN_OLD) continue;
+    verifying = object;
+    blackenObject(object);
+  }
+  verifying = NULL;
 }
+#endif
 
 static void traceReferences() {
   while (vm.grayCount > 0) {
@@ -222,12 +375,35 @@ static void traceReferences() {
   }
 }
 
+// promotes the survivors into the old generation, unmarked.
+static void sweepNursery() {
+  Obj* object = vm.nursery;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->next = vm.objects;
+      vm.objects = object;
+      promote(object);
+    } else {
+      if (object->type == OBJ_STRING) {
+        tableDelete(&vm.strings, (ObjString*)object);
+      }
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm.nursery = NULL;
+  vm.nurseryBytes = 0;
+}
+
 static void sweep() {
   Obj* previous = NULL;
   Obj* object = vm.objects;
   while (object != NULL) {
     if (object->isMarked) {
       object->isMarked = false; //转换白色节点
+      promote(object);
       previous = object;
       object = object->next;
     } else {
@@ -244,16 +420,56 @@ static void sweep() {
   }
 }
 
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  vm.minorGC = true;
+  markRoots();
+#ifdef DEBUG_VERIFY_GC
+  verifyRemembered();
+#endif
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  for (int i = 0; i < vm.youngCacheCount; i++) {
+    markCache(vm.youngCaches[i]);
+  }
+  traceReferences();
+  vm.minorGC = false;
+
+  forgetRemembered();
+  sweepNursery();
+  vm.minorCollections++;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+      before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
+  // full collections trace the caches from their functions
+  forgetRemembered();
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  // closed upvalues are remembered again as they are promoted
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->generation = GEN_OLD;
+  }
+  vm.rememberedCount = 0;
   sweep();
+  sweepNursery();
+  vm.fullCollections++;
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
@@ -265,12 +481,18 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  freeList(vm.objects);
+  freeList(vm.nursery);
   free(vm.grayStack);
+  free(vm.remembered);
+  free(vm.youngCaches);
 }
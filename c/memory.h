@@ -19,10 +19,52 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// the collector is generational. new objects go on the vm.nursery list,
+// and once NURSERY_SIZE bytes were allocated since the last collection a
+// minor one traces only them, from the roots and from the old objects
+// in vm.remembered. the survivors are promoted to vm.objects where they
+// stay put: compiled code and the c stack hold raw pointers, so nothing
+// is ever moved. when the old generation has outgrown vm.nextGC the
+// collection is a full one instead.
+#define NURSERY_SIZE (1024 * 1024)
+
+#define GEN_YOUNG      0
+#define GEN_OLD        1
+#define GEN_REMEMBERED 2 // old and in vm.remembered
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
+void collectNursery();
 void freeObjects();
 
+// adds an old object to vm.remembered, the next minor collection then
+// traces it as a root. does nothing for young objects.
+void rememberObject(Obj* object);
+void rememberCache(InlineCache* cache);
+
+// every store of a reference into the heap goes through a barrier, so a
+// minor collection knows each old object that may point at a young one.
+// closed upvalues are remembered for good instead, see closeUpvalues().
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (owner->generation == GEN_OLD && IS_OBJ(value) &&
+      AS_OBJ(value)->generation == GEN_YOUNG) {
+    rememberObject(owner);
+  }
+}
+
+static inline void objectBarrier(Obj* owner, Obj* object) {
+  if (owner->generation == GEN_OLD && object != NULL &&
+      object->generation == GEN_YOUNG) {
+    rememberObject(owner);
+  }
+}
+
+// tables hold on to their keys as well
+static inline void tableBarrier(Obj* owner, ObjString* key, Value value) {
+  objectBarrier(owner, (Obj*)key);
+  writeBarrier(owner, value);
+}
+
 #endif
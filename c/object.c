@@ -15,9 +15,10 @@ static Obj* allocateObject(size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
   object->isMarked = false;
+  object->generation = GEN_YOUNG;
 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm.nursery;
+  vm.nursery = object;
 
 #ifdef DEBUG_LOG_GC
   char buf[128] = {0};
@@ -40,6 +41,12 @@ ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->shape = NULL;
+
+  push(OBJ_VAL(klass)); // for collector
+  klass->shape = newShape();
+  objectBarrier((Obj*)klass, (Obj*)klass->shape);
+  pop();
   return klass;
 }
 
@@ -61,6 +68,14 @@ ObjFunction* newFunction() {
 
   function->arity = 0;
   function->upvalueCount = 0;
+  function->frameSize = UINT8_COUNT;
+  function->deopts = 0;
+  function->hotness = 0;
+  function->native = NULL;
+  function->traces = NULL;
+  function->compiled = NULL;
+  function->registers = NULL;
+  function->lazy = NULL;
   function->name = NULL;
   initChunk(&function->chunk);
   return function;
@@ -69,7 +84,10 @@ ObjFunction* newFunction() {
 ObjInstance* newInstance(ObjClass* klass) {
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->shape;
+  instance->capacity = 0;
+  instance->fields = NULL;
+  instance->dict = NULL;
   return instance;
 }
 
@@ -139,6 +157,8 @@ void copyList(ObjList* list, Value* values, int length) {
   list->array.count = length;
   list->array.capacity = length;
   memcpy(list->array.values, values, length * sizeof(Value));
+  // the allocation above may have promoted the list
+  rememberObject((Obj*)list);
 }
 
 ObjMap* newMap() {
@@ -155,6 +175,114 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
+// past these an instance stops sharing shapes and keeps its fields in
+// a table of its own. the first keeps shape lookups small, the second
+// catches instances used as maps with ever new keys.
+#define MAX_SHAPE_FIELDS 64
+#define MAX_SHAPE_TRANSITIONS 32
+
+ObjShape* newShape() {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->fieldCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+// the shape reached by adding name, NULL when the tree got too big.
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+  if (shape->fieldCount >= MAX_SHAPE_FIELDS ||
+      shape->transitions.count >= MAX_SHAPE_TRANSITIONS) {
+    return NULL;
+  }
+
+  ObjShape* added = newShape();
+  push(OBJ_VAL(added)); // for collector
+  tableAddAll(&shape->slots, &added->slots);
+  tableSet(&added->slots, name, NUMBER_VAL(shape->fieldCount));
+  // the tables growing may have promoted the new shape
+  rememberObject((Obj*)added);
+  added->fieldCount = shape->fieldCount + 1;
+  tableSet(&shape->transitions, name, OBJ_VAL(added));
+  tableBarrier((Obj*)shape, name, OBJ_VAL(added));
+  pop();
+  return added;
+}
+
+static void toDictionary(ObjInstance* instance) {
+  ObjShape* shape = instance->shape;
+  instance->dict = ALLOCATE(Table, 1);
+  initTable(instance->dict);
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry* entry = &shape->slots.entries[i];
+    if (entry->key == NULL) continue;
+    tableSet(instance->dict, entry->key,
+      instance->fields[(int)AS_NUMBER(entry->value)]);
+  }
+  rememberObject((Obj*)instance);
+
+  FREE_ARRAY(Value, instance->fields, instance->capacity);
+  instance->fields = NULL;
+  instance->capacity = 0;
+  instance->shape = NULL;
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dict, name, value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot < 0) return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+// store value in the slot next takes over from the current shape.
+void addField(ObjInstance* instance, ObjShape* next, Value value) {
+  int slot = instance->shape->fieldCount;
+  if (instance->capacity < slot + 1) {
+    int oldCapacity = instance->capacity;
+    instance->capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    instance->fields = GROW_ARRAY(Value, instance->fields,
+        oldCapacity, instance->capacity);
+  }
+  instance->fields[slot] = value;
+  instance->shape = next;
+  writeBarrier((Obj*)instance, value);
+  objectBarrier((Obj*)instance, (Obj*)next);
+}
+
+void setField(ObjInstance* instance, ObjString* name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+      instance->fields[slot] = value;
+      writeBarrier((Obj*)instance, value);
+      return;
+    }
+
+    ObjShape* next = shapeTransition(instance->shape, name);
+    if (next != NULL) {
+      addField(instance, next, value);
+      return;
+    }
+    toDictionary(instance);
+  }
+  tableSet(instance->dict, name, value);
+  tableBarrier((Obj*)instance, name, value);
+}
+
 static void printList(ObjList* list) {
   printf("[");
   for (int i=0; i < list->array.count; i++) {
@@ -224,6 +352,9 @@ void printObject(Value value) {
   case OBJ_MAP:
     printMap(AS_MAP(value));
     break;
+  case OBJ_SHAPE:
+    printf("shape");
+    break;
   case OBJ_UPVALUE:
     printf("upvalue");
     break;
@@ -259,6 +390,9 @@ void objTypeName(ObjType type, char* out) {
   case OBJ_MAP:
     strcpy(out, "map");
     break;
+  case OBJ_SHAPE:
+    strcpy(out, "shape");
+    break;
   case OBJ_UPVALUE:
     strcpy(out, "upvalue");
     break;
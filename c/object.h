@@ -17,6 +17,7 @@
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_MAP(value)          isObjType(value, OBJ_MAP)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -28,6 +29,7 @@
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 #define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 
 typedef enum {
   OBJ_BOUND_METHOD,
@@ -39,19 +41,39 @@ typedef enum {
   OBJ_STRING,
   OBJ_LIST,
   OBJ_MAP,
+  OBJ_SHAPE,
   OBJ_UPVALUE,
 } ObjType;
 
 struct Obj {
   ObjType type;
   bool isMarked;
+  uint8_t generation; // GEN_YOUNG until it survives a collection
   struct Obj* next;
 };
 
+typedef struct NativeCode NativeCode;
+typedef struct Trace Trace;
+typedef struct RegCode RegCode;
+typedef struct LazyBody LazyBody;
+
+struct CallFrame;
+// native code for a function, jitted or from clox --emit-c. runs the
+// frame from frame->ip and returns a CodeStatus.
+typedef int (*CompiledFn)(struct CallFrame* frame);
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount; // 放在ObjFunction里面,因为要在runtime时用到
+  int frameSize; // stack slots a frame needs, its locals and temporaries
+  int deopts; // failed type guards of quickened instructions
+  int hotness; // calls and loop iterations seen with the jit on
+  NativeCode* native; // jitted code, NULL until the function got hot
+  Trace* traces; // its loops the tracer looked at
+  CompiledFn compiled; // NULL while only the interpreter can run it
+  RegCode* registers; // clox --reg, NULL when the translation gave up
+  LazyBody* lazy; // clox --lazy, the body isn't compiled yet
   Chunk chunk;
   ObjString* name;
 } ObjFunction;
@@ -108,16 +130,31 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
+// the field layout shared by instances that got the same fields in the
+// same order. every class has its own empty root shape, so a shape also
+// pins down the class, and adding a field moves an instance along a
+// transition to the next shape.
+typedef struct ObjShape {
+  Obj obj;
+  int fieldCount;
+  Table slots;       // field name -> slot index
+  Table transitions; // field name -> shape with that field added
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString* name;
   Table methods;
+  ObjShape* shape; // root shape of its instances
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  ObjShape* shape; // NULL once the instance fell back to dictionary mode
+  int capacity;
+  Value* fields;   // indexed by the shape's slots
+  Table* dict;     // fields in dictionary mode
 } ObjInstance;
 
 typedef struct {
@@ -139,6 +176,11 @@ ObjList* newList();
 void copyList(ObjList* list, Value* values, int length);
 ObjMap* newMap();
 ObjUpvalue* newUpvalue(Value* slot);
+ObjShape* newShape();
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+void setField(ObjInstance* instance, ObjString* name, Value value);
+void addField(ObjInstance* instance, ObjShape* next, Value value);
 void printObject(Value value);
 void objTypeName(ObjType type, char* out);
 
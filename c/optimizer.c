@@ -0,0 +1,657 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// a pass rewrites a finished chunk into a new code array. instructions
+// may shrink, so every jump is re-pointed through newOffset once the
+// whole chunk has been rewritten.
+typedef struct {
+  int operand; // offset of the 16 bit operand in the new code
+  int from;    // new offset the jump is relative to (end of instruction)
+  int target;  // jump target in the old code
+} JumpFixup;
+
+typedef struct {
+  Chunk* chunk;    // the chunk being rewritten
+  Chunk out;       // the rewritten code and lines
+  bool* isTarget;  // old offsets that some jump lands on
+  int* newOffset;  // old offset -> new offset, chunk->count + 1 entries
+  JumpFixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+} Rewriter;
+
+static int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  switch (code[0]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+    return offset + 3 + (uint16_t)((code[1] << 8) | code[2]);
+  case OP_LOOP:
+    return offset + 3 - (uint16_t)((code[1] << 8) | code[2]);
+  case OP_FOR_PREP:
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return offset + 5 + (uint16_t)((code[3] << 8) | code[4]);
+  case OP_FOR_LOOP:
+    return offset + 5 - (uint16_t)((code[3] << 8) | code[4]);
+  default:
+    return -1;
+  }
+}
+
+static void initRewriter(Rewriter* r, Chunk* chunk) {
+  r->chunk = chunk;
+  initChunk(&r->out);
+  r->isTarget = ALLOCATE(bool, chunk->count + 1);
+  r->newOffset = ALLOCATE(int, chunk->count + 1);
+  r->fixups = NULL;
+  r->fixupCount = 0;
+  r->fixupCapacity = 0;
+
+  for (int i = 0; i <= chunk->count; i++) {
+    r->isTarget[i] = false;
+    r->newOffset[i] = -1;
+  }
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0) r->isTarget[target] = true;
+  }
+}
+
+static void emit(Rewriter* r, uint8_t byte, int line) {
+  writeChunk(&r->out, byte, line);
+}
+
+// writes a placeholder 16 bit jump operand, patched in finishRewrite().
+// the operand has to be the last thing in the instruction.
+static void emitJumpOperand(Rewriter* r, int target, int line) {
+  if (r->fixupCapacity < r->fixupCount + 1) {
+    int oldCapacity = r->fixupCapacity;
+    r->fixupCapacity = GROW_CAPACITY(oldCapacity);
+    r->fixups = GROW_ARRAY(JumpFixup, r->fixups,
+        oldCapacity, r->fixupCapacity);
+  }
+  JumpFixup* fixup = &r->fixups[r->fixupCount++];
+  fixup->operand = r->out.count;
+  fixup->from = r->out.count + 2;
+  fixup->target = target;
+  emit(r, 0xff, line);
+  emit(r, 0xff, line);
+}
+
+static void copyInstruction(Rewriter* r, int offset) {
+  Chunk* chunk = r->chunk;
+  int size = instructionSize(chunk, offset);
+  int line = getLine(chunk, offset);
+  r->newOffset[offset] = r->out.count;
+
+  int target = jumpTarget(chunk, offset);
+  if (target < 0) {
+    for (int i = 0; i < size; i++) {
+      emit(r, chunk->code[offset + i], getLine(chunk, offset + i));
+    }
+    return;
+  }
+
+  // the jump operand is always the last two bytes of the instruction
+  for (int i = 0; i < size - 2; i++) {
+    emit(r, chunk->code[offset + i], line);
+  }
+  emitJumpOperand(r, target, line);
+}
+
+// true when the instructions starting at offset are exactly `ops`,
+// and no jump lands inside the run. their offsets go into `at`.
+static bool matches(Rewriter* r, int offset, const uint8_t* ops,
+    int length, int* at) {
+  Chunk* chunk = r->chunk;
+  for (int i = 0; i < length; i++) {
+    if (offset >= chunk->count) return false;
+    if (chunk->code[offset] != ops[i]) return false;
+    if (i > 0 && r->isTarget[offset]) return false;
+    at[i] = offset;
+    offset += instructionSize(chunk, offset);
+  }
+  return true;
+}
+
+static void finishRewrite(Rewriter* r) {
+  Chunk* chunk = r->chunk;
+  int oldCount = chunk->count;
+  r->newOffset[oldCount] = r->out.count;
+
+  for (int i = 0; i < r->fixupCount; i++) {
+    JumpFixup* fixup = &r->fixups[i];
+    int target = r->newOffset[fixup->target];
+    int jump = target >= fixup->from
+      ? target - fixup->from : fixup->from - target;
+    r->out.code[fixup->operand] = (jump >> 8) & 0xff;
+    r->out.code[fixup->operand + 1] = jump & 0xff;
+  }
+
+  if (!chunk->mapped) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
+  chunk->mapped = false;
+  chunk->code = r->out.code;
+  chunk->count = r->out.count;
+  chunk->capacity = r->out.capacity;
+  chunk->lines = r->out.lines;
+  chunk->lineCount = r->out.lineCount;
+  chunk->lineCapacity = r->out.lineCapacity;
+
+  FREE_ARRAY(bool, r->isTarget, oldCount + 1);
+  FREE_ARRAY(int, r->newOffset, oldCount + 1);
+  FREE_ARRAY(JumpFixup, r->fixups, r->fixupCapacity);
+}
+
+// the sequences are the most frequent ones in static opcode-pair counts
+// over example/*.lox, weighted towards loop and function bodies:
+//   GET_LOCAL INC SET_LOCAL DEC POP            `i++;`   -> INC_LOCAL
+//   GET_LOCAL CONSTANT LESS JUMP_IF_FALSE POP  `i < n`  -> LESS_LOCAL_CONST_JUMP
+//   SET_LOCAL POP                              `a = b;` -> SET_LOCAL_POP
+//   GET_LOCAL GET_LOCAL ADD                    `a + b`  -> ADD_LOCALS
+// returns the old offset after the fused run, or -1 if nothing matched.
+static int fuse(Rewriter* r, int offset) {
+  static const uint8_t incLocal[] =
+    { OP_GET_LOCAL, OP_INC, OP_SET_LOCAL, OP_DEC, OP_POP };
+  static const uint8_t decLocal[] =
+    { OP_GET_LOCAL, OP_DEC, OP_SET_LOCAL, OP_INC, OP_POP };
+  static const uint8_t lessJump[] =
+    { OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP };
+  static const uint8_t addLocals[] =
+    { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD };
+  static const uint8_t setLocalPop[] = { OP_SET_LOCAL, OP_POP };
+
+  Chunk* chunk = r->chunk;
+  uint8_t* code = chunk->code;
+  int line = getLine(chunk, offset);
+  int at[5];
+
+  if ((matches(r, offset, incLocal, 5, at) ||
+       matches(r, offset, decLocal, 5, at)) &&
+      code[at[0] + 1] == code[at[2] + 1]) {
+    emit(r, code[at[1]] == OP_INC ? OP_INC_LOCAL : OP_DEC_LOCAL, line);
+    emit(r, code[at[0] + 1], line);
+    return at[4] + 1;
+  }
+
+  if (matches(r, offset, lessJump, 5, at)) {
+    // the fused form pushes no condition, so it can only be used when
+    // the false branch starts by popping it. it jumps past that pop.
+    int target = jumpTarget(chunk, at[3]);
+    if (code[target] == OP_POP) {
+      emit(r, OP_LESS_LOCAL_CONST_JUMP, line);
+      emit(r, code[at[0] + 1], line);
+      emit(r, code[at[1] + 1], line);
+      emitJumpOperand(r, target + 1, line);
+      return at[4] + 1;
+    }
+  }
+
+  if (matches(r, offset, addLocals, 3, at)) {
+    emit(r, OP_ADD_LOCALS, line);
+    emit(r, code[at[0] + 1], line);
+    emit(r, code[at[1] + 1], line);
+    return at[2] + 1;
+  }
+
+  if (matches(r, offset, setLocalPop, 2, at)) {
+    emit(r, OP_SET_LOCAL_POP, line);
+    emit(r, code[at[0] + 1], line);
+    return at[1] + 1;
+  }
+
+  return -1;
+}
+
+// rewrites common opcode sequences of a finished chunk into single
+// superinstructions, saving their dispatches.
+void fuseSuperinstructions(Chunk* chunk) {
+  Rewriter r;
+  initRewriter(&r, chunk);
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    int start = r.out.count;
+    int next = fuse(&r, offset);
+    if (next < 0) {
+      copyInstruction(&r, offset);
+      offset += instructionSize(chunk, offset);
+      continue;
+    }
+    for (int i = offset; i < next; i++) r.newOffset[i] = start;
+    offset = next;
+  }
+
+  finishRewrite(&r);
+}
+
+// where a jump op at offset ends up when it lands on other jumps. only
+// unconditional jumps may turn backwards, and OP_JUMP_IF_FALSE can go
+// on through another one since the value it tests is still there.
+static int threadJump(Chunk* chunk, int offset, uint8_t op, int target) {
+  bool forwardOnly = op != OP_JUMP && op != OP_LOOP;
+  if (op == OP_FOR_LOOP) return target; // it can only jump back
+  for (int i = 0; i < 16 && target < chunk->count; i++) {
+    uint8_t next = chunk->code[target];
+    if (next != OP_JUMP && next != OP_LOOP &&
+        !(op == OP_JUMP_IF_FALSE && next == OP_JUMP_IF_FALSE)) {
+      break;
+    }
+    int further = jumpTarget(chunk, target);
+    if (further == target) break;
+    if (forwardOnly && further <= offset) break;
+    target = further;
+  }
+  return target;
+}
+
+typedef struct {
+  Rewriter r;
+  int* targets;     // old offset -> where its jump goes once threaded
+  bool* popJump;    // a JUMP_IF_FALSE and the POP after it become one
+  bool* reachable;
+} Peephole;
+
+// thread every jump, then find what can still run from the start.
+static void analyze(Peephole* p) {
+  Chunk* chunk = p->r.chunk;
+  uint8_t* code = chunk->code;
+  int count = chunk->count;
+
+  for (int offset = 0; offset < count;
+       offset += instructionSize(chunk, offset)) {
+    p->targets[offset] = -1;
+    p->popJump[offset] = false;
+    p->reachable[offset] = false;
+    int target = jumpTarget(chunk, offset);
+    if (target < 0) continue;
+    target = threadJump(chunk, offset, code[offset], target);
+
+    // both ways pop the condition first: pop it in the jump, and go
+    // past the pop it lands on.
+    int next = offset + 3;
+    if (code[offset] == OP_JUMP_IF_FALSE && next < count &&
+        code[next] == OP_POP && !p->r.isTarget[next] &&
+        target < count && code[target] == OP_POP) {
+      p->popJump[offset] = true;
+      target = threadJump(chunk, offset, OP_POP_JUMP_IF_FALSE, target + 1);
+    }
+    p->targets[offset] = target;
+  }
+
+  int* work = ALLOCATE(int, count);
+  int workCount = 0;
+  if (count > 0) {
+    p->reachable[0] = true;
+    work[workCount++] = 0;
+  }
+  while (workCount > 0) {
+    int offset = work[--workCount];
+    uint8_t op = code[offset];
+    int successors[2];
+    int n = 0;
+    if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) {
+      successors[n++] = offset + instructionSize(chunk, offset) +
+        (p->popJump[offset] ? 1 : 0);
+    }
+    if (p->targets[offset] >= 0) successors[n++] = p->targets[offset];
+    for (int i = 0; i < n; i++) {
+      if (successors[i] >= count || p->reachable[successors[i]]) continue;
+      p->reachable[successors[i]] = true;
+      work[workCount++] = successors[i];
+    }
+  }
+  FREE_ARRAY(int, work, count);
+
+  // only what the rewritten jumps land on keeps runs from merging
+  for (int i = 0; i <= count; i++) p->r.isTarget[i] = false;
+  for (int offset = 0; offset < count;
+       offset += instructionSize(chunk, offset)) {
+    if (p->reachable[offset] && p->targets[offset] >= 0) {
+      p->r.isTarget[p->targets[offset]] = true;
+    }
+  }
+}
+
+// the first instruction at or after offset that is kept.
+static int nextLive(Peephole* p, int offset) {
+  Chunk* chunk = p->r.chunk;
+  while (offset < chunk->count && !p->reachable[offset]) {
+    offset += instructionSize(chunk, offset);
+  }
+  return offset;
+}
+
+// returns the old offset after what was rewritten, -1 to copy it as is.
+static int peep(Peephole* p, int offset) {
+  Rewriter* r = &p->r;
+  Chunk* chunk = r->chunk;
+  uint8_t* code = chunk->code;
+  int line = getLine(chunk, offset);
+  int size = instructionSize(chunk, offset);
+  int target = p->targets[offset];
+
+  if (target >= 0) {
+    if (p->popJump[offset]) {
+      emit(r, OP_POP_JUMP_IF_FALSE, line);
+      emitJumpOperand(r, target, line);
+      return offset + size + 1;
+    }
+    switch (code[offset]) {
+    case OP_JUMP:
+    case OP_LOOP:
+      // a jump to where the code goes on anyway
+      if (target > offset && nextLive(p, offset + size) == target) {
+        return offset + size;
+      }
+      emit(r, target > offset ? OP_JUMP : OP_LOOP, line);
+      break;
+    default:
+      for (int i = 0; i < size - 2; i++) emit(r, code[offset + i], line);
+      break;
+    }
+    emitJumpOperand(r, target, line);
+    return offset + size;
+  }
+
+  switch (code[offset]) {
+  case OP_POP: {
+    // endScope() and break pop one local at a time
+    int end = offset + 1;
+    while (end < chunk->count && end - offset < UINT8_MAX &&
+           code[end] == OP_POP && !r->isTarget[end]) {
+      end++;
+    }
+    if (end - offset == 1) return -1;
+    emit(r, OP_POPN, line);
+    emit(r, end - offset, line);
+    return end;
+  }
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS: {
+    // !=, <= and >= compile to the opposite test and a NOT
+    int next = offset + 1;
+    if (next >= chunk->count || code[next] != OP_NOT ||
+        r->isTarget[next]) {
+      return -1;
+    }
+    uint8_t op = code[offset] == OP_EQUAL ? OP_NOT_EQUAL :
+      code[offset] == OP_GREATER ? OP_LESS_EQUAL : OP_GREATER_EQUAL;
+    emit(r, op, line);
+    return next + 1;
+  }
+  default:
+    return -1;
+  }
+}
+
+// cleans up what the single pass compiler leaves behind: runs of pops,
+// jumps to jumps, negated comparisons, conditions popped on both paths
+// and the code none of that can reach any more.
+void optimizePeephole(Chunk* chunk) {
+  Peephole p;
+  initRewriter(&p.r, chunk);
+  int count = chunk->count;
+  p.targets = ALLOCATE(int, count + 1);
+  p.popJump = ALLOCATE(bool, count + 1);
+  p.reachable = ALLOCATE(bool, count + 1);
+  analyze(&p);
+
+  int offset = 0;
+  while (offset < count) {
+    int start = p.r.out.count;
+    int next = -1;
+    if (!p.reachable[offset]) {
+      next = offset + instructionSize(chunk, offset);
+    } else {
+      next = peep(&p, offset);
+    }
+    if (next < 0) {
+      copyInstruction(&p.r, offset);
+      offset += instructionSize(chunk, offset);
+      continue;
+    }
+    for (int i = offset; i < next; i++) p.r.newOffset[i] = start;
+    offset = next;
+  }
+
+  FREE_ARRAY(int, p.targets, count + 1);
+  FREE_ARRAY(bool, p.popJump, count + 1);
+  FREE_ARRAY(bool, p.reachable, count + 1);
+  finishRewrite(&p.r);
+}
+
+bool stackEffect(Chunk* chunk, int offset, int depth,
+    int* pops, int* pushes) {
+  uint8_t* code = &chunk->code[offset];
+  int width = constantWidth(code[0]);
+  *pops = 0;
+  *pushes = 0;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_MAP_INIT:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+    *pushes = 1;
+    return true;
+  case OP_GET_LOCAL:
+    *pushes = 1;
+    return code[1] < depth;
+  case OP_GET_LOCAL_LONG:
+    *pushes = 1;
+    return ((code[1] << 8) | code[2]) < depth;
+  case OP_SET_LOCAL:
+    *pops = *pushes = 1;
+    return code[1] < depth;
+  case OP_SET_LOCAL_LONG:
+    *pops = *pushes = 1;
+    return ((code[1] << 8) | code[2]) < depth;
+  case OP_SET_LOCAL_POP:
+    *pops = 1;
+    return code[1] < depth;
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL:
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return code[1] < depth;
+  case OP_ADD_LOCALS:
+    *pushes = 1;
+    return code[1] < depth && code[2] < depth;
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    return code[1] < depth && code[2] < depth;
+  case OP_DUP:
+    *pops = 1;
+    *pushes = 2;
+    return true;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_POP_JUMP_IF_FALSE:
+    *pops = 1;
+    return true;
+  case OP_POPN:
+    *pops = code[1];
+    return true;
+  case OP_SET_GLOBAL:
+  case OP_SET_UPVALUE:
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_INC:
+  case OP_DEC:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_JUMP_IF_FALSE:
+    *pops = *pushes = 1;
+    return true;
+  case OP_GET_INDEX:
+  case OP_SHIFT_INDEX:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER:
+  case OP_GET_SUPER_LONG:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_NOT_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_EQUAL_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+    *pops = 2;
+    *pushes = 1;
+    return true;
+  case OP_SET_INDEX:
+  case OP_MAP_DATA:
+    *pops = 3;
+    *pushes = 1;
+    return true;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    *pops = code[1] + 1;
+    *pushes = 1;
+    return true;
+  case OP_INVOKE:
+  case OP_INVOKE_LONG:
+    *pops = code[1 + width] + 1;
+    *pushes = 1;
+    return true;
+  case OP_SUPER_INVOKE:
+  case OP_SUPER_INVOKE_LONG:
+    *pops = code[1 + width] + 2;
+    *pushes = 1;
+    return true;
+  case OP_LIST:
+    *pops = code[1];
+    *pushes = 1;
+    return true;
+  case OP_LIST_APPEND:
+    *pops = code[1] + 1;
+    *pushes = 1;
+    return true;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    ObjFunction* inner =
+      AS_FUNCTION(chunk->constants.values[constantIndex(code)]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      int pair = 1 + width + i * 2;
+      if (code[pair] && code[pair + 1] >= depth) return false;
+    }
+    *pushes = 1;
+    return true;
+  }
+  default:
+    // OP_JUMP, OP_LOOP
+    return true;
+  }
+}
+
+static bool isJump(uint8_t op) {
+  switch (op) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_LESS_LOCAL_CONST_JUMP:
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    return true;
+  default:
+    return false;
+  }
+}
+
+typedef struct {
+  Chunk* chunk;
+  const bool* starts; // offsets where an instruction begins
+  int* depths;        // stack height before each instruction, -1 unseen
+  int* work;
+  int workCount;
+} StackWalk;
+
+static bool reach(StackWalk* w, int offset, int depth) {
+  if (offset < 0 || offset >= w->chunk->count || !w->starts[offset]) {
+    return false;
+  }
+  if (w->depths[offset] >= 0) return w->depths[offset] == depth;
+  w->depths[offset] = depth;
+  w->work[w->workCount++] = offset;
+  return true;
+}
+
+int measureStack(Chunk* chunk, int depth, const bool* starts) {
+  StackWalk w;
+  w.chunk = chunk;
+  w.starts = starts;
+  w.depths = ALLOCATE(int, chunk->count);
+  w.work = ALLOCATE(int, chunk->count);
+  w.workCount = 0;
+  for (int i = 0; i < chunk->count; i++) w.depths[i] = -1;
+
+  int maxDepth = depth;
+  bool ok = reach(&w, 0, depth);
+  while (ok && w.workCount > 0) {
+    int offset = w.work[--w.workCount];
+    depth = w.depths[offset];
+    int pops, pushes;
+    if (!stackEffect(chunk, offset, depth, &pops, &pushes) ||
+        pops >= depth) {
+      ok = false;
+      break;
+    }
+    depth += pushes - pops;
+    if (depth > maxDepth) maxDepth = depth;
+
+    uint8_t op = chunk->code[offset];
+    if (isJump(op)) ok = reach(&w, jumpTarget(chunk, offset), depth);
+    if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+      ok = ok && reach(&w, offset + instructionSize(chunk, offset), depth);
+    }
+  }
+
+  FREE_ARRAY(int, w.depths, chunk->count);
+  FREE_ARRAY(int, w.work, chunk->count);
+  return ok ? maxDepth : -1;
+}
+
+int frameSlots(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  bool* starts = ALLOCATE(bool, chunk->count);
+  for (int i = 0; i < chunk->count; i++) starts[i] = false;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    starts[offset] = true;
+  }
+  int maxDepth = measureStack(chunk, function->arity + 1, starts);
+  FREE_ARRAY(bool, starts, chunk->count);
+  // makeList() roots the new list in the slot above its elements
+  return maxDepth < 0 ? -1 : maxDepth + 1;
+}
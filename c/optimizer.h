@@ -0,0 +1,23 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+#include "object.h"
+
+void fuseSuperinstructions(Chunk* chunk);
+void optimizePeephole(Chunk* chunk);
+
+// how many values the instruction at offset takes off the stack and
+// puts back. false when a local it uses is not below depth.
+bool stackEffect(Chunk* chunk, int offset, int depth,
+    int* pops, int* pushes);
+// the highest the stack gets on any path through the chunk, entered
+// with depth values on it. only the offsets marked in starts begin an
+// instruction. -1 when the stack underflows, a local is used from above
+// the top or two paths meet at different heights.
+int measureStack(Chunk* chunk, int depth, const bool* starts);
+// the stack slots a frame of the function needs, its locals and every
+// temporary on top of them. -1 when the paths through it disagree.
+int frameSlots(ObjFunction* function);
+
+#endif
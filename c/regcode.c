@@ -0,0 +1,655 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "regcode.h"
+
+// the translation walks the stack code keeping a picture of the stack.
+// a value pushed by GET_LOCAL or CONSTANT is not copied anywhere yet,
+// its slot remembers the register or constant it stands for and the
+// instruction consuming it reads that directly. such values are written
+// to their own slot when something needs the stack for real: a call, a
+// join of control flow, a slow path that can collect garbage.
+typedef enum {
+  SLOT_HOME,  // the value is in the slot's own register
+  SLOT_REG,   // a copy of a lower register
+  SLOT_CONST, // a constant
+} SlotKind;
+
+typedef struct {
+  SlotKind kind;
+  int index;
+} Slot;
+
+typedef struct {
+  Chunk* chunk;
+  RegCode* code;
+  int* depths;  // stack height at every offset, -1 where unreachable
+  bool* labels; // jump targets and entries
+  int* pcs;     // offset -> first instruction translated from it
+  Slot stack[UINT8_COUNT];
+  int depth;
+  int next;     // offset of the stack instruction after this one
+  int base;     // RegSite.base of what is emitted now
+  int last;     // instruction whose result may be moved to a local, -1
+} Translator;
+
+static int stackEffect(uint8_t* code) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_DUP:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_MAP_INIT:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_ADD_LOCALS:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_INDEX:
+  case OP_SHIFT_INDEX:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER:
+  case OP_GET_SUPER_LONG:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_EQUAL_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_SET_LOCAL_POP:
+  case OP_NOT_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_POP_JUMP_IF_FALSE:
+    return -1;
+  case OP_POPN:
+    return -code[1];
+  case OP_SET_INDEX:
+  case OP_MAP_DATA:
+    return -2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  case OP_INVOKE:
+    return -code[2];
+  case OP_INVOKE_LONG:
+    return -code[4];
+  case OP_SUPER_INVOKE:
+    return -code[2] - 1;
+  case OP_SUPER_INVOKE_LONG:
+    return -code[4] - 1;
+  case OP_LIST:
+    return 1 - code[1];
+  case OP_LIST_APPEND:
+    return -code[1];
+  default:
+    return 0;
+  }
+}
+
+// where a jump at offset goes, -1 for other instructions.
+static int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+    return offset + 3 + ((code[1] << 8) | code[2]);
+  case OP_LOOP:
+    return offset + 3 - ((code[1] << 8) | code[2]);
+  case OP_FOR_PREP:
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return offset + 5 + ((code[3] << 8) | code[4]);
+  case OP_FOR_LOOP:
+    return offset + 5 - ((code[3] << 8) | code[4]);
+  default:
+    return -1;
+  }
+}
+
+static bool fallsThrough(uint8_t op) {
+  return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+// the stack height before every instruction, false when it does not fit
+// in the register fields or differs between two paths.
+static bool computeDepths(Translator* t, int arity) {
+  Chunk* chunk = t->chunk;
+  int* work = malloc(sizeof(int) * chunk->count);
+  int count = 0;
+  bool ok = true;
+
+  if (arity + 1 >= UINT8_MAX) ok = false;
+  t->depths[0] = arity + 1;
+  work[count++] = 0;
+  while (ok && count > 0) {
+    int offset = work[--count];
+    int depth = t->depths[offset] + stackEffect(&chunk->code[offset]);
+    if (depth < 0 || depth >= UINT8_MAX) {
+      ok = false;
+      break;
+    }
+
+    int successors[2];
+    int n = 0;
+    if (fallsThrough(chunk->code[offset])) {
+      successors[n++] = offset + instructionSize(chunk, offset);
+    }
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0) {
+      successors[n++] = target;
+      t->labels[target] = true;
+    }
+
+    for (int i = 0; i < n; i++) {
+      int next = successors[i];
+      if (next >= chunk->count) continue;
+      if (t->depths[next] < 0) {
+        t->depths[next] = depth;
+        work[count++] = next;
+      } else if (t->depths[next] != depth) {
+        ok = false;
+      }
+    }
+  }
+
+  free(work);
+  return ok;
+}
+
+static void emit(Translator* t, uint32_t word) {
+  RegCode* code = t->code;
+  if (code->capacity < code->count + 1) {
+    int oldCapacity = code->capacity;
+    code->capacity = GROW_CAPACITY(oldCapacity);
+    code->code = GROW_ARRAY(uint32_t, code->code,
+      oldCapacity, code->capacity);
+    code->sites = GROW_ARRAY(RegSite, code->sites,
+      oldCapacity, code->capacity);
+  }
+  code->code[code->count] = word;
+  code->sites[code->count].offset = (uint16_t)t->next;
+  code->sites[code->count].base = (uint8_t)t->base;
+  code->count++;
+  t->last = -1;
+}
+
+static void emitABC(Translator* t, RegOp op, int a, int b, int c) {
+  emit(t, op | a << 8 | b << 16 | (uint32_t)c << 24);
+}
+
+static void emitABx(Translator* t, RegOp op, int a, int bx) {
+  emit(t, op | a << 8 | (uint32_t)bx << 16);
+}
+
+static void materialize(Translator* t, int slot) {
+  Slot* s = &t->stack[slot];
+  if (s->kind == SLOT_REG) {
+    emitABC(t, R_MOVE, slot, s->index, 0);
+  } else if (s->kind == SLOT_CONST) {
+    emitABx(t, R_LOADK, slot, s->index);
+  }
+  s->kind = SLOT_HOME;
+}
+
+static void flushBelow(Translator* t, int limit) {
+  for (int i = 0; i < limit; i++) materialize(t, i);
+}
+
+// the register holding a slot the next instruction consumes.
+static int operand(Translator* t, int slot) {
+  Slot* s = &t->stack[slot];
+  if (s->kind == SLOT_REG) return s->index;
+  if (s->kind == SLOT_CONST) materialize(t, slot);
+  return slot;
+}
+
+// a local read or written in place has to hold its value.
+static int local(Translator* t, int slot) {
+  if (slot < t->depth) materialize(t, slot);
+  return slot;
+}
+
+// copies of a local that is about to change get their own value.
+static void clobber(Translator* t, int reg) {
+  for (int i = reg + 1; i < t->depth; i++) {
+    if (t->stack[i].kind == SLOT_REG && t->stack[i].index == reg) {
+      materialize(t, i);
+    }
+  }
+}
+
+static bool isClobbering(Translator* t, int reg) {
+  for (int i = reg + 1; i < t->depth; i++) {
+    if (t->stack[i].kind == SLOT_REG && t->stack[i].index == reg) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void push(Translator* t, SlotKind kind, int index) {
+  t->stack[t->depth].kind = kind;
+  t->stack[t->depth].index = index;
+  t->depth++;
+}
+
+// an instruction that wrote its result to the new top slot.
+static void pushResult(Translator* t) {
+  push(t, SLOT_HOME, 0);
+  t->last = t->code->count - 1;
+}
+
+// SET_LOCAL: the instruction computing the value writes the local
+// directly when it can.
+static void setLocal(Translator* t, int slot) {
+  int top = t->depth - 1;
+  Slot* value = &t->stack[top];
+  if (slot == top) return;
+
+  if (t->last >= 0 && REG_A(t->code->code[t->last]) == top &&
+      value->kind == SLOT_HOME && slot < top && !isClobbering(t, slot)) {
+    uint32_t* word = &t->code->code[t->last];
+    *word = (*word & ~0xff00u) | (uint32_t)slot << 8;
+    value->kind = SLOT_REG;
+    value->index = slot;
+  } else {
+    clobber(t, slot);
+    if (value->kind == SLOT_CONST) {
+      emitABx(t, R_LOADK, slot, value->index);
+    } else if (value->kind == SLOT_HOME) {
+      emitABC(t, R_MOVE, slot, top, 0);
+    } else if (value->index != slot) {
+      emitABC(t, R_MOVE, slot, value->index, 0);
+    }
+  }
+  if (slot < t->depth) t->stack[slot].kind = SLOT_HOME;
+}
+
+static void binary(Translator* t, RegOp op, RegOp opK) {
+  int b = t->depth - 2;
+  Slot* right = &t->stack[t->depth - 1];
+  int rb = operand(t, b);
+  if (op == R_ADD) flushBelow(t, b); // strings allocate
+  t->base = b;
+  if (right->kind == SLOT_CONST) {
+    emitABC(t, opK, b, rb, right->index);
+  } else {
+    emitABC(t, op, b, rb, operand(t, t->depth - 1));
+  }
+  t->depth -= 2;
+  pushResult(t);
+}
+
+static void unary(Translator* t, RegOp op) {
+  int slot = t->depth - 1;
+  int reg = operand(t, slot);
+  emitABC(t, op, slot, reg, 0);
+  t->depth--;
+  pushResult(t);
+}
+
+// everything the register code does not handle itself goes back to
+// run(), with the stack as the interpreter expects it.
+static void exitAt(Translator* t, int offset) {
+  flushBelow(t, t->depth);
+  emitABx(t, R_EXIT, t->depth, offset);
+}
+
+// false when the code after it is only reached through a label.
+static bool translate(Translator* t, int offset) {
+  uint8_t* code = &t->chunk->code[offset];
+  int top = t->depth - 1;
+  t->base = t->depth;
+
+  switch (code[0]) {
+  case OP_CONSTANT: push(t, SLOT_CONST, code[1]); return true;
+  case OP_CONSTANT_LONG: {
+    // K operands only have 8 bits, it is loaded right away
+    int constant = (code[1] << 16) | (code[2] << 8) | code[3];
+    if (constant > UINT16_MAX) {
+      exitAt(t, offset);
+      return false;
+    }
+    emitABx(t, R_LOADK, t->depth, constant);
+    pushResult(t);
+    return true;
+  }
+  case OP_NIL:      emitABC(t, R_NIL, t->depth, 0, 0); pushResult(t); return true;
+  case OP_TRUE:     emitABC(t, R_TRUE, t->depth, 0, 0); pushResult(t); return true;
+  case OP_FALSE:    emitABC(t, R_FALSE, t->depth, 0, 0); pushResult(t); return true;
+  case OP_POP:      t->depth--; return true;
+  case OP_POPN:     t->depth -= code[1]; return true;
+  case OP_DUP: {
+    Slot copy = t->stack[top];
+    if (copy.kind == SLOT_HOME) {
+      copy.kind = SLOT_REG;
+      copy.index = top;
+    }
+    push(t, copy.kind, copy.index);
+    return true;
+  }
+  case OP_GET_LOCAL:
+    push(t, SLOT_REG, local(t, code[1]));
+    return true;
+  case OP_SET_LOCAL:
+    setLocal(t, code[1]);
+    return true;
+  case OP_SET_LOCAL_POP:
+    setLocal(t, code[1]);
+    t->depth--;
+    return true;
+  case OP_GET_GLOBAL:
+    emitABx(t, R_GET_GLOBAL, t->depth, (code[1] << 8) | code[2]);
+    pushResult(t);
+    return true;
+  case OP_DEFINE_GLOBAL:
+    emitABx(t, R_DEFINE_GLOBAL, operand(t, top), (code[1] << 8) | code[2]);
+    t->depth--;
+    return true;
+  case OP_SET_GLOBAL:
+    emitABx(t, R_SET_GLOBAL, operand(t, top), (code[1] << 8) | code[2]);
+    return true;
+  case OP_GET_UPVALUE:
+    emitABC(t, R_GET_UPVALUE, t->depth, code[1], 0);
+    pushResult(t);
+    return true;
+  case OP_SET_UPVALUE:
+    emitABC(t, R_SET_UPVALUE, operand(t, top), code[1], 0);
+    return true;
+  case OP_GET_PROPERTY: {
+    int receiver = operand(t, top);
+    flushBelow(t, top);
+    t->base = top;
+    emitABC(t, R_GET_PROPERTY, top, receiver, 0);
+    emit(t, code[1] | ((code[2] << 8) | code[3]) << 8);
+    t->depth--;
+    pushResult(t);
+    t->last = t->code->count - 2; // the cache word comes after it
+    return true;
+  }
+  case OP_SET_PROPERTY: {
+    int instance = operand(t, top - 1);
+    int value = operand(t, top);
+    flushBelow(t, top - 1);
+    t->base = top - 1;
+    emitABC(t, R_SET_PROPERTY, top - 1, instance, value);
+    emit(t, code[1] | ((code[2] << 8) | code[3]) << 8);
+    t->depth -= 2;
+    push(t, SLOT_HOME, 0);
+    return true;
+  }
+  case OP_GET_INDEX: {
+    int b = operand(t, top - 1);
+    int c = operand(t, top);
+    emitABC(t, R_GET_INDEX, top - 1, b, c);
+    t->depth -= 2;
+    pushResult(t);
+    return true;
+  }
+  case OP_SET_INDEX: {
+    int a = operand(t, top - 2);
+    int b = operand(t, top - 1);
+    int c = operand(t, top);
+    flushBelow(t, top - 2); // maps allocate
+    t->base = top - 2;
+    emitABC(t, R_SET_INDEX, a, b, c);
+    t->depth -= 2;
+    return true;
+  }
+  case OP_EQUAL:
+  case OP_EQUAL_NUM:    binary(t, R_EQUAL, R_EQUAL_K); return true;
+  case OP_GREATER:
+  case OP_GREATER_NUM:  binary(t, R_GREATER, R_GREATER_K); return true;
+  case OP_LESS:
+  case OP_LESS_NUM:     binary(t, R_LESS, R_LESS_K); return true;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:      binary(t, R_ADD, R_ADD_K); return true;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM: binary(t, R_SUBTRACT, R_SUBTRACT_K); return true;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM: binary(t, R_MULTIPLY, R_MULTIPLY_K); return true;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:   binary(t, R_DIVIDE, R_DIVIDE_K); return true;
+  case OP_NOT_EQUAL:
+    binary(t, R_EQUAL, R_EQUAL_K);
+    unary(t, R_NOT);
+    return true;
+  case OP_LESS_EQUAL:
+    binary(t, R_GREATER, R_GREATER_K);
+    unary(t, R_NOT);
+    return true;
+  case OP_GREATER_EQUAL:
+    binary(t, R_LESS, R_LESS_K);
+    unary(t, R_NOT);
+    return true;
+  case OP_INC:          unary(t, R_INC); return true;
+  case OP_DEC:          unary(t, R_DEC); return true;
+  case OP_NOT:          unary(t, R_NOT); return true;
+  case OP_NEGATE:       unary(t, R_NEGATE); return true;
+  case OP_PRINT:
+    emitABC(t, R_PRINT, operand(t, top), 0, 0);
+    t->depth--;
+    return true;
+  case OP_JUMP:
+  case OP_LOOP:
+    flushBelow(t, t->depth);
+    emitABx(t, R_JUMP, 0, jumpTarget(t->chunk, offset));
+    return false;
+  case OP_JUMP_IF_FALSE:
+    flushBelow(t, t->depth);
+    emitABx(t, R_JUMP_IF_FALSE, top, jumpTarget(t->chunk, offset));
+    return true;
+  case OP_POP_JUMP_IF_FALSE: {
+    int condition = operand(t, top);
+    flushBelow(t, top);
+    emitABx(t, R_JUMP_IF_FALSE, condition, jumpTarget(t->chunk, offset));
+    t->depth--;
+    return true;
+  }
+  case OP_CALL: {
+    int argCount = code[1];
+    flushBelow(t, t->depth);
+    t->base = t->depth - argCount - 1;
+    emitABC(t, R_CALL, t->base, argCount, 0);
+    t->depth -= argCount + 1;
+    push(t, SLOT_HOME, 0);
+    return true;
+  }
+  case OP_INVOKE: {
+    int argCount = code[2];
+    flushBelow(t, t->depth);
+    t->base = t->depth - argCount - 1;
+    emitABC(t, R_INVOKE, t->base, argCount, 0);
+    emit(t, code[1] | ((code[3] << 8) | code[4]) << 8);
+    t->depth -= argCount + 1;
+    push(t, SLOT_HOME, 0);
+    return true;
+  }
+  case OP_RETURN:
+    emitABC(t, R_RETURN, operand(t, top), 0, 0);
+    return false;
+  case OP_ADD_LOCALS: {
+    int a = local(t, code[1]);
+    int b = local(t, code[2]);
+    flushBelow(t, t->depth);
+    emitABC(t, R_ADD, t->depth, a, b);
+    pushResult(t);
+    return true;
+  }
+  case OP_LESS_LOCAL_CONST_JUMP: {
+    int a = local(t, code[1]);
+    flushBelow(t, t->depth);
+    emitABC(t, R_LESS_K, t->depth, a, code[2]);
+    emitABx(t, R_JUMP_IF_FALSE, t->depth, jumpTarget(t->chunk, offset));
+    return true;
+  }
+  case OP_FOR_PREP: {
+    int counter = local(t, code[1]);
+    int limit = local(t, code[2]);
+    flushBelow(t, t->depth);
+    emitABC(t, R_LESS, t->depth, counter, limit);
+    emitABx(t, R_JUMP_IF_FALSE, t->depth, jumpTarget(t->chunk, offset));
+    return true;
+  }
+  case OP_FOR_LOOP: {
+    // no jump if true, so the test skips over a jump back
+    int counter = local(t, code[1]);
+    int limit = local(t, code[2]);
+    clobber(t, counter);
+    flushBelow(t, t->depth);
+    emitABC(t, R_INC, counter, counter, 0);
+    emitABC(t, R_LESS, t->depth, counter, limit);
+    emitABx(t, R_JUMP_IF_FALSE, t->depth, t->next);
+    emitABx(t, R_JUMP, 0, jumpTarget(t->chunk, offset));
+    return true;
+  }
+  case OP_INC_LOCAL:
+  case OP_DEC_LOCAL: {
+    int slot = local(t, code[1]);
+    clobber(t, slot);
+    emitABC(t, code[0] == OP_INC_LOCAL ? R_INC : R_DEC, slot, slot, 0);
+    return true;
+  }
+  default:
+    // the _LONG forms too, a name past 255 doesn't fit the data word
+    exitAt(t, offset);
+    return false;
+  }
+}
+
+static bool isEntry(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CALL:
+  case OP_INVOKE:
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE:
+  case OP_SUPER_INVOKE_LONG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// jumps were emitted with stack offsets, point them at instructions.
+static void resolveJumps(Translator* t) {
+  RegCode* code = t->code;
+  for (int pc = 0; pc < code->count; pc++) {
+    uint32_t word = code->code[pc];
+    switch (REG_OP(word)) {
+    case R_JUMP:
+    case R_JUMP_IF_FALSE:
+      code->code[pc] = (word & 0xffff) | (uint32_t)t->pcs[REG_BX(word)] << 16;
+      break;
+    case R_GET_PROPERTY:
+    case R_SET_PROPERTY:
+    case R_INVOKE:
+      pc++; // cache word
+      break;
+    }
+  }
+}
+
+RegCode* compileRegisters(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count > UINT16_MAX) return NULL;
+
+  Translator t;
+  t.chunk = chunk;
+  t.depths = malloc(sizeof(int) * chunk->count);
+  t.labels = calloc(chunk->count, sizeof(bool));
+  t.pcs = malloc(sizeof(int) * chunk->count);
+  for (int i = 0; i < chunk->count; i++) t.depths[i] = -1;
+
+  RegCode* code = NULL;
+  if (!computeDepths(&t, function->arity)) goto done;
+
+  code = ALLOCATE(RegCode, 1);
+  code->code = NULL;
+  code->sites = NULL;
+  code->count = 0;
+  code->capacity = 0;
+  code->entries = NULL;
+  code->entryCount = 0;
+  code->entries = ALLOCATE(int, chunk->count);
+  code->entryCount = chunk->count;
+  t.code = code;
+
+  t.labels[0] = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    code->entries[offset] = -1;
+    int next = offset + instructionSize(chunk, offset);
+    if (isEntry(chunk, offset) && next < chunk->count) {
+      t.labels[next] = true;
+    }
+  }
+
+  // loop headers are where run() hands a frame over, a call returns
+  // into the offset after it.
+  bool reachable = false;
+  t.depth = 0;
+  t.last = -1;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    t.next = offset + instructionSize(chunk, offset);
+    t.base = t.depth;
+    if (t.labels[offset] && t.depths[offset] >= 0) {
+      if (reachable) flushBelow(&t, t.depth);
+      t.depth = t.depths[offset];
+      for (int i = 0; i < t.depth; i++) t.stack[i].kind = SLOT_HOME;
+      reachable = true;
+      t.last = -1;
+      code->entries[offset] = code->count;
+    }
+    t.pcs[offset] = code->count;
+    if (!reachable) continue;
+    reachable = translate(&t, offset);
+  }
+
+  if (code->count > UINT16_MAX) {
+    freeRegCode(code);
+    code = NULL;
+    goto done;
+  }
+  resolveJumps(&t);
+
+done:
+  free(t.depths);
+  free(t.labels);
+  free(t.pcs);
+  return code;
+}
+
+void freeRegCode(RegCode* code) {
+  FREE_ARRAY(uint32_t, code->code, code->capacity);
+  FREE_ARRAY(RegSite, code->sites, code->capacity);
+  FREE_ARRAY(int, code->entries, code->entryCount);
+  FREE(RegCode, code);
+}
@@ -0,0 +1,87 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "common.h"
+#include "object.h"
+
+// register code, an alternative form of a finished chunk for clox --reg.
+// a function's stack slots become registers: locals are read and
+// written in place, and the temporaries the stack code pushes and pops
+// are addressed by their stack position. so three stack instructions
+// like GET_LOCAL a, GET_LOCAL b, ADD become one R_ADD t, a, b.
+//
+// every instruction is a 32-bit word, op in the low byte, then A, B, C
+// or A and a 16-bit Bx. property access and invoke take a second word
+// holding the name constant and the inline cache.
+typedef enum {
+  R_MOVE,          // A = B
+  R_LOADK,         // A = K[Bx]
+  R_NIL,           // A = nil
+  R_TRUE,          // A = true
+  R_FALSE,         // A = false
+  R_GET_GLOBAL,    // A = global Bx
+  R_SET_GLOBAL,    // global Bx = A
+  R_DEFINE_GLOBAL, // global Bx = A, defines it
+  R_GET_UPVALUE,   // A = upvalue B
+  R_SET_UPVALUE,   // upvalue B = A
+  R_GET_PROPERTY,  // A = B.name
+  R_SET_PROPERTY,  // B.name = C, A = C
+  R_GET_INDEX,     // A = B[C]
+  R_SET_INDEX,     // A[B] = C
+  R_ADD,           // A = B + C
+  R_SUBTRACT,
+  R_MULTIPLY,
+  R_DIVIDE,
+  R_EQUAL,
+  R_GREATER,
+  R_LESS,
+  R_ADD_K,         // A = B + K[C]
+  R_SUBTRACT_K,
+  R_MULTIPLY_K,
+  R_DIVIDE_K,
+  R_EQUAL_K,
+  R_GREATER_K,
+  R_LESS_K,
+  R_INC,           // A = B + 1
+  R_DEC,           // A = B - 1
+  R_NOT,           // A = !B
+  R_NEGATE,        // A = -B
+  R_PRINT,         // print A
+  R_JUMP,          // to Bx
+  R_JUMP_IF_FALSE, // to Bx if A is falsey
+  R_CALL,          // A = A(A+1 .. A+B)
+  R_INVOKE,        // A = A.name(A+1 .. A+B)
+  R_RETURN,        // return A
+  R_EXIT,          // run() goes on at stack offset Bx, A slots in use
+} RegOp;
+
+#define REG_OP(word) ((word) & 0xff)
+#define REG_A(word)  (((word) >> 8) & 0xff)
+#define REG_B(word)  (((word) >> 16) & 0xff)
+#define REG_C(word)  ((word) >> 24)
+#define REG_BX(word) ((word) >> 16)
+
+// where an instruction came from: the stack instruction after it, for
+// line numbers and calls, and the stack height below its operands, for
+// the slow paths that put the operands back on the stack.
+typedef struct {
+  uint16_t offset;
+  uint8_t base;
+} RegSite;
+
+struct RegCode {
+  uint32_t* code;
+  RegSite* sites;
+  int count;
+  int capacity;
+  // stack offset -> instruction where a frame at that offset can be
+  // picked up (function start, after calls, loop headers), -1 elsewhere
+  int* entries;
+  int entryCount;
+};
+
+// NULL when the chunk uses more than 255 slots.
+RegCode* compileRegisters(ObjFunction* function);
+void freeRegCode(RegCode* code);
+
+#endif
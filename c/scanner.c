@@ -1,75 +1,342 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "utf8.h"
 #include "common.h"
 #include "scanner.h"
 
-typedef utf8_int32_t rune;
-
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
+#ifdef SIMD_SCANNER
+#include <immintrin.h>
+#endif
 
 Scanner scanner;
 
+// a streamed source is read a block at a time. blocks are NUL terminated
+// like any source, the scanner moves on to the next one when it reaches
+// the '\0' at the end of a block. a token must be in one piece, so the
+// token being scanned there is copied to the front of the next block,
+// and so is everything after the mark. tokens scanned before still
+// point into the old blocks, which are kept until releaseSource().
+typedef struct Segment {
+  struct Segment* next;
+  // where the bytes copied to the front of this block start in the one
+  // before it.
+  const char* carried;
+  size_t length;
+  char bytes[];
+} Segment;
+
+#define STREAM_BLOCK (64 * 1024)
+
+static FILE* stream = NULL;
+static Segment* segments = NULL; // the oldest first
+static const char* mark = NULL;
+
 void initScanner(const char* source) {
   scanner.start = source;
   scanner.current = source;
   scanner.line = 1;
 }
 
-static bool isAlpha(rune c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <='Z') || c == '_';
+Scanner saveScanner() {
+  return scanner;
 }
 
-static bool isDigit(rune c) {
-  return c >= '0' && c <= '9';
+void restoreScanner(Scanner saved) {
+  scanner = saved;
+}
+
+static Segment* findSegment(const char* p) {
+  for (Segment* segment = segments; segment != NULL;
+      segment = segment->next) {
+    if (p >= segment->bytes && p <= segment->bytes + segment->length) {
+      return segment;
+    }
+  }
+  return NULL;
+}
+
+// the block after the last one, false at the end of the stream.
+static bool readSegment(Segment* last) {
+  const char* keep = scanner.start;
+  if (mark != NULL && mark < keep) keep = mark;
+  size_t kept = (size_t)(last->bytes + last->length - keep);
+
+  // a long token or marked stretch doubles the block, so copying it
+  // again and again costs no more than reading it.
+  size_t capacity = kept + (kept > STREAM_BLOCK ? kept : STREAM_BLOCK);
+  Segment* segment = (Segment*)malloc(sizeof(Segment) + capacity + 1);
+  if (segment == NULL) return false;
+  memcpy(segment->bytes, keep, kept);
+  size_t read = fread(segment->bytes + kept, 1, capacity - kept, stream);
+  if (read == 0) {
+    free(segment);
+    return false;
+  }
+
+  segment->next = NULL;
+  segment->carried = keep;
+  segment->length = kept + read;
+  segment->bytes[segment->length] = '\0';
+  last->next = segment;
+  return true;
+}
+
+static const char* carry(const char* p, Segment* to) {
+  return to->bytes + (p - to->carried);
+}
+
+// the scanner found a '\0' at, true when there was more of a streamed
+// source after it. scanning again after restoreScanner() reaches the end
+// of a block with the same token as the first time, and goes on in the
+// block that was read then.
+static bool refill(const char* at) {
+  if (segments == NULL) return false;
+
+  Segment* segment = findSegment(at);
+  if (segment == NULL || at != segment->bytes + segment->length) {
+    return false;
+  }
+  if (segment->next == NULL && (stream == NULL || !readSegment(segment))) {
+    return false;
+  }
+
+  Segment* next = segment->next;
+  scanner.start = carry(scanner.start, next);
+  scanner.current = carry(scanner.current, next);
+  if (mark != NULL) mark = carry(mark, next);
+  return true;
+}
+
+void initStreamScanner(FILE* file) {
+  stream = file;
+  mark = NULL;
+
+  // an empty block to start from
+  segments = (Segment*)malloc(sizeof(Segment) + 1);
+  segments->next = NULL;
+  segments->carried = NULL;
+  segments->length = 0;
+  segments->bytes[0] = '\0';
+  initScanner(segments->bytes);
+}
+
+void releaseSource(const char* keep) {
+  Segment* kept = findSegment(keep);
+  while (kept != NULL && segments != kept) {
+    Segment* next = segments->next;
+    free(segments);
+    segments = next;
+  }
+}
+
+void freeStreamScanner() {
+  while (segments != NULL) {
+    Segment* next = segments->next;
+    free(segments);
+    segments = next;
+  }
+  stream = NULL;
+  mark = NULL;
 }
 
-static bool isEol(rune c) {
-  return c == '\n' || c == '\r';
+void markSource(const char* from) {
+  mark = from;
+}
+
+const char* sourceMark() {
+  return mark;
+}
+
+// the scanner works on bytes. every byte the grammar cares about is
+// ascii, and the bytes of a multi-byte utf-8 character are all >= 0x80,
+// so they can't be mistaken for one. only a non-ascii character at the
+// start of a token is stepped over as a whole, see scanToken().
+static bool isAlpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <='Z') || c == '_';
+}
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
 }
 
 static bool isAtEnd() {
-  return *scanner.current == '\0';
+  return *scanner.current == '\0' && !refill(scanner.current);
 }
 
-static rune advance() {
-  rune rune;
-  scanner.current = (const char*)utf8codepoint(scanner.current, &rune);
-  return rune;
+static char advance() {
+  scanner.current++;
+  return scanner.current[-1];
 }
 
-static rune peek() {
-  const char* p = scanner.current;
-  rune rune;
-  utf8codepoint(p, &rune);
-  return rune;
+static char peek() {
+  if (*scanner.current == '\0') refill(scanner.current);
+  return *scanner.current;
 }
 
-static rune peekNext() {
+static char peekNext() {
   if (isAtEnd()) return '\0';
+  if (scanner.current[1] == '\0') refill(scanner.current + 1);
+  return scanner.current[1];
+}
+
+static bool match(char expected) {
+  if (peek() != expected) return false;
+  scanner.current++;
+  return true;
+}
+
+// the runs of bytes the scanner skips over in bulk. each ends at the
+// first byte that stops it, the '\0' at the end of the source always
+// does. lines are counted on the way.
+typedef enum {
+  SCAN_SPACE,   // ' ', '\t', '\r' and '\n', counts '\n'
+  SCAN_LINE,    // a line comment, up to '\n'
+  SCAN_COMMENT, // a block comment, up to '*', counts '\n' and '\r'
+  SCAN_STRING,  // a string, up to '"' or '\\', counts '\n' and '\r'
+  SCAN_NAME,    // letters, digits and '_'
+} ScanKind;
+
+static inline bool stopsRun(char c, ScanKind kind) {
+  switch (kind) {
+  case SCAN_SPACE: return c != ' ' && c != '\t' && c != '\r' && c != '\n';
+  case SCAN_LINE: return c == '\n' || c == '\0';
+  case SCAN_COMMENT: return c == '*' || c == '\0';
+  case SCAN_STRING: return c == '"' || c == '\\' || c == '\0';
+  case SCAN_NAME: return !isAlpha(c) && !isDigit(c);
+  }
+  return true;
+}
+
+static inline bool countsLine(char c, ScanKind kind) {
+  switch (kind) {
+  case SCAN_SPACE: return c == '\n';
+  case SCAN_COMMENT:
+  case SCAN_STRING: return c == '\n' || c == '\r';
+  default: return false;
+  }
+}
+
+#ifdef SIMD_SCANNER
+
+// a vector at a time. the loads are aligned, so they never cross into
+// a page the source doesn't touch, though they do read past its '\0'.
+// the bytes before the start of the run are masked off.
+#ifdef __AVX2__
+#define BLOCK 32
+typedef __m256i Vector;
+#define LOAD(p) _mm256_load_si256((const __m256i*)(p))
+#define SPLAT(c) _mm256_set1_epi8(c)
+#define EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define GT(a, b) _mm256_cmpgt_epi8(a, b)
+#define OR(a, b) _mm256_or_si256(a, b)
+#define AND(a, b) _mm256_and_si256(a, b)
+#define MASK(v) ((uint32_t)_mm256_movemask_epi8(v))
+#define ALL 0xffffffffu
+#else
+#define BLOCK 16
+typedef __m128i Vector;
+#define LOAD(p) _mm_load_si128((const __m128i*)(p))
+#define SPLAT(c) _mm_set1_epi8(c)
+#define EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define GT(a, b) _mm_cmpgt_epi8(a, b)
+#define OR(a, b) _mm_or_si128(a, b)
+#define AND(a, b) _mm_and_si128(a, b)
+#define MASK(v) ((uint32_t)_mm_movemask_epi8(v))
+#define ALL 0xffffu
+#endif
+
+#define IS(v, c) EQ(v, SPLAT(c))
+// lo <= v <= hi, the compares are signed so bytes >= 0x80 are never in.
+#define IN(v, lo, hi) AND(GT(v, SPLAT((lo) - 1)), GT(SPLAT((hi) + 1), v))
+
+static inline uint32_t stopMask(Vector v, ScanKind kind) {
+  switch (kind) {
+  case SCAN_SPACE: {
+    Vector space = OR(OR(IS(v, ' '), IS(v, '\t')),
+        OR(IS(v, '\r'), IS(v, '\n')));
+    return ALL ^ MASK(space);
+  }
+  case SCAN_LINE:
+    return MASK(OR(IS(v, '\n'), IS(v, '\0')));
+  case SCAN_COMMENT:
+    return MASK(OR(IS(v, '*'), IS(v, '\0')));
+  case SCAN_STRING:
+    return MASK(OR(OR(IS(v, '"'), IS(v, '\\')), IS(v, '\0')));
+  case SCAN_NAME: {
+    // setting 0x20 folds upper case letters onto lower case ones.
+    Vector letters = IN(OR(v, SPLAT(0x20)), 'a', 'z');
+    return ALL ^ MASK(OR(OR(letters, IN(v, '0', '9')), IS(v, '_')));
+  }
+  }
+  return 0;
+}
 
-  rune rune;
-  const char* p = scanner.current;
-  utf8codepoint(p + utf8codepointcalcsize(p), &rune);
+static inline uint32_t lineMask(Vector v, ScanKind kind) {
+  switch (kind) {
+  case SCAN_SPACE: return MASK(IS(v, '\n'));
+  case SCAN_COMMENT:
+  case SCAN_STRING: return MASK(OR(IS(v, '\n'), IS(v, '\r')));
+  default: return 0;
+  }
+}
 
-  return rune;
+// there are few lines in a vector, and without -mpopcnt
+// __builtin_popcount() is a call.
+static inline int countLines(uint32_t lines) {
+  int count = 0;
+  for (; lines != 0; lines &= lines - 1) count++;
+  return count;
 }
 
-static bool match(rune expected) {
-  if (isAtEnd()) return false;
+// the bytes looked at one by one before the first vector.
+#define SCALAR_BYTES 8
 
-  const char* p= scanner.current;
-  rune rune;
-  p = utf8codepoint(p, &rune);
+__attribute__((no_sanitize_address))
+static inline const char* scanRun(const char* p, ScanKind kind) {
+  // most runs are short, a space between two tokens or a short name,
+  // and end before a vector would pay for itself.
+  for (int i = 0; i < SCALAR_BYTES; i++, p++) {
+    if (stopsRun(*p, kind)) return p;
+    if (countsLine(*p, kind)) scanner.line++;
+  }
 
-  if (rune != expected) return false;
+  const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)(BLOCK - 1));
+  uint32_t from = ~0u << (p - block);
 
-  scanner.current = p;
-  return true;
+  for (;;) {
+    Vector v = LOAD(block);
+    uint32_t stops = stopMask(v, kind) & from;
+    uint32_t lines = lineMask(v, kind) & from;
+
+    if (stops != 0) {
+      int offset = __builtin_ctz(stops);
+      scanner.line += countLines(lines & ((1u << offset) - 1));
+      return block + offset;
+    }
+
+    scanner.line += countLines(lines);
+    block += BLOCK;
+    from = ~0u;
+  }
+}
+
+#else
+
+// a byte at a time.
+static const char* scanRun(const char* p, ScanKind kind) {
+  for (; !stopsRun(*p, kind); p++) {
+    if (countsLine(*p, kind)) scanner.line++;
+  }
+  return p;
+}
+
+#endif
+
+static void skip(ScanKind kind) {
+  do {
+    scanner.current = scanRun(scanner.current, kind);
+  } while (*scanner.current == '\0' && refill(scanner.current));
 }
 
 static Token makeToken(TokenType type) {
@@ -86,7 +353,7 @@ static Token errorToken(const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
-  token.length = (int)utf8size(message) - 1;
+  token.length = (int)strlen(message);
   token.line = scanner.line; 
 
   return token;
@@ -94,42 +361,25 @@ static Token errorToken(const char* message) {
 
 static void skipWhitespace() {
   for (;;) {
-    rune c = peek();
-    switch (c) {
-    case ' ':
-    case '\r':
-    case '\t':
-      advance();
-      break;
-
-    case'\n':
-      scanner.line++;
-      advance();
-      break;
-
-    case '/':
-      if (peekNext() == '/') {
-        // a comments goes until the end of the line.
-        while (peek() != '\n' && !isAtEnd()) advance();
-      } else if (peekNext() == '*') {
-        // a block comment goes until '*/'
-        advance(); // slash
-        advance(); // star
-
-        // scan for */ while ignoring everything else
-        while ((peek() != '*' || peekNext() != '/') && !isAtEnd()) {
-          if (isEol(peek())) scanner.line++;
-          advance();
-        }
-
+    skip(SCAN_SPACE);
+    if (peek() != '/') return;
+
+    if (peekNext() == '/') {
+      // a comments goes until the end of the line.
+      skip(SCAN_LINE);
+    } else if (peekNext() == '*') {
+      // a block comment goes until '*/'
+      advance(); // slash
+      advance(); // star
+
+      // scan for */ while ignoring everything else
+      for (;;) {
+        skip(SCAN_COMMENT);
+        if (isAtEnd()) return;
         advance(); // star
-        advance(); // slash
-      } else {
-        return;
+        if (match('/')) break;
       }
-      break;
-
-    default:
+    } else {
       return;
     }
   }
@@ -138,24 +388,20 @@ static void skipWhitespace() {
 static TokenType checkKeyword(int start, int length, 
     const char* rest, TokenType type) {
   if (scanner.current - scanner.start == start + length &&
-    utf8ncmp(scanner.start + start, rest, length) == 0) {
+    memcmp(scanner.start + start, rest, length) == 0) {
     return type;
   }
   return TOKEN_IDENTIFIER;
 }
 
 static TokenType identifierType() {
-  const char* p = scanner.start;
-  rune rune;
-  p = utf8codepoint(p, &rune);
-  switch (rune) {
+  switch (scanner.start[0]) {
   case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
   case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
   case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
   case 'c':
     if (scanner.current - scanner.start > 1) {
-      utf8codepoint(p, &rune);
-      switch (rune) {
+      switch (scanner.start[1]) {
       case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS); 
       case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
       case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
@@ -165,8 +411,7 @@ static TokenType identifierType() {
   case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
   case 'f':
     if (scanner.current - scanner.start > 1) {
-      utf8codepoint(p, &rune);
-      switch (rune) {
+      switch (scanner.start[1]) {
       case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
       case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
       case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
@@ -180,8 +425,7 @@ static TokenType identifierType() {
   case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
   case 's':
     if ( scanner.current - scanner.start > 1) {
-      utf8codepoint(p, &rune);
-      switch (rune) {
+      switch (scanner.start[1]) {
       case 'w':
         return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
       case 'u':
@@ -190,8 +434,7 @@ static TokenType identifierType() {
     }
   case 't':
     if (scanner.current - scanner.start > 1) {
-      utf8codepoint(p, &rune);
-      switch (rune) {
+      switch (scanner.start[1]) {
       case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
       case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
       }
@@ -205,7 +448,7 @@ static TokenType identifierType() {
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  skip(SCAN_NAME);
   return makeToken(identifierType());
 }
 
@@ -225,23 +468,15 @@ static Token number() {
 }
 
 static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (isEol(peek())) scanner.line++;
-    if (peek() == '\\' && peekNext() == '\\') {
-      // double backslashes will be interpreted as a single backslash later
-      // skip them so they don't interfere with the next test
-      advance();
-      advance();
-      continue;
-    } 
-    if (peek() == '\\' && peekNext() == '"') {
-      // escaped double quotes must not terminate the string
-      advance();
-      advance();
-      continue;
-    }
-    // as it going on without causing problems
+  for (;;) {
+    skip(SCAN_STRING);
+    if (peek() != '\\') break;
+
+    // double backslashes will be interpreted as a single backslash later,
+    // and escaped double quotes must not terminate the string. skip both
+    // so they don't interfere with the next test
     advance();
+    if (peek() == '\\' || peek() == '"') advance();
   }
 
   if (isAtEnd()) return errorToken("unterminated string.");
@@ -251,7 +486,17 @@ static Token string() {
   return makeToken(TOKEN_STRING);
 }
 
+// steps over a character that isn't ascii, its lead byte and the
+// continuation bytes after it.
+static void skipCharacter() {
+  for (int i = 0; i < 3 && (peek() & 0xc0) == 0x80; i++) {
+    scanner.current++;
+  }
+}
+
 Token scanToken() {
+  // nothing before the whitespace needs carrying to a new block
+  scanner.start = scanner.current;
   skipWhitespace();
 
   scanner.start = scanner.current;
@@ -259,7 +504,7 @@ Token scanToken() {
     return makeToken(TOKEN_EOF);
   }
 
-  rune c = advance();
+  char c = advance();
   if (isAlpha(c)) return identifier();
   if (isDigit(c)) return number();
 
@@ -285,5 +530,6 @@ Token scanToken() {
   case '"': return string();
   }
 
+  if ((c & 0x80) != 0) skipCharacter();
   return errorToken("unexpected character.");
 }
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stdio.h>
+
 typedef enum {
   // single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -38,8 +40,28 @@ typedef struct {
   int line;
 } Token;
 
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
 void initScanner(const char* source);
+// lets the parser look further ahead than one token and come back.
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
 Token scanToken();
 
+// clox - or a pipe. the source is read from file as the scanner gets
+// to it, tokens point into blocks that stay until releaseSource(keep)
+// frees the ones before keep's. the file is the caller's to close.
+void initStreamScanner(FILE* file);
+void releaseSource(const char* keep);
+void freeStreamScanner();
+// the source from the mark on stays in one piece, and sourceMark() is
+// where it is now. markSource(NULL) clears it.
+void markSource(const char* from);
+const char* sourceMark();
+
 #endif
 
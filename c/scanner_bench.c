@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "scanner.h"
+
+#ifdef clox_scanner_bench
+
+// `make scanbench`: tokens per second over a few megabytes of generated
+// source, for each mix of code, comments, strings and utf-8 below.
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define PASSES 5
+
+static const char* code[] = {
+  "fun fib(n) {\n  if (n < 2) return n;\n"
+  "  return fib(n - 2) + fib(n - 1);\n}\n",
+  "class Point {\n  init(x, y) {\n    this.x = x;\n    this.y = y;\n  }\n"
+  "  add(other) { return Point(this.x + other.x, this.y + other.y); }\n}\n",
+  "var total = 0;\nfor (var i = 0; i < 1000; i++) {\n"
+  "  total = total + i * 2.5;\n}\nprint total;\n",
+  "var items = [1, 2, 3, 4];\nwhile (items.len() > 0 and !done) "
+  "{ items.pop(); }\n",
+};
+
+static const char* comments[] = {
+  "// walks the list and sums every element that is still alive\n",
+  "/* the cache is keyed by the shape of the receiver, a miss falls\n"
+  "   back to the slow lookup and fills it in again. */\n",
+  "  // TODO: handle the empty case before anything else runs\n",
+};
+
+static const char* strings[] = {
+  "var message = \"the quick brown fox jumps over the lazy dog, again "
+  "and again and again until the buffer runs out\";\n",
+  "print \"a \\\"quoted\\\" word and a \\\\ backslash in a longer line\";\n",
+  "var path = \"/usr/local/share/lox/library/collections/list.lox\";\n",
+};
+
+static const char* unicode[] = {
+  "var greeting = \"héllo wörld, 你好世界, привет мир\";\n",
+  "// résumé: naïve café façade, 日本語のコメント\n",
+  "/* ünïcödé in a block comment, Ελληνικά and עברית */\n",
+};
+
+typedef struct {
+  const char** parts;
+  int count;
+} Group;
+
+// the parts of a mix are picked from its groups evenly.
+typedef struct {
+  const char* name;
+  Group groups[4];
+} Mix;
+
+#define PARTS(array) array, sizeof(array) / sizeof(array[0])
+
+static char* generate(Mix* mix, size_t size) {
+  char* source = malloc(size + 1);
+  size_t length = 0;
+  unsigned seed = 1;
+
+  for (;;) {
+    // a cheap lcg picks the next part, so every run is the same.
+    seed = seed * 1103515245 + 12345;
+    Group* from = &mix->groups[(seed >> 16) % 4];
+    if (from->count == 0) continue;
+    const char* part = from->parts[(seed >> 8) % from->count];
+
+    size_t partLength = strlen(part);
+    if (length + partLength > size) break;
+    memcpy(source + length, part, partLength);
+    length += partLength;
+  }
+
+  source[length] = '\0';
+  return source;
+}
+
+static void bench(Mix* mix) {
+  char* source = generate(mix, SOURCE_SIZE);
+  size_t length = strlen(source);
+  double best = 0;
+  long tokens = 0;
+
+  for (int pass = 0; pass < PASSES; pass++) {
+    clock_t start = clock();
+    initScanner(source);
+    tokens = 0;
+    for (;;) {
+      Token token = scanToken();
+      if (token.type == TOKEN_ERROR) {
+        fprintf(stderr, "%s: %.*s\n", mix->name, token.length, token.start);
+        exit(1);
+      }
+      tokens++;
+      if (token.type == TOKEN_EOF) break;
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (pass == 0 || seconds < best) best = seconds;
+  }
+
+  printf("%-10s %5.1f MB %9ld tokens %7.1f Mtokens/s %7.1f MB/s\n",
+      mix->name, length / 1e6, tokens, tokens / best / 1e6,
+      length / best / 1e6);
+  free(source);
+}
+
+int main() {
+  Mix mixes[] = {
+    {"code", {{PARTS(code)}}},
+    {"comments", {{PARTS(code)}, {PARTS(comments)}, {PARTS(comments)}}},
+    {"strings", {{PARTS(code)}, {PARTS(strings)}, {PARTS(strings)}}},
+    {"utf-8", {{PARTS(code)}, {PARTS(unicode)}, {PARTS(strings)}}},
+  };
+
+#if !defined(SIMD_SCANNER)
+  printf("== byte at a time\n");
+#elif defined(__AVX2__)
+  printf("== avx2\n");
+#else
+  printf("== sse2\n");
+#endif
+
+  for (int i = 0; i < (int)(sizeof(mixes) / sizeof(mixes[0])); i++) {
+    bench(&mixes[i]);
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,901 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "lxim"
+#define BYTE_ORDER_MARK 0x01020304u
+#define NO_REF 0xffffffffu
+#define VALUE_SIZE 12
+// where the header keeps the object count, written last
+#define OBJECT_COUNT_OFFSET 20
+
+typedef enum {
+  VALUE_NIL,
+  VALUE_FALSE,
+  VALUE_TRUE,
+  VALUE_NUMBER,
+  VALUE_OBJECT,
+  VALUE_UNDEFINED, // a global that was declared but never defined
+} ValueTag;
+
+// in the order the loader creates them, each only needs the kinds
+// before it to exist.
+typedef enum {
+  RECORD_STRING,
+  RECORD_BUILTIN,
+  RECORD_FUNCTION,
+  RECORD_UPVALUE,
+  RECORD_SHAPE,
+  RECORD_CLASS,
+  RECORD_LIST,
+  RECORD_MAP,
+  RECORD_INSTANCE,
+  RECORD_CLOSURE,
+  RECORD_BOUND_METHOD,
+  RECORD_TYPES,
+} RecordType;
+
+typedef struct {
+  Obj* object;
+  char name[64];
+} Builtin;
+
+// the objects initVM() makes, which an image only names: the natives
+// by their global, the List class and its methods as "List" and
+// "List.push".
+static Builtin* listBuiltins(int* count) {
+  Table* methods = &vm.listClass->methods;
+  int capacity = vm.globalValues.count + methods->capacity + 1;
+  Builtin* builtins = ALLOCATE(Builtin, capacity);
+  *count = 0;
+
+  for (int i = 0; i < vm.globalValues.count; i++) {
+    Value value = vm.globalValues.values[i];
+    if (!IS_NATIVE(value)) continue;
+    Builtin* builtin = &builtins[(*count)++];
+    builtin->object = AS_OBJ(value);
+    snprintf(builtin->name, sizeof(builtin->name), "%s",
+      AS_CSTRING(vm.globalNames.values[i]));
+  }
+
+  Builtin* listClass = &builtins[(*count)++];
+  listClass->object = (Obj*)vm.listClass;
+  snprintf(listClass->name, sizeof(listClass->name), "%s",
+    vm.listClass->name->chars);
+  for (int i = 0; i < methods->capacity; i++) {
+    Entry* entry = &methods->entries[i];
+    if (entry->key == NULL) continue;
+    Builtin* builtin = &builtins[(*count)++];
+    builtin->object = AS_OBJ(entry->value);
+    snprintf(builtin->name, sizeof(builtin->name), "%s.%s",
+      vm.listClass->name->chars, entry->key->chars);
+  }
+  return builtins;
+}
+
+static void freeBuiltins(Builtin* builtins) {
+  int capacity = vm.globalValues.count + vm.listClass->methods.capacity + 1;
+  FREE_ARRAY(Builtin, builtins, capacity);
+}
+
+typedef struct {
+  FILE* out;
+  Obj** objects; // by index, in the order their records are written
+  int count;
+  int capacity;
+  Obj** keys;    // open addressing, an object to its index
+  int* indexes;
+  int keyCapacity;
+  Builtin* builtins;
+  int builtinCount;
+  const char* error;
+} Writer;
+
+static uint32_t hashObject(Obj* object) {
+  uintptr_t address = (uintptr_t)object;
+  return (uint32_t)((address >> 4) ^ (address >> 20)) * 2654435761u;
+}
+
+static void insertKey(Writer* w, Obj* object, int index) {
+  uint32_t i = hashObject(object) & (w->keyCapacity - 1);
+  while (w->keys[i] != NULL) i = (i + 1) & (w->keyCapacity - 1);
+  w->keys[i] = object;
+  w->indexes[i] = index;
+}
+
+static void growKeys(Writer* w) {
+  FREE_ARRAY(Obj*, w->keys, w->keyCapacity);
+  FREE_ARRAY(int, w->indexes, w->keyCapacity);
+  w->keyCapacity = w->keyCapacity < 64 ? 64 : w->keyCapacity * 2;
+  w->keys = ALLOCATE(Obj*, w->keyCapacity);
+  w->indexes = ALLOCATE(int, w->keyCapacity);
+  for (int i = 0; i < w->keyCapacity; i++) w->keys[i] = NULL;
+  for (int i = 0; i < w->count; i++) insertKey(w, w->objects[i], i);
+}
+
+// the first time an object shows up it gets the next index, and its
+// record is written when the writer gets there.
+static uint32_t objectIndex(Writer* w, Obj* object) {
+  if ((w->count + 1) * 4 > w->keyCapacity * 3) growKeys(w);
+  uint32_t i = hashObject(object) & (w->keyCapacity - 1);
+  while (w->keys[i] != NULL) {
+    if (w->keys[i] == object) return (uint32_t)w->indexes[i];
+    i = (i + 1) & (w->keyCapacity - 1);
+  }
+
+  if (w->capacity < w->count + 1) {
+    int oldCapacity = w->capacity;
+    w->capacity = GROW_CAPACITY(oldCapacity);
+    w->objects = GROW_ARRAY(Obj*, w->objects, oldCapacity, w->capacity);
+  }
+  w->keys[i] = object;
+  w->indexes[i] = w->count;
+  w->objects[w->count] = object;
+  return (uint32_t)w->count++;
+}
+
+static void writeRef(Writer* w, Obj* object) {
+  writeU32(w->out, object == NULL ? NO_REF : objectIndex(w, object));
+}
+
+static void writeValue(Writer* w, Value value) {
+  uint32_t tag;
+  uint8_t payload[8] = {0};
+  if (IS_NIL(value)) {
+    tag = VALUE_NIL;
+  } else if (IS_BOOL(value)) {
+    tag = AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE;
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    tag = VALUE_NUMBER;
+    memcpy(payload, &number, sizeof(number));
+  } else if (IS_UNDEFINED(value)) {
+    tag = VALUE_UNDEFINED;
+  } else {
+    uint32_t index = objectIndex(w, AS_OBJ(value));
+    tag = VALUE_OBJECT;
+    memcpy(payload, &index, sizeof(index));
+  }
+  writeU32(w->out, tag);
+  fwrite(payload, 1, sizeof(payload), w->out);
+}
+
+static void writeTable(Writer* w, Table* table) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) count++;
+  }
+  writeU32(w->out, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    writeRef(w, (Obj*)entry->key);
+    writeValue(w, entry->value);
+  }
+}
+
+static const char* builtinName(Writer* w, Obj* object) {
+  for (int i = 0; i < w->builtinCount; i++) {
+    if (w->builtins[i].object == object) return w->builtins[i].name;
+  }
+  return NULL;
+}
+
+static RecordType recordType(Writer* w, Obj* object) {
+  if (builtinName(w, object) != NULL) return RECORD_BUILTIN;
+  switch (object->type) {
+  case OBJ_STRING:       return RECORD_STRING;
+  case OBJ_FUNCTION:     return RECORD_FUNCTION;
+  case OBJ_UPVALUE:      return RECORD_UPVALUE;
+  case OBJ_SHAPE:        return RECORD_SHAPE;
+  case OBJ_CLASS:        return RECORD_CLASS;
+  case OBJ_LIST:         return RECORD_LIST;
+  case OBJ_MAP:          return RECORD_MAP;
+  case OBJ_INSTANCE:     return RECORD_INSTANCE;
+  case OBJ_CLOSURE:      return RECORD_CLOSURE;
+  case OBJ_BOUND_METHOD: return RECORD_BOUND_METHOD;
+  default:               return RECORD_TYPES;
+  }
+}
+
+static void writeObject(Writer* w, Obj* object, RecordType type) {
+  FILE* out = w->out;
+  switch (type) {
+  case RECORD_STRING:
+    writeString(out, (ObjString*)object);
+    break;
+  case RECORD_BUILTIN: {
+    const char* name = builtinName(w, object);
+    writeU32(out, (uint32_t)strlen(name));
+    writePadded(out, name, strlen(name));
+    break;
+  }
+  case RECORD_FUNCTION: {
+    ObjFunction* function = (ObjFunction*)object;
+    Chunk* chunk = &function->chunk;
+    // clox --lazy left it for its first call
+    if (function->lazy != NULL && !compileLazy(function)) {
+      w->error = "a function doesn't compile";
+    }
+    writeU32(out, (uint32_t)function->arity);
+    writeU32(out, (uint32_t)function->upvalueCount);
+    writeU32(out, (uint32_t)function->frameSize);
+    writeU32(out, (uint32_t)chunk->cacheCount);
+    writeRef(w, (Obj*)function->name);
+    writeU32(out, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+      writeValue(w, chunk->constants.values[i]);
+    }
+    writeCode(out, chunk);
+    break;
+  }
+  case RECORD_UPVALUE: {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->location != &upvalue->closed) {
+      w->error = "an upvalue is still open";
+    }
+    writeValue(w, upvalue->closed);
+    break;
+  }
+  case RECORD_SHAPE: {
+    ObjShape* shape = (ObjShape*)object;
+    writeU32(out, (uint32_t)shape->fieldCount);
+    writeTable(w, &shape->slots);
+    writeTable(w, &shape->transitions);
+    break;
+  }
+  case RECORD_CLASS: {
+    ObjClass* klass = (ObjClass*)object;
+    writeRef(w, (Obj*)klass->name);
+    writeRef(w, (Obj*)klass->shape);
+    writeTable(w, &klass->methods);
+    break;
+  }
+  case RECORD_LIST: {
+    ValueArray* array = &((ObjList*)object)->array;
+    writeU32(out, (uint32_t)array->count);
+    for (int i = 0; i < array->count; i++) writeValue(w, array->values[i]);
+    break;
+  }
+  case RECORD_MAP:
+    writeTable(w, &((ObjMap*)object)->table);
+    break;
+  case RECORD_INSTANCE: {
+    // only the fields the shape uses, or the dictionary
+    ObjInstance* instance = (ObjInstance*)object;
+    writeRef(w, (Obj*)instance->klass);
+    writeRef(w, (Obj*)instance->shape);
+    if (instance->shape != NULL) {
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        writeValue(w, instance->fields[i]);
+      }
+    } else {
+      writeTable(w, instance->dict);
+    }
+    break;
+  }
+  case RECORD_CLOSURE: {
+    ObjClosure* closure = (ObjClosure*)object;
+    writeRef(w, (Obj*)closure->function);
+    writeU32(out, (uint32_t)closure->upvalueCount);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      writeRef(w, (Obj*)closure->upvalues[i]);
+    }
+    break;
+  }
+  case RECORD_BOUND_METHOD: {
+    ObjBoundMethod* bound = (ObjBoundMethod*)object;
+    writeValue(w, bound->receiver);
+    writeValue(w, OBJ_VAL(bound->method));
+    break;
+  }
+  default:
+    w->error = "a native the vm doesn't define";
+    break;
+  }
+}
+
+// the record's length is filled in once the object is written.
+static void writeRecord(Writer* w, Obj* object) {
+  RecordType type = recordType(w, object);
+  long start = ftell(w->out);
+  writeU32(w->out, type);
+  writeU32(w->out, 0);
+  writeObject(w, object, type);
+  long end = ftell(w->out);
+  fseek(w->out, start + 4, SEEK_SET);
+  writeU32(w->out, (uint32_t)(end - start - 8));
+  fseek(w->out, end, SEEK_SET);
+}
+
+bool writeSnapshot(const char* path) {
+  FILE* out = fopen(path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  Writer w = {out, NULL, 0, 0, NULL, NULL, 0, NULL, 0, NULL};
+  w.builtins = listBuiltins(&w.builtinCount);
+
+  fwrite(SNAPSHOT_MAGIC, 1, 4, out);
+  writeU32(out, SNAPSHOT_VERSION);
+  writeU32(out, BYTE_ORDER_MARK);
+  writeU32(out, OPCODE_COUNT);
+  writeU32(out, (uint32_t)vm.globalNames.count);
+  writeU32(out, 0);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    writeRef(&w, AS_OBJ(vm.globalNames.values[i]));
+    writeValue(&w, vm.globalValues.values[i]);
+  }
+  // objects found while writing a record are appended, so this walks
+  // the heap breadth first from the globals
+  for (int i = 0; i < w.count && w.error == NULL; i++) {
+    writeRecord(&w, w.objects[i]);
+  }
+  fseek(out, OBJECT_COUNT_OFFSET, SEEK_SET);
+  writeU32(out, (uint32_t)w.count);
+
+  freeBuiltins(w.builtins);
+  FREE_ARRAY(Obj*, w.objects, w.capacity);
+  FREE_ARRAY(Obj*, w.keys, w.keyCapacity);
+  FREE_ARRAY(int, w.indexes, w.keyCapacity);
+
+  bool written = !ferror(out);
+  if (fclose(out) != 0 || !written || w.error != NULL) {
+    if (w.error != NULL) {
+      fprintf(stderr, "could not snapshot \"%s\": %s.\n", path, w.error);
+    } else {
+      fprintf(stderr, "could not write \"%s\".\n", path);
+    }
+    remove(path);
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  Reader reader;
+  int objectCount;
+  uint32_t* types;
+  size_t* starts; // where each record's object begins
+  size_t* ends;
+  Obj** objects;
+  size_t globalStart;
+  int globalCount;
+  uint16_t* globals; // slot in this vm for every global of the image
+  ObjList* roots;    // every object made so far, for the collector
+} Loader;
+
+// any value a program can hold. the rest only show up in constants and
+// the vm's own fields.
+static bool isData(Value value) {
+  return !IS_UNDEFINED(value) && !IS_FUNCTION(value) &&
+    !isObjType(value, OBJ_UPVALUE) && !IS_SHAPE(value);
+}
+
+static bool isMethod(Value value) {
+  return IS_CLOSURE(value) || IS_NATIVE(value);
+}
+
+static bool isShapeValue(Value value) {
+  return IS_SHAPE(value);
+}
+
+static bool isSlot(Value value) {
+  return IS_NUMBER(value) && AS_NUMBER(value) >= 0 &&
+    AS_NUMBER(value) < UINT16_COUNT &&
+    AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+static bool readValue(Loader* loader, Value* value) {
+  Reader* reader = &loader->reader;
+  uint32_t tag = readU32(reader);
+  uint8_t* payload = readBytes(reader, 8);
+  if (payload == NULL) return false;
+  switch (tag) {
+  case VALUE_NIL:       *value = NIL_VAL; return true;
+  case VALUE_FALSE:     *value = BOOL_VAL(false); return true;
+  case VALUE_TRUE:      *value = BOOL_VAL(true); return true;
+  case VALUE_UNDEFINED: *value = UNDEFINED_VAL; return true;
+  case VALUE_NUMBER: {
+    double number;
+    memcpy(&number, payload, sizeof(number));
+    // any other nan could pass for a boxed pointer
+    if (isnan(number)) number = NAN;
+    *value = NUMBER_VAL(number);
+    return true;
+  }
+  case VALUE_OBJECT: {
+    uint32_t index;
+    memcpy(&index, payload, sizeof(index));
+    if (index < (uint32_t)loader->objectCount &&
+        loader->objects[index] != NULL) {
+      *value = OBJ_VAL(loader->objects[index]);
+      return true;
+    }
+    readFailed(reader, "bad reference");
+    return false;
+  }
+  default:
+    readFailed(reader, "unknown value");
+    return false;
+  }
+}
+
+static bool readData(Loader* loader, Value* value) {
+  if (!readValue(loader, value)) return false;
+  if (isData(*value)) return true;
+  readFailed(&loader->reader, "bad value");
+  return false;
+}
+
+// the object of that type at the next index, NULL for none (~0) when
+// it is optional.
+static bool readObject(Loader* loader, ObjType type, bool optional,
+    Obj** object) {
+  Reader* reader = &loader->reader;
+  uint32_t index = readU32(reader);
+  if (reader->failed) return false;
+  *object = NULL;
+  if (index == NO_REF && optional) return true;
+  if (index < (uint32_t)loader->objectCount &&
+      loader->objects[index] != NULL &&
+      loader->objects[index]->type == type) {
+    *object = loader->objects[index];
+    return true;
+  }
+  readFailed(reader, "bad reference");
+  return false;
+}
+
+// entries are string keys and values that pass valid.
+static bool readTable(Loader* loader, Table* table, bool (*valid)(Value)) {
+  Reader* reader = &loader->reader;
+  uint32_t count = readU32(reader);
+  if (count > (reader->size - reader->offset) / (4 + VALUE_SIZE)) {
+    readFailed(reader, "truncated");
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    Obj* key;
+    Value value;
+    if (!readObject(loader, OBJ_STRING, false, &key) ||
+        !readValue(loader, &value)) {
+      return false;
+    }
+    if (!valid(value) || !tableSet(table, (ObjString*)key, value)) {
+      readFailed(reader, "bad table entry");
+      return false;
+    }
+  }
+  return true;
+}
+
+static Obj* findBuiltin(const char* name, uint32_t length) {
+  int count;
+  Builtin* builtins = listBuiltins(&count);
+  Obj* object = NULL;
+  for (int i = 0; i < count && object == NULL; i++) {
+    if (strlen(builtins[i].name) == length &&
+        memcmp(builtins[i].name, name, length) == 0) {
+      object = builtins[i].object;
+    }
+  }
+  freeBuiltins(builtins);
+  return object;
+}
+
+static bool endRecord(Loader* loader, int index) {
+  if (loader->reader.offset == loader->ends[index]) return true;
+  readFailed(&loader->reader, "bad record length");
+  return false;
+}
+
+// the object with only what the other kinds need when they are made:
+// a class's name, an instance's class, the upvalue count of a function
+// for its closures, and the field count of a shape.
+static bool createObject(Loader* loader, int index) {
+  Reader* reader = &loader->reader;
+  reader->offset = loader->starts[index];
+  Obj* object = NULL;
+  switch (loader->types[index]) {
+  case RECORD_STRING:
+    object = (Obj*)readString(reader);
+    if (object == NULL || !endRecord(loader, index)) return false;
+    break;
+  case RECORD_BUILTIN: {
+    uint32_t length = readU32(reader);
+    uint8_t* name = readBytes(reader, length);
+    if (name == NULL || !endRecord(loader, index)) return false;
+    object = findBuiltin((const char*)name, length);
+    if (object == NULL) {
+      readFailed(reader, "unknown builtin");
+      return false;
+    }
+    break;
+  }
+  case RECORD_FUNCTION: {
+    uint32_t arity = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    if (reader->failed) return false;
+    if (arity > UINT8_MAX || upvalueCount > UINT8_MAX) {
+      readFailed(reader, "bad function header");
+      return false;
+    }
+    ObjFunction* function = newFunction();
+    function->arity = (int)arity;
+    function->upvalueCount = (int)upvalueCount;
+    object = (Obj*)function;
+    break;
+  }
+  case RECORD_UPVALUE: {
+    ObjUpvalue* upvalue = newUpvalue(NULL);
+    upvalue->location = &upvalue->closed;
+    object = (Obj*)upvalue;
+    break;
+  }
+  case RECORD_SHAPE: {
+    uint32_t fieldCount = readU32(reader);
+    if (reader->failed) return false;
+    if (fieldCount > UINT16_MAX) {
+      readFailed(reader, "bad shape");
+      return false;
+    }
+    ObjShape* shape = newShape();
+    shape->fieldCount = (int)fieldCount;
+    object = (Obj*)shape;
+    break;
+  }
+  case RECORD_CLASS: {
+    Obj* name;
+    if (!readObject(loader, OBJ_STRING, false, &name)) return false;
+    object = (Obj*)newClass((ObjString*)name);
+    break;
+  }
+  case RECORD_LIST:
+    object = (Obj*)newList();
+    break;
+  case RECORD_MAP:
+    object = (Obj*)newMap();
+    break;
+  case RECORD_INSTANCE: {
+    Obj* klass;
+    if (!readObject(loader, OBJ_CLASS, false, &klass)) return false;
+    object = (Obj*)newInstance((ObjClass*)klass);
+    break;
+  }
+  case RECORD_CLOSURE: {
+    Obj* function;
+    if (!readObject(loader, OBJ_FUNCTION, false, &function)) return false;
+    object = (Obj*)newClosure((ObjFunction*)function);
+    break;
+  }
+  case RECORD_BOUND_METHOD:
+    object = (Obj*)newBoundMethod(NIL_VAL, NULL);
+    break;
+  }
+
+  push(OBJ_VAL(object)); // for collector
+  writeValueArray(&loader->roots->array, OBJ_VAL(object));
+  writeBarrier((Obj*)loader->roots, OBJ_VAL(object));
+  pop();
+  loader->objects[index] = object;
+  return true;
+}
+
+static bool fillFunction(Loader* loader, ObjFunction* function) {
+  Reader* reader = &loader->reader;
+  Chunk* chunk = &function->chunk;
+  readU32(reader); // arity and upvalue count, read when it was made
+  readU32(reader);
+  uint32_t frameSize = readU32(reader);
+  uint32_t cacheCount = readU32(reader);
+  if (reader->failed) return false;
+  if (frameSize > MAX_FRAME_SIZE || cacheCount > UINT16_COUNT) {
+    readFailed(reader, "bad function header");
+    return false;
+  }
+  function->frameSize = (int)frameSize;
+  for (uint32_t i = 0; i < cacheCount; i++) addInlineCache(chunk);
+
+  Obj* name;
+  if (!readObject(loader, OBJ_STRING, true, &name)) return false;
+  function->name = (ObjString*)name;
+
+  uint32_t constantCount = readU32(reader);
+  if (constantCount > (reader->size - reader->offset) / VALUE_SIZE) {
+    readFailed(reader, "truncated");
+    return false;
+  }
+  for (uint32_t i = 0; i < constantCount; i++) {
+    Value value;
+    if (!readValue(loader, &value)) return false;
+    // only what the compiler puts there
+    if (IS_OBJ(value) && !IS_STRING(value) && !IS_FUNCTION(value)) {
+      readFailed(reader, "bad constant");
+      return false;
+    }
+    addConstant(chunk, value);
+  }
+  return readCode(reader, chunk);
+}
+
+static bool fillShape(Loader* loader, ObjShape* shape) {
+  Reader* reader = &loader->reader;
+  readU32(reader); // field count, read when it was made
+  if (!readTable(loader, &shape->slots, isSlot) ||
+      !readTable(loader, &shape->transitions, isShapeValue)) {
+    return false;
+  }
+  // instances index their fields by these
+  bool valid = shape->slots.count <= shape->fieldCount;
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry* entry = &shape->slots.entries[i];
+    if (entry->key == NULL) continue;
+    valid = valid && AS_NUMBER(entry->value) < shape->fieldCount;
+  }
+  for (int i = 0; i < shape->transitions.capacity; i++) {
+    Entry* entry = &shape->transitions.entries[i];
+    if (entry->key == NULL) continue;
+    valid = valid &&
+      AS_SHAPE(entry->value)->fieldCount == shape->fieldCount + 1;
+  }
+  if (!valid) readFailed(reader, "bad shape");
+  return valid;
+}
+
+static bool fillInstance(Loader* loader, ObjInstance* instance) {
+  Reader* reader = &loader->reader;
+  readU32(reader); // the class, read when it was made
+  Obj* shapeObject;
+  if (!readObject(loader, OBJ_SHAPE, true, &shapeObject)) return false;
+
+  if (shapeObject == NULL) {
+    Table* dict = ALLOCATE(Table, 1);
+    initTable(dict);
+    instance->dict = dict;
+    instance->shape = NULL;
+    return readTable(loader, dict, isData);
+  }
+
+  ObjShape* shape = (ObjShape*)shapeObject;
+  if (shape->fieldCount > 0) {
+    Value* fields = ALLOCATE(Value, shape->fieldCount);
+    for (int i = 0; i < shape->fieldCount; i++) fields[i] = NIL_VAL;
+    instance->fields = fields;
+    instance->capacity = shape->fieldCount;
+    for (int i = 0; i < shape->fieldCount; i++) {
+      if (!readData(loader, &fields[i])) return false;
+    }
+  }
+  instance->shape = shape;
+  return true;
+}
+
+static bool fillClosure(Loader* loader, ObjClosure* closure) {
+  Reader* reader = &loader->reader;
+  readU32(reader); // the function, read when it was made
+  uint32_t upvalueCount = readU32(reader);
+  if (reader->failed) return false;
+  if (upvalueCount != (uint32_t)closure->upvalueCount) {
+    readFailed(reader, "bad closure");
+    return false;
+  }
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    Obj* upvalue;
+    if (!readObject(loader, OBJ_UPVALUE, false, &upvalue)) return false;
+    closure->upvalues[i] = (ObjUpvalue*)upvalue;
+  }
+  return true;
+}
+
+static bool fillObject(Loader* loader, int index) {
+  Reader* reader = &loader->reader;
+  reader->offset = loader->starts[index];
+  Obj* object = loader->objects[index];
+  bool filled = true;
+  switch (loader->types[index]) {
+  case RECORD_STRING:
+  case RECORD_BUILTIN:
+    return true;
+  case RECORD_FUNCTION:
+    filled = fillFunction(loader, (ObjFunction*)object);
+    break;
+  case RECORD_UPVALUE:
+    filled = readData(loader, &((ObjUpvalue*)object)->closed);
+    break;
+  case RECORD_SHAPE:
+    filled = fillShape(loader, (ObjShape*)object);
+    break;
+  case RECORD_CLASS: {
+    ObjClass* klass = (ObjClass*)object;
+    Obj* shape;
+    readU32(reader); // the name, read when it was made
+    filled = readObject(loader, OBJ_SHAPE, false, &shape) &&
+      readTable(loader, &klass->methods, isMethod);
+    if (filled) klass->shape = (ObjShape*)shape;
+    break;
+  }
+  case RECORD_LIST: {
+    ValueArray* array = &((ObjList*)object)->array;
+    uint32_t count = readU32(reader);
+    if (count > (reader->size - reader->offset) / VALUE_SIZE) {
+      readFailed(reader, "truncated");
+      return false;
+    }
+    for (uint32_t i = 0; i < count && filled; i++) {
+      Value value;
+      filled = readData(loader, &value);
+      if (filled) writeValueArray(array, value);
+    }
+    break;
+  }
+  case RECORD_MAP:
+    filled = readTable(loader, &((ObjMap*)object)->table, isData);
+    break;
+  case RECORD_INSTANCE:
+    filled = fillInstance(loader, (ObjInstance*)object);
+    break;
+  case RECORD_CLOSURE:
+    filled = fillClosure(loader, (ObjClosure*)object);
+    break;
+  case RECORD_BOUND_METHOD: {
+    ObjBoundMethod* bound = (ObjBoundMethod*)object;
+    Value method;
+    filled = readData(loader, &bound->receiver) &&
+      readValue(loader, &method);
+    if (filled && !isMethod(method)) {
+      readFailed(reader, "bad bound method");
+      return false;
+    }
+    if (filled) bound->method = AS_OBJ(method);
+    break;
+  }
+  }
+  return filled && endRecord(loader, index);
+}
+
+static bool readHeader(Loader* loader) {
+  Reader* reader = &loader->reader;
+  uint8_t* magic = readBytes(reader, 4);
+  if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0) {
+    readFailed(reader, "not an image");
+    return false;
+  }
+  uint32_t version = readU32(reader);
+  uint32_t byteOrder = readU32(reader);
+  uint32_t opcodeCount = readU32(reader);
+  uint32_t globalCount = readU32(reader);
+  uint32_t objectCount = readU32(reader);
+  if (reader->failed) return false;
+  if (version != SNAPSHOT_VERSION || byteOrder != BYTE_ORDER_MARK ||
+      opcodeCount != OPCODE_COUNT) {
+    readFailed(reader, "written by another version of clox");
+    return false;
+  }
+  if (globalCount > UINT16_COUNT || objectCount > reader->size / 8) {
+    readFailed(reader, "bad header");
+    return false;
+  }
+
+  loader->globalCount = (int)globalCount;
+  loader->globals = ALLOCATE(uint16_t, globalCount);
+  loader->globalStart = reader->offset;
+  if (readBytes(reader, globalCount * (4 + VALUE_SIZE)) == NULL) {
+    return false;
+  }
+
+  loader->objectCount = (int)objectCount;
+  loader->types = ALLOCATE(uint32_t, objectCount);
+  loader->starts = ALLOCATE(size_t, objectCount);
+  loader->ends = ALLOCATE(size_t, objectCount);
+  loader->objects = ALLOCATE(Obj*, objectCount);
+  for (int i = 0; i < loader->objectCount; i++) {
+    loader->objects[i] = NULL;
+    loader->types[i] = readU32(reader);
+    uint32_t length = readU32(reader);
+    if (reader->failed) return false;
+    if (loader->types[i] >= RECORD_TYPES || length % 4 != 0 ||
+        length > reader->size - reader->offset) {
+      readFailed(reader, "bad record");
+      return false;
+    }
+    loader->starts[i] = reader->offset;
+    loader->ends[i] = reader->offset + length;
+    reader->offset += length;
+  }
+  if (reader->offset != reader->size) {
+    readFailed(reader, "trailing bytes");
+    return false;
+  }
+  return true;
+}
+
+static bool readImage(Loader* loader) {
+  Reader* reader = &loader->reader;
+  if (!readHeader(loader)) return false;
+
+  loader->roots = newList();
+  push(OBJ_VAL(loader->roots));
+  for (int type = 0; type < RECORD_TYPES; type++) {
+    for (int i = 0; i < loader->objectCount; i++) {
+      if (loader->types[i] == (uint32_t)type &&
+          !createObject(loader, i)) {
+        return false;
+      }
+    }
+  }
+
+  // the global slots the code refers to, before it is verified
+  reader->offset = loader->globalStart;
+  for (int i = 0; i < loader->globalCount; i++) {
+    Obj* name;
+    if (!readObject(loader, OBJ_STRING, false, &name)) return false;
+    int slot = globalSlot((ObjString*)name);
+    if (slot > UINT16_MAX) {
+      readFailed(reader, "too many global variables");
+      return false;
+    }
+    loader->globals[i] = (uint16_t)slot;
+    reader->offset += VALUE_SIZE;
+  }
+
+  for (int i = 0; i < loader->objectCount; i++) {
+    if (!fillObject(loader, i)) return false;
+  }
+  for (int i = 0; i < loader->objectCount; i++) {
+    if (loader->types[i] == RECORD_FUNCTION &&
+        !verifyFunction((ObjFunction*)loader->objects[i], loader->globals,
+                        loader->globalCount)) {
+      readFailed(reader, "malformed code");
+      return false;
+    }
+  }
+
+  // nothing is defined until the whole image checked out
+  reader->offset = loader->globalStart;
+  for (int i = 0; i < loader->globalCount; i++) {
+    Value value;
+    readU32(reader);
+    if (!readValue(loader, &value)) return false;
+    if (IS_UNDEFINED(value)) continue;
+    if (!isData(value)) {
+      readFailed(reader, "bad global");
+      return false;
+    }
+    vm.globalValues.values[loader->globals[i]] = value;
+  }
+  return true;
+}
+
+bool loadSnapshot(const char* path) {
+  Loader loader;
+  if (!openReader(&loader.reader, path, "image")) return false;
+  loader.objectCount = 0;
+  loader.types = NULL;
+  loader.starts = NULL;
+  loader.ends = NULL;
+  loader.objects = NULL;
+  loader.globalCount = 0;
+  loader.globals = NULL;
+
+  // a failed image stays mapped like a bytecode file, see loadBytecode()
+  Value* stackTop = vm.stackTop;
+  bool loaded = readImage(&loader);
+
+  FREE_ARRAY(uint32_t, loader.types, loader.objectCount);
+  FREE_ARRAY(size_t, loader.starts, loader.objectCount);
+  FREE_ARRAY(size_t, loader.ends, loader.objectCount);
+  FREE_ARRAY(Obj*, loader.objects, loader.objectCount);
+  FREE_ARRAY(uint16_t, loader.globals, loader.globalCount);
+  vm.stackTop = stackTop;
+  return loaded;
+}
@@ -0,0 +1,38 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+// heap images. `clox --snapshot out.img prelude.lox` runs the prelude
+// and saves everything its globals can reach, `clox --image out.img
+// script.lox` starts from that heap instead of running the prelude
+// again.
+//
+// an image is a table of objects that refer to each other by index,
+// so it can be loaded at any address. the globals come first, then one
+// record per object. numbers are 32-bit in the writer's byte order and
+// every record is padded to 4 bytes, as in bytecode.h:
+//
+//   header     "lxim", version, byte order mark, opcode count,
+//              global count, object count
+//   global     name (a string's index), value
+//   value      tag, then 8 bytes: a double or an object's index
+//   record     type, byte length, the object
+//
+// a function record is laid out like a function of a bytecode file,
+// except that its constants are values, and its code is used in place
+// from the mapped image. inline caches come back empty, jitted and
+// register code is left behind. the natives and the List class are the
+// new vm's own, the image only names them.
+//
+// loading creates every object first and then fills them in, checking
+// that each reference has the type the vm expects there, and verifies
+// every function the way loadBytecode() does.
+#define SNAPSHOT_VERSION 1
+
+// false after reporting why the heap couldn't be saved.
+bool writeSnapshot(const char* path);
+// false after reporting an unreadable or invalid image.
+bool loadSnapshot(const char* path);
+
+#endif
@@ -14,6 +14,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
 
 typedef uint64_t Value;
 
@@ -30,6 +31,9 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+// only ever stored in a global slot that has not been defined yet
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -51,7 +55,8 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED // a global slot that has not been defined yet
 } ValueType;
 
 typedef struct {
@@ -76,6 +81,8 @@ typedef struct {
 #define NIL_VAL            ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)  ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL      ((Value){VAL_UNDEFINED, {.number = 0}})
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #endif
 
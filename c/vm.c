@@ -1,14 +1,18 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+#include "regcode.h"
 
 VM vm;
 
@@ -18,6 +22,11 @@ static void resetStack() {
   vm.openUpvalues = NULL;
 }
 
+// frames printed from each end of a runtime error's stack trace
+#define TRACE_FRAMES 16
+
+// run() writes its cached ip and stack top back before calling here,
+// so every frame's ip points just past the failing instruction.
 static void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
@@ -26,13 +35,19 @@ static void runtimeError(const char* format, ...) {
   fputs("\n", stderr);
 
   for (int i = vm.frameCount -1; i >= 0; i--) {
+    // deep recursion only shows both ends
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+      fprintf(stderr, "[%d more frames]\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     // -1 becaulse the IP is sitting on the next instruction to be
     // executed.
     size_t instruction = frame->ip - function->chunk.code -1;
-    fprintf(stderr, "[line %d] in ",
-      function->chunk.lines[instruction]);
+    int line = getLine(&function->chunk, (int)instruction);
+    if (line > 0) fprintf(stderr, "[line %d] ", line);
+    fprintf(stderr, "in ");
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -90,6 +105,9 @@ static Value typeNative(int argCount, Value* args, int* errRet) {
     case OBJ_STRING:
       s = "string";
       break;
+    case OBJ_SHAPE:
+      s = "shape";
+      break;
     case OBJ_UPVALUE:
       s = "upvalue";
       break;
@@ -108,7 +126,8 @@ static void defineNative(const char* name, NativeFn function,
     int arity) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function, arity)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
@@ -122,6 +141,7 @@ static void defineNativeMethod(ObjClass *klass, const char* name, NativeFn fn,
   push(OBJ_VAL(native));
 
   tableSet(&klass->methods, AS_STRING(vm.stack[0]), vm.stack[1]);
+  tableBarrier((Obj*)klass, AS_STRING(vm.stack[0]), vm.stack[1]);
 
   pop(); //str
   pop(); //native
@@ -157,12 +177,14 @@ static Value listInsertAt(int argCount, Value* args, int* errRet) {
   ObjList* list = AS_LIST(args[-1]);
   int index = (int)AS_NUMBER(args[0]);
   insertValueArray(&list->array, index, args[1]);
+  writeBarrier((Obj*)list, args[1]);
   return TRUE_VAL;
 }
 
 static Value listPush(int argCount, Value* args, int* errRet) {
   ObjList* list = AS_LIST(args[-1]);
   writeValueArray(&list->array, args[0]);
+  writeBarrier((Obj*)list, args[0]);
   return TRUE_VAL;
 }
 
@@ -217,17 +239,80 @@ static void initListClass() {
   defineNativeMethod(vm.listClass, "size", listSize, 0);
 }
 
+// a bigger copy of the vm's stack or frames, exits when out of memory.
+static void* growCopy(void* array, size_t oldSize, size_t newSize) {
+  void* grown = malloc(newSize);
+  if (grown == NULL) {
+    fprintf(stderr, "not enough memory to grow the vm stack.\n");
+    exit(1);
+  }
+  if (oldSize > 0) memcpy(grown, array, oldSize);
+  return grown;
+}
+
+static void growFrames() {
+  int capacity = vm.frameCapacity * 2;
+  CallFrame* frames = growCopy(vm.frames,
+    sizeof(CallFrame) * vm.frameCapacity, sizeof(CallFrame) * capacity);
+  free(vm.frames);
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+}
+
+// make room for count more values above the stack top. everything
+// pointing into the old stack is moved over to the new one.
+static void ensureStack(int count) {
+  int needed = (int)(vm.stackTop - vm.stack) + count;
+  if (needed <= vm.stackCapacity) return;
+
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) capacity *= 2;
+
+  Value* old = vm.stack;
+  Value* stack = growCopy(old, sizeof(Value) * vm.stackCapacity,
+    sizeof(Value) * capacity);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - old);
+  }
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - old);
+  }
+  vm.stackTop = stack + (vm.stackTop - old);
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+  free(old);
+}
+
 void initVM() { 
+  vm.frames = growCopy(NULL, 0, sizeof(CallFrame) * FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.maxFrames = FRAMES_MAX;
+  vm.stack = growCopy(NULL, 0, sizeof(Value) * STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
   resetStack();
   vm.objects = NULL;
+  vm.nursery = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.nurseryBytes = 0;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.youngCaches = NULL;
+  vm.youngCacheCount = 0;
+  vm.youngCacheCapacity = 0;
+  vm.minorGC = false;
+  vm.minorCollections = 0;
+  vm.fullCollections = 0;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.strings);
 
   vm.initString = NULL; // copyString 可以会触发gc, 读到initString
@@ -237,14 +322,68 @@ void initVM() {
   defineNative("len", lenNative, 1);
   defineNative("type", typeNative, 1);
 
+  vm.instructions = 0;
+  vm.quickened = 0;
+  vm.deoptimized = 0;
+  vm.cacheHits = 0;
+  vm.cacheMisses = 0;
+  vm.cacheMegamorphic = 0;
+
+  vm.compiledCode = false;
+  vm.registers = false;
+  vm.nativeDepth = 0;
+  vm.jit = false;
+  vm.lazy = false;
+  vm.jitCompiled = 0;
+  vm.jitTraces = 0;
+  vm.jitTraceAborts = 0;
+  vm.jitBytes = 0;
+
   initListClass();
 }
 
 void freeVM() { 
-  freeTable(&vm.globals);
+#ifdef DEBUG_PRINT_STATS
+  fprintf(stderr, "-- instructions %zu\n", vm.instructions);
+  fprintf(stderr, "-- quickened %zu, deoptimized %zu\n",
+    vm.quickened, vm.deoptimized);
+  fprintf(stderr, "-- inline cache hits %zu, misses %zu, megamorphic %zu\n",
+    vm.cacheHits, vm.cacheMisses, vm.cacheMegamorphic);
+  fprintf(stderr, "-- jit compiled %zu functions, %zu traces, %zu bytes\n",
+    vm.jitCompiled, vm.jitTraces, vm.jitBytes);
+  fprintf(stderr, "-- jit trace recordings aborted %zu\n",
+    vm.jitTraceAborts);
+  fprintf(stderr, "-- gc minor %zu, full %zu\n",
+    vm.minorCollections, vm.fullCollections);
+#endif
+
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.strings);
   vm.initString = NULL;
   freeObjects();
+  freeBytecodeFiles();
+  free(vm.frames);
+  free(vm.stack);
+}
+
+// the slot of a global name, allocated the first time the name is
+// compiled. slots live as long as the vm so redefining a name in the
+// repl reuses it.
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+
+  push(OBJ_VAL(name)); // for collector
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  int index = vm.globalValues.count - 1;
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
 }
 
 void push(Value value) {
@@ -261,18 +400,35 @@ static Value peek(int distance) {
   return vm.stackTop[-1 -distance];
 }
 
-static bool call(ObjClosure* closure, int argCount) { 
+// call() and callValue() work on vm.stackTop, run() stores its cached
+// stack top before calling them and reloads the new frame afterwards.
+// a body clox --lazy only skimmed is compiled by its first call.
+static bool compileBody(ObjFunction* function) {
+  if (compileLazy(function)) return true;
+  runtimeError("could not compile %s().", function->name->chars);
+  return false;
+}
+
+static inline bool call(ObjClosure* closure, int argCount) {
+  if (closure->function->lazy != NULL && !compileBody(closure->function)) {
+    return false;
+  }
   if (argCount != closure->function->arity) {
     runtimeError("expected %d arguments but got %d.",
       closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount == vm.maxFrames) {
     runtimeError("stack overflow.");
     return false;
   }
 
+  // pointers to frames and into the stack held across a call have to
+  // be reloaded afterwards.
+  if (vm.frameCount == vm.frameCapacity) growFrames();
+  ensureStack(closure->function->frameSize);
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
@@ -342,16 +498,127 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,
   return callValue(method, argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+#ifdef DEBUG_PRINT_STATS
+#define CACHE_STAT(counter) (vm.counter++)
+#define COUNT_INSTRUCTION() (vm.instructions++)
+#else
+#define CACHE_STAT(counter) do { } while (false)
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif
+
+static inline ICEntry* findCacheEntry(InlineCache* cache, Obj* key) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].key == key) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// shapes never change, so an entry stays valid for as long as its key
+// lives. instances in dictionary mode have no shape and aren't cached.
+static void updateCache(InlineCache* cache, Obj* key,
+    int index, Value value) {
+  if (key == NULL) return;
+
+  ICEntry* entry = findCacheEntry(cache, key);
+  if (entry == NULL) {
+    if (cache->count == IC_WAYS) {
+      cache->megamorphic = true;
+      return;
+    }
+    entry = &cache->entries[cache->count++];
+    entry->key = key;
+  }
+  entry->index = index;
+  entry->value = value;
+  if (key->generation == GEN_YOUNG ||
+      (IS_OBJ(value) && AS_OBJ(value)->generation == GEN_YOUNG)) {
+    rememberCache(cache);
+  }
+}
+
+static void cacheMiss(InlineCache* cache) {
+  if (cache->megamorphic) {
+    CACHE_STAT(cacheMegamorphic);
+  } else {
+    CACHE_STAT(cacheMisses);
+  }
+}
+
+// the shape, or for lists the class, property caches are keyed on.
+// NULL for anything else and for instances in dictionary mode.
+static inline Obj* cacheKey(Value receiver) {
+  if (IS_INSTANCE(receiver)) return (Obj*)AS_INSTANCE(receiver)->shape;
+  if (IS_LIST(receiver)) return (Obj*)vm.listClass;
+  return NULL;
+}
+
+// OP_GET_PROPERTY after its cache missed: look name up on the receiver
+// at the top of the stack, refill the cache and replace the receiver
+// with the field or a bound method.
+static bool getProperty(ObjString* name, InlineCache* cache) {
+  Value receiver = peek(0);
+  Obj* key = cacheKey(receiver);
+  ObjClass* klass;
+
+  cacheMiss(cache);
+  if (IS_INSTANCE(receiver)) {
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    Value value;
+    if (getField(instance, name, &value)) {
+      if (key != NULL) {
+        updateCache(cache, key, shapeSlot(instance->shape, name), NIL_VAL);
+      }
+      vm.stackTop[-1] = value;
+      return true;
+    }
+    klass = instance->klass;
+  } else if (IS_LIST(receiver)) {
+    klass = vm.listClass;
+  } else {
+    runtimeError("only lists and instances have properties.");
+    return false;
+  }
+
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("undefined property '%s'.", name->chars);
+    return false;
+  }
+  updateCache(cache, key, -1, method);
+
+  ObjBoundMethod* bound = newBoundMethod(receiver, AS_OBJ(method));
+  vm.stackTop[-1] = OBJ_VAL(bound);
+  return true;
+}
+
+// OP_SET_PROPERTY after its cache missed, the instance was checked.
+static void setProperty(ObjString* name, InlineCache* cache) {
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  ObjShape* shape = instance->shape;
+
+  cacheMiss(cache);
+  setField(instance, name, peek(0));
+  if (instance->shape != NULL) {
+    updateCache(cache, (Obj*)shape, shapeSlot(instance->shape, name),
+      instance->shape == shape ? NIL_VAL : OBJ_VAL(instance->shape));
+  }
+}
+
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
   Value receiver = peek(argCount);
+  Obj* key = cacheKey(receiver);
   ObjClass* klass;
 
+  cacheMiss(cache);
   if (IS_LIST(receiver)) {
     klass = vm.listClass;
   } else if (IS_INSTANCE(receiver)){
     ObjInstance* instance = AS_INSTANCE(receiver);
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (getField(instance, name, &value)) {
+      if (key != NULL) {
+        updateCache(cache, key, shapeSlot(instance->shape, name), NIL_VAL);
+      }
       vm.stackTop[-argCount - 1] = value;
       return callValue(value, argCount);
     }
@@ -361,7 +628,29 @@ static bool invoke(ObjString* name, int argCount) {
     return false;
   }
 
-  return invokeFromClass(klass, name, argCount);
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("undefined property '%s'.", name->chars);
+    return false;
+  }
+  updateCache(cache, key, -1, method);
+  return callValue(method, argCount);
+}
+
+// invoke() behind the call site's cache.
+static inline bool invokeCached(ObjString* name, int argCount,
+    InlineCache* cache) {
+  Value receiver = peek(argCount);
+  ICEntry* entry = findCacheEntry(cache, cacheKey(receiver));
+  if (entry == NULL) return invoke(name, argCount, cache);
+
+  CACHE_STAT(cacheHits);
+  Value callee = entry->value;
+  if (entry->index >= 0) {
+    callee = AS_INSTANCE(receiver)->fields[entry->index];
+    vm.stackTop[-argCount - 1] = callee;
+  }
+  return callValue(callee, argCount);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
@@ -405,14 +694,54 @@ static void closeUpvalues(Value* last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    rememberObject((Obj*)upvalue);
     vm.openUpvalues = upvalue->next;
   }
 }
 
+// a call in tail position. a closure, also through a bound method,
+// takes over the frame of the function returning its result. anything
+// else is called normally and the OP_RETURN after the call returns what
+// it produced.
+static bool tailCall(int argCount) {
+  Value callee = peek(argCount);
+  ObjClosure* closure;
+  if (IS_CLOSURE(callee)) {
+    closure = AS_CLOSURE(callee);
+  } else if (IS_BOUND_METHOD(callee) &&
+             AS_BOUND_METHOD(callee)->method->type == OBJ_CLOSURE) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    closure = (ObjClosure*)bound->method;
+  } else {
+    return callValue(callee, argCount);
+  }
+
+  if (closure->function->lazy != NULL && !compileBody(closure->function)) {
+    return false;
+  }
+  if (argCount != closure->function->arity) {
+    runtimeError("expected %d arguments but got %d.",
+      closure->function->arity, argCount);
+    return false;
+  }
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  Value* args = vm.stackTop - argCount - 1;
+  memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  ensureStack(closure->function->frameSize);
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
 static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  tableBarrier((Obj*)klass, name, method);
   pop();
 }
 
@@ -451,433 +780,1466 @@ void makeList(uint8_t length) {
   push(value);
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount-1];
+// the list below the count values on top of the stack gets them.
+static void appendList(int count) {
+  ObjList* list = AS_LIST(peek(count));
+  for (Value* value = vm.stackTop - count; value < vm.stackTop; value++) {
+    writeValueArray(&list->array, *value);
+    writeBarrier((Obj*)list, *value);
+  }
+  vm.stackTop -= count;
+}
+
+static InterpretResult run(int baseFrame);
+
+#ifdef JIT
+// calls plus loop back edges before a function is compiled
+#define JIT_THRESHOLD 1000
+#endif
+
+// hand the top frame to its compiled code, with the jit on once the
+// function is hot.
+static CodeStatus runCompiled(CallFrame* frame) {
+  // calls made by compiled code nest on the c stack, past this many
+  // the frames above stay in the interpreter.
+  if (vm.nativeDepth >= NATIVE_DEPTH_MAX) return CODE_EXIT;
+
+  ObjFunction* function = frame->closure->function;
+#ifdef JIT
+  if (function->compiled == NULL && vm.jit) {
+    if (function->hotness < JIT_THRESHOLD) {
+      function->hotness++;
+      return CODE_EXIT;
+    }
+    function->native = jitCompile(function);
+    if (function->native == NULL) {
+      function->hotness = INT32_MIN; // out of executable memory, stay put
+      return CODE_EXIT;
+    }
+    function->compiled = jitEnter;
+  }
+#endif
+  if (function->compiled == NULL) return CODE_EXIT;
+  return (CodeStatus)function->compiled(frame);
+}
+
+// keep running compiled code while frames return into callers that
+// have some. CODE_RETURNED once the frame above baseFrame returned,
+// CODE_EXIT when the interpreter has to carry on with the top frame.
+static CodeStatus enterCompiled(int baseFrame) {
+  for (;;) {
+    CodeStatus status = runCompiled(&vm.frames[vm.frameCount - 1]);
+    if (status != CODE_RETURNED) return status;
+    if (vm.frameCount == baseFrame || vm.frameCount == 0) return status;
+  }
+}
+
+// run a frame just pushed for compiled code until it returned.
+static bool finishCall(int frameCount) {
+  if (vm.frameCount == frameCount) return true; // native fn
+  vm.nativeDepth++;
+  CodeStatus status = enterCompiled(frameCount);
+  bool ok = status == CODE_RETURNED ||
+    (status == CODE_EXIT && run(frameCount) == INTERPRET_OK);
+  vm.nativeDepth--;
+  return ok;
+}
+
+bool vmCall(int argCount) {
+  int frameCount = vm.frameCount;
+  if (!callValue(peek(argCount), argCount)) return false;
+  return finishCall(frameCount);
+}
+
+bool vmInvoke(ObjString* name, int argCount, InlineCache* cache) {
+  int frameCount = vm.frameCount;
+  if (!invokeCached(name, argCount, cache)) return false;
+  return finishCall(frameCount);
+}
+
+#ifdef JIT
+// pushes the frame for a call from jitted code to a closure with jitted
+// code of its own, the caller then calls straight into it. NULL leaves
+// the call to vmCall() or vmInvoke(), which have the checks and errors.
+static uint8_t* pushJitted(Value callee, int argCount) {
+  if (!IS_CLOSURE(callee)) return NULL;
+  ObjClosure* closure = AS_CLOSURE(callee);
+  ObjFunction* function = closure->function;
+  if (function->compiled != jitEnter || argCount != function->arity ||
+      vm.nativeDepth >= NATIVE_DEPTH_MAX ||
+      vm.frameCount == vm.frameCapacity || vm.frameCount == vm.maxFrames ||
+      (vm.stackTop - vm.stack) + function->frameSize > vm.stackCapacity) {
+    return NULL;
+  }
+
+  CallFrame* frame = &vm.frames[vm.frameCount++];
+  frame->closure = closure;
+  frame->ip = function->chunk.code;
+  frame->slots = vm.stackTop - argCount - 1;
+  return function->native->code + function->native->entries[0];
+}
+
+uint8_t* vmCallEntry(int argCount) {
+  return pushJitted(peek(argCount), argCount);
+}
+
+// only a method the call site has cached, the receiver stays in slot 0
+uint8_t* vmInvokeEntry(InlineCache* cache, int argCount) {
+  ICEntry* entry = findCacheEntry(cache, cacheKey(peek(argCount)));
+  if (entry == NULL || entry->index >= 0) return NULL;
+  CACHE_STAT(cacheHits);
+  return pushJitted(entry->value, argCount);
+}
+
+// a callee entered through vmCallEntry() or vmInvokeEntry() that didn't
+// return: reported an error, or left its frame for the interpreter.
+bool vmFinishJitted(int status) {
+  if (status == CODE_ERROR) return false;
+  vm.nativeDepth++;
+  bool ok = run(vm.frameCount - 1) == INTERPRET_OK;
+  vm.nativeDepth--;
+  return ok;
+}
+#endif
+
+// OP_RETURN of a native frame, leaves the result where the interpreter
+// would.
+void vmReturn() {
+  Value result = pop();
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  if (vm.frameCount == 0) {
+    vm.stackTop = frame->slots;
+    return;
+  }
+  frame->slots[0] = result;
+  vm.stackTop = frame->slots + 1;
+}
+
+bool vmGetProperty(ObjString* name, InlineCache* cache) {
+  Value receiver = peek(0);
+  ICEntry* entry = findCacheEntry(cache, cacheKey(receiver));
+  if (entry == NULL) return getProperty(name, cache);
 
-#define READ_BYTE()     (*frame->ip++)
-#define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  CACHE_STAT(cacheHits);
+  if (entry->index >= 0) {
+    vm.stackTop[-1] = AS_INSTANCE(receiver)->fields[entry->index];
+  } else {
+    ObjBoundMethod* bound = newBoundMethod(receiver, AS_OBJ(entry->value));
+    vm.stackTop[-1] = OBJ_VAL(bound);
+  }
+  return true;
+}
+
+bool vmSetProperty(ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("only instances have fields.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  ICEntry* entry = findCacheEntry(cache, (Obj*)instance->shape);
+  if (entry != NULL && IS_NIL(entry->value)) {
+    CACHE_STAT(cacheHits);
+    instance->fields[entry->index] = peek(0);
+    writeBarrier((Obj*)instance, peek(0));
+  } else if (entry != NULL) {
+    CACHE_STAT(cacheHits);
+    addField(instance, AS_SHAPE(entry->value), peek(0));
+  } else {
+    setProperty(name, cache);
+  }
+
+  Value value = pop();
+  vm.stackTop[-1] = value;
+  return true;
+}
+
+void vmPrint(Value value) {
+  printValue(value);
+  printf("\n");
+}
+
+// a function whose quickened instructions keep failing their guards
+// stays on the generic ones instead of flipping back and forth.
+#define MAX_DEOPTS 16
+
+// runs until the frame count drops back to baseFrame, 0 for the script
+// and the count before the call for functions called from native code.
+static InterpretResult run(int baseFrame) {
+  // the hot interpreter state lives in locals so the compiler can keep
+  // it in registers. it is written back to the frame and to vm.stackTop
+  // only when control leaves the loop: calls, returns, anything that can
+  // allocate (and so collect) and runtime errors.
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* slots;
+  Value* constants;
+  Value* stackTop;
+
+#define LOAD_FRAME() do { \
+  frame = &vm.frames[vm.frameCount - 1]; \
+  ip = frame->ip; \
+  slots = frame->slots; \
+  constants = frame->closure->function->chunk.constants.values; \
+  stackTop = vm.stackTop; \
+} while (false)
+
+#define STORE_FRAME() do { \
+  frame->ip = ip; \
+  vm.stackTop = stackTop; \
+} while (false)
+
+#define PUSH(value)     (*stackTop++ = (value))
+#define POP()           (*--stackTop)
+#define DROP()          (stackTop--)
+#define PEEK(distance)  (stackTop[-1 - (distance)])
+
+#define READ_BYTE()     (*ip++)
+#define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
+#define READ_LONG()     (ip += 3, (ip[-3] << 16) | (ip[-2] << 8) | ip[-1])
+// the constant of an instruction with a _LONG form, read from either
+#define READ_OPERAND(longOp) (ip[-1] == (longOp) ? READ_LONG() : READ_BYTE())
+#define READ_LONG_STRING(longOp) AS_STRING(constants[READ_OPERAND(longOp)])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define READ_CACHE() \
+  (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...) do { \
+  STORE_FRAME(); \
+  runtimeError(__VA_ARGS__); \
+  return INTERPRET_RUNTIME_ERROR; \
+} while (false)
 
-#define BINARY_OP(valueType, op) do { \
-  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-    runtimeError("operands must be numbers."); \
-    return INTERPRET_RUNTIME_ERROR; \
+#ifdef DEBUG_PRINT_STATS
+#define QUICKEN_STAT(counter) (vm.counter++)
+#else
+#define QUICKEN_STAT(counter) do { } while (false)
+#endif
+
+// rewrite the one byte instruction just read into its specialized form.
+#define QUICKEN(op) do { \
+  if (frame->closure->function->deopts < MAX_DEOPTS) { \
+    ip[-1] = op; \
+    QUICKEN_STAT(quickened); \
   } \
-  double b = AS_NUMBER(pop()); \
-  double a = AS_NUMBER(pop()); \
-  push(valueType(a op b)); \
 } while (false)
 
-  for (;;) {
+// a type guard failed, put the generic instruction back and run it.
+#define DEOPTIMIZE(op) do { \
+  ip[-1] = op; \
+  frame->closure->function->deopts++; \
+  QUICKEN_STAT(deoptimized); \
+  ip--; \
+  DISPATCH(); \
+} while (false)
+
+#define BINARY_OP(valueType, op, quickOp) do { \
+  if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+    RUNTIME_ERROR("operands must be numbers."); \
+  } \
+  QUICKEN(quickOp); \
+  double b = AS_NUMBER(POP()); \
+  double a = AS_NUMBER(PEEK(0)); \
+  stackTop[-1] = valueType(a op b); \
+} while (false)
+
+#define NEGATED_OP(op) do { \
+  if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+    RUNTIME_ERROR("operands must be numbers."); \
+  } \
+  double b = AS_NUMBER(POP()); \
+  double a = AS_NUMBER(PEEK(0)); \
+  stackTop[-1] = BOOL_VAL(!(a op b)); \
+} while (false)
+
+#define BINARY_NUM_OP(valueType, op, genericOp) do { \
+  if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+    DEOPTIMIZE(genericOp); \
+  } \
+  double b = AS_NUMBER(POP()); \
+  double a = AS_NUMBER(PEEK(0)); \
+  stackTop[-1] = valueType(a op b); \
+} while (false)
+
+#define ENTER_COMPILED() do { \
+  if (vm.compiledCode) { \
+    STORE_FRAME(); \
+    switch (enterCompiled(baseFrame)) { \
+    case CODE_RETURNED: return INTERPRET_OK; \
+    case CODE_ERROR:    return INTERPRET_RUNTIME_ERROR; \
+    case CODE_EXIT:     break; \
+    } \
+    LOAD_FRAME(); \
+  } \
+} while (false)
+#ifdef JIT
+// at a loop header, ip
+#define ENTER_TRACE() do { \
+  if (vm.jit) { \
+    STORE_FRAME(); \
+    jitLoop(frame); \
+    LOAD_FRAME(); \
+  } \
+} while (false)
+#else
+#define ENTER_TRACE() do { } while (false)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-      (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() do { \
+  printf("          "); \
+  for (Value* slot = vm.stack; slot < stackTop; slot++) { \
+    printf("[ "); \
+    printValue(*slot); \
+    printf(" ]"); \
+  } \
+  printf("\n"); \
+  disassembleInstruction(&frame->closure->function->chunk, \
+    (int)(ip - frame->closure->function->chunk.code)); \
+} while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
+#ifdef COMPUTED_GOTO
+  // one indirect jump per handler instead of the single shared one
+  // at the top of the switch, so the branch predictor can learn
+  // opcode to opcode transitions.
+  static void* dispatchTable[] = {
+    [OP_CONSTANT]        = &&L_OP_CONSTANT,
+    [OP_CONSTANT_LONG]   = &&L_OP_CONSTANT_LONG,
+    [OP_NIL]             = &&L_OP_NIL,
+    [OP_TRUE]            = &&L_OP_TRUE,
+    [OP_FALSE]           = &&L_OP_FALSE,
+    [OP_POP]             = &&L_OP_POP,
+    [OP_DUP]             = &&L_OP_DUP,
+    [OP_GET_LOCAL]       = &&L_OP_GET_LOCAL,
+    [OP_SET_LOCAL]       = &&L_OP_SET_LOCAL,
+    [OP_GET_LOCAL_LONG]  = &&L_OP_GET_LOCAL_LONG,
+    [OP_SET_LOCAL_LONG]  = &&L_OP_SET_LOCAL_LONG,
+    [OP_GET_GLOBAL]      = &&L_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL]   = &&L_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]      = &&L_OP_SET_GLOBAL,
+    [OP_LIST]            = &&L_OP_LIST,
+    [OP_LIST_APPEND]     = &&L_OP_LIST_APPEND,
+    [OP_MAP_INIT]        = &&L_OP_MAP_INIT,
+    [OP_MAP_DATA]        = &&L_OP_MAP_DATA,
+    [OP_GET_INDEX]       = &&L_OP_GET_INDEX,
+    [OP_SET_INDEX]       = &&L_OP_SET_INDEX,
+    [OP_SHIFT_INDEX]     = &&L_OP_SHIFT_INDEX,
+    [OP_GET_UPVALUE]     = &&L_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE]     = &&L_OP_SET_UPVALUE,
+    [OP_GET_PROPERTY]    = &&L_OP_GET_PROPERTY,
+    [OP_GET_PROPERTY_LONG] = &&L_OP_GET_PROPERTY_LONG,
+    [OP_SET_PROPERTY]    = &&L_OP_SET_PROPERTY,
+    [OP_SET_PROPERTY_LONG] = &&L_OP_SET_PROPERTY_LONG,
+    [OP_GET_SUPER]       = &&L_OP_GET_SUPER,
+    [OP_GET_SUPER_LONG]  = &&L_OP_GET_SUPER_LONG,
+    [OP_EQUAL]           = &&L_OP_EQUAL,
+    [OP_GREATER]         = &&L_OP_GREATER,
+    [OP_LESS]            = &&L_OP_LESS,
+    [OP_INC]             = &&L_OP_INC,
+    [OP_DEC]             = &&L_OP_DEC,
+    [OP_ADD]             = &&L_OP_ADD,
+    [OP_SUBTRACT]        = &&L_OP_SUBTRACT,
+    [OP_MULTIPLY]        = &&L_OP_MULTIPLY,
+    [OP_DIVIDE]          = &&L_OP_DIVIDE,
+    [OP_NOT]             = &&L_OP_NOT,
+    [OP_NEGATE]          = &&L_OP_NEGATE,
+    [OP_PRINT]           = &&L_OP_PRINT,
+    [OP_JUMP]            = &&L_OP_JUMP,
+    [OP_JUMP_IF_FALSE]   = &&L_OP_JUMP_IF_FALSE,
+    [OP_LOOP]            = &&L_OP_LOOP,
+    [OP_CALL]            = &&L_OP_CALL,
+    [OP_TAIL_CALL]       = &&L_OP_TAIL_CALL,
+    [OP_INVOKE]          = &&L_OP_INVOKE,
+    [OP_INVOKE_LONG]     = &&L_OP_INVOKE_LONG,
+    [OP_SUPER_INVOKE]    = &&L_OP_SUPER_INVOKE,
+    [OP_SUPER_INVOKE_LONG] = &&L_OP_SUPER_INVOKE_LONG,
+    [OP_CLOSURE]         = &&L_OP_CLOSURE,
+    [OP_CLOSURE_LONG]    = &&L_OP_CLOSURE_LONG,
+    [OP_CLOSE_UPVALUE]   = &&L_OP_CLOSE_UPVALUE,
+    [OP_RETURN]          = &&L_OP_RETURN,
+    [OP_INHERIT]         = &&L_OP_INHERIT,
+    [OP_CLASS]           = &&L_OP_CLASS,
+    [OP_CLASS_LONG]      = &&L_OP_CLASS_LONG,
+    [OP_METHOD]          = &&L_OP_METHOD,
+    [OP_METHOD_LONG]     = &&L_OP_METHOD_LONG,
+    [OP_FOR_PREP]        = &&L_OP_FOR_PREP,
+    [OP_FOR_LOOP]        = &&L_OP_FOR_LOOP,
+    [OP_ADD_LOCALS]      = &&L_OP_ADD_LOCALS,
+    [OP_LESS_LOCAL_CONST_JUMP] = &&L_OP_LESS_LOCAL_CONST_JUMP,
+    [OP_INC_LOCAL]       = &&L_OP_INC_LOCAL,
+    [OP_DEC_LOCAL]       = &&L_OP_DEC_LOCAL,
+    [OP_SET_LOCAL_POP]   = &&L_OP_SET_LOCAL_POP,
+    [OP_POPN]            = &&L_OP_POPN,
+    [OP_NOT_EQUAL]       = &&L_OP_NOT_EQUAL,
+    [OP_LESS_EQUAL]      = &&L_OP_LESS_EQUAL,
+    [OP_GREATER_EQUAL]   = &&L_OP_GREATER_EQUAL,
+    [OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
+    [OP_ADD_NUM]         = &&L_OP_ADD_NUM,
+    [OP_ADD_STR]         = &&L_OP_ADD_STR,
+    [OP_SUBTRACT_NUM]    = &&L_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]    = &&L_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]      = &&L_OP_DIVIDE_NUM,
+    [OP_EQUAL_NUM]       = &&L_OP_EQUAL_NUM,
+    [OP_GREATER_NUM]     = &&L_OP_GREATER_NUM,
+    [OP_LESS_NUM]        = &&L_OP_LESS_NUM,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op)       L_##op
+#define DISPATCH()     do { \
+  TRACE_INSTRUCTION(); \
+  COUNT_INSTRUCTION(); \
+  goto *dispatchTable[READ_BYTE()]; \
+} while (false)
+#else
+#define INTERPRET_LOOP loop: TRACE_INSTRUCTION(); COUNT_INSTRUCTION(); \
+  switch (READ_BYTE())
+#define CASE(op)       case op
+#define DISPATCH()     goto loop
+#endif
+
+  LOAD_FRAME();
+
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT): {
       Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_NIL:      push(NIL_VAL); break;
-    case OP_TRUE:     push(BOOL_VAL(true)); break;
-    case OP_FALSE:    push(BOOL_VAL(false)); break;
-    case OP_POP:      pop(); break;
-    case OP_DUP:      push(peek(0)); break;
-    case OP_GET_LOCAL: {
-      uint8_t slot= READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+    CASE(OP_CONSTANT_LONG): {
+      int index = READ_BYTE() << 16;
+      index |= READ_SHORT();
+      PUSH(constants[index]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_NIL):      PUSH(NIL_VAL); DISPATCH();
+    CASE(OP_TRUE):     PUSH(BOOL_VAL(true)); DISPATCH();
+    CASE(OP_FALSE):    PUSH(BOOL_VAL(false)); DISPATCH();
+    CASE(OP_POP):      DROP(); DISPATCH();
+    CASE(OP_DUP):      *stackTop = stackTop[-1]; stackTop++; DISPATCH();
+    CASE(OP_GET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      PUSH(slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString* name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    CASE(OP_DEFINE_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      vm.globalValues.values[slot] = POP();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value* global = &vm.globalValues.values[slot];
+      if (IS_UNDEFINED(*global)) {
+        RUNTIME_ERROR("undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      break;
+      *global = PEEK(0);
+      DISPATCH();
     }
-    case OP_LIST: {
-      uint8_t length = READ_BYTE(); 
+    CASE(OP_LIST): {
+      uint8_t length = READ_BYTE();
+      STORE_FRAME();
       makeList(length);
-      break;
+      stackTop = vm.stackTop;
+      DISPATCH();
     }
-    case OP_MAP_INIT: {
-      push(OBJ_VAL(newMap()));
-      break;
+    CASE(OP_LIST_APPEND): {
+      uint8_t count = READ_BYTE();
+      // the compiler's code always has the list there, a loaded file
+      // (see bytecode.h) is only checked for its stack height.
+      if (!IS_LIST(PEEK(count))) {
+        RUNTIME_ERROR("list data can only be added to a list.");
+      }
+      STORE_FRAME();
+      appendList(count);
+      stackTop = vm.stackTop;
+      DISPATCH();
     }
-    case OP_MAP_DATA: {
-      if (!IS_MAP(peek(2))) {
-        runtimeError("map data can only be added to a map.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_MAP_INIT): {
+      STORE_FRAME();
+      ObjMap* map = newMap();
+      PUSH(OBJ_VAL(map));
+      DISPATCH();
+    }
+    CASE(OP_MAP_DATA): {
+      if (!IS_MAP(PEEK(2))) {
+        RUNTIME_ERROR("map data can only be added to a map.");
       }
-      if (!IS_STRING(peek(1))) {
-        runtimeError("map key must be a string.");
+      if (!IS_STRING(PEEK(1))) {
+        RUNTIME_ERROR("map key must be a string.");
       }
-      ObjMap* map = AS_MAP(peek(2));
-      ObjString* key = AS_STRING(peek(1));
-      tableSet(&map->table, key, peek(0));
-      pop(); // value
-      pop(); // key
-      break;
+      ObjMap* map = AS_MAP(PEEK(2));
+      ObjString* key = AS_STRING(PEEK(1));
+      STORE_FRAME();
+      tableSet(&map->table, key, PEEK(0));
+      tableBarrier((Obj*)map, key, PEEK(0));
+      stackTop -= 2; // value and key
+      DISPATCH();
     }
-    case OP_GET_INDEX: {
-      if (IS_LIST(peek(1))) {
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GET_INDEX): {
+      if (IS_LIST(PEEK(1))) {
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("index must be a number.");
         }
-        int index = (int)AS_NUMBER(pop());
-        ObjList* list = AS_LIST(pop());
+        int index = (int)AS_NUMBER(PEEK(0));
+        ObjList* list = AS_LIST(PEEK(1));
         if (index < 0 || index >= list->array.count) {
-          runtimeError("index out of range.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("index out of range.");
         }
-        push(list->array.values[index]);
-      } else if (IS_MAP(peek(1))) {
-        if (!IS_STRING(peek(0))) {
-          runtimeError("map can only be indexed by string.");
-          return INTERPRET_RUNTIME_ERROR;
+        stackTop -= 2;
+        PUSH(list->array.values[index]);
+      } else if (IS_MAP(PEEK(1))) {
+        if (!IS_STRING(PEEK(0))) {
+          RUNTIME_ERROR("map can only be indexed by string.");
         }
-        ObjString* key = AS_STRING(peek(0));
-        ObjMap* map = AS_MAP(peek(1));
+        ObjString* key = AS_STRING(PEEK(0));
+        ObjMap* map = AS_MAP(PEEK(1));
         Value value;
         if (tableGet(&map->table, key, &value)) {
-          pop(); // key
-          pop(); // map
-          push(value);
+          stackTop -= 2; // key and map
+          PUSH(value);
         } else {
-          runtimeError("undefined key '%s'", key->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("undefined key '%s'", key->chars);
         }
-      } else if (IS_STRING(peek(1))) {
-        ObjString* s = AS_STRING(peek(1));
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+      } else if (IS_STRING(PEEK(1))) {
+        ObjString* s = AS_STRING(PEEK(1));
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("index must be a number.");
         }
-        int index = (int)AS_NUMBER(pop()); // index
+        int index = (int)AS_NUMBER(PEEK(0));
         if (index < 0 || index >= s->length) {
-          runtimeError("index out of range.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("index out of range.");
         }
         char c = s->chars[index];
-        pop(); // string
-        push(NUMBER_VAL((double)c));
+        stackTop -= 2; // index and string
+        PUSH(NUMBER_VAL((double)c));
       } else {
-        runtimeError("can only subscript list, string or index map.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("can only subscript list, string or index map.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_SET_INDEX: { 
-      Value value = pop();
-      if (IS_LIST(peek(1))) {
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("index must be a number.");
-          return INTERPRET_RUNTIME_ERROR; 
+    CASE(OP_SET_INDEX): {
+      // the value stays on the stack until it is stored, so that a
+      // collection triggered by the map write can still see it.
+      Value value = PEEK(0);
+      if (IS_LIST(PEEK(2))) {
+        if (!IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("index must be a number.");
         }
-        int index = (int) AS_NUMBER(pop());
-        ObjList* list = AS_LIST(peek(0));
+        int index = (int)AS_NUMBER(PEEK(1));
+        ObjList* list = AS_LIST(PEEK(2));
         if (index < 0 || index >= list->array.count) {
-          runtimeError("index out of range.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("index out of range.");
         }
-        list->array.values[index] = value; 
-      } else if (IS_MAP(peek(1))) {
-        if (!IS_STRING(peek(0))) {
-          runtimeError("map can only be indexed by string.");
-          return INTERPRET_RUNTIME_ERROR;
+        list->array.values[index] = value;
+        writeBarrier((Obj*)list, value);
+      } else if (IS_MAP(PEEK(2))) {
+        if (!IS_STRING(PEEK(1))) {
+          RUNTIME_ERROR("map can only be indexed by string.");
         }
-        ObjString* key = AS_STRING(peek(0));
-        ObjMap* map = AS_MAP(peek(1));
+        ObjString* key = AS_STRING(PEEK(1));
+        ObjMap* map = AS_MAP(PEEK(2));
+        STORE_FRAME();
         tableSet(&map->table, key, value);
-        pop(); // key
+        tableBarrier((Obj*)map, key, value);
       } else {
-        runtimeError("can only set subscript of list or index of map.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("can only set subscript of list or index of map.");
       }
-      break;
+      stackTop -= 2; // value and index
+      DISPATCH();
     }
-    case OP_SHIFT_INDEX: {
-      Value value = pop();
-      if (!IS_LIST(peek(0))) {
-        runtimeError("can only push value to list.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SHIFT_INDEX): {
+      Value value = PEEK(0);
+      if (!IS_LIST(PEEK(1))) {
+        RUNTIME_ERROR("can only push value to list.");
       }
 
-      ObjList* list = AS_LIST(peek(0)); 
+      ObjList* list = AS_LIST(PEEK(1));
+      STORE_FRAME();
       writeValueArray(&list->array, value);
-      break;
+      writeBarrier((Obj*)list, value);
+      DROP();
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_GET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
+    CASE(OP_SET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+      *frame->closure->upvalues[slot]->location = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_PROPERTY: {
-      Value receiver = peek(0);
-      ObjString* name = READ_STRING();
-      ObjClass* klass;
-
-      if (IS_LIST(receiver)) {
-        klass = vm.listClass;
-      } else if (IS_INSTANCE(receiver)) {
-        ObjInstance* instance = AS_INSTANCE(receiver);
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop(); // instance
-          push(value);
-          break;
-        }
-        klass = instance->klass;
-      } else {
-        runtimeError("only lists and instances have properties.");
-        return INTERPRET_RUNTIME_ERROR; 
+    CASE(OP_GET_PROPERTY_LONG):
+    CASE(OP_GET_PROPERTY): {
+      Value receiver = PEEK(0);
+      ObjString* name = READ_LONG_STRING(OP_GET_PROPERTY_LONG);
+      InlineCache* cache = READ_CACHE();
+      ICEntry* entry = findCacheEntry(cache, cacheKey(receiver));
+
+      STORE_FRAME();
+      if (entry == NULL) {
+        if (!getProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+        stackTop = vm.stackTop;
+        DISPATCH();
       }
 
-      if (!bindMethod(klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      CACHE_STAT(cacheHits);
+      if (entry->index >= 0) {
+        stackTop[-1] = AS_INSTANCE(receiver)->fields[entry->index];
+      } else {
+        ObjBoundMethod* bound = newBoundMethod(receiver,
+          AS_OBJ(entry->value));
+        stackTop[-1] = OBJ_VAL(bound);
       }
-      break;
+      DISPATCH();
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_PROPERTY_LONG):
+    CASE(OP_SET_PROPERTY): {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("only instances have fields.");
       }
 
-      ObjInstance* instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
+      ObjInstance* instance = AS_INSTANCE(PEEK(1));
+      ObjString* name = READ_LONG_STRING(OP_SET_PROPERTY_LONG);
+      InlineCache* cache = READ_CACHE();
+      ICEntry* entry = findCacheEntry(cache, (Obj*)instance->shape);
+
+      if (entry != NULL && IS_NIL(entry->value)) {
+        CACHE_STAT(cacheHits);
+        instance->fields[entry->index] = PEEK(0);
+        writeBarrier((Obj*)instance, PEEK(0));
+      } else if (entry != NULL) {
+        CACHE_STAT(cacheHits);
+        STORE_FRAME();
+        addField(instance, AS_SHAPE(entry->value), PEEK(0));
+      } else {
+        STORE_FRAME();
+        setProperty(name, cache);
+      }
 
-      Value value = pop();
-      pop();
-      push(value); //这里将属性的赋值当作为一个表达式处理
-      break;
+      Value value = POP();
+      stackTop[-1] = value; //这里将属性的赋值当作为一个表达式处理
+      DISPATCH();
     }
-    case OP_GET_SUPER: {
-      ObjString* name = READ_STRING();
-      ObjClass* superclass = AS_CLASS(pop());
+    CASE(OP_GET_SUPER_LONG):
+    CASE(OP_GET_SUPER): {
+      ObjString* name = READ_LONG_STRING(OP_GET_SUPER_LONG);
+      if (!IS_CLASS(PEEK(0))) {
+        RUNTIME_ERROR("superclass must be a class.");
+      }
+      ObjClass* superclass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!bindMethod(superclass, name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      stackTop = vm.stackTop;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    CASE(OP_EQUAL): {
+      if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_EQUAL_NUM);
+      }
+      Value b = POP();
+      Value a = PEEK(0);
+      stackTop[-1] = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
     }
-    case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-    case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-    case OP_INC: {
-      if (IS_NUMBER(peek(0))) {
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + 1));
-      } else {
-        runtimeError("can only increment numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+    CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+    CASE(OP_INC): {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("can only increment numbers.");
       }
-      break;
+      stackTop[-1] = NUMBER_VAL(AS_NUMBER(PEEK(0)) + 1);
+      DISPATCH();
     }
-    case OP_DEC: {
-      if (IS_NUMBER(peek(0))) {
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a -1));
-      } else {
-        runtimeError("can only decreament numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_DEC): {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("can only decreament numbers.");
       }
-      break;
+      stackTop[-1] = NUMBER_VAL(AS_NUMBER(PEEK(0)) - 1);
+      DISPATCH();
     }
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    CASE(OP_ADD): {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        QUICKEN(OP_ADD_STR);
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double a = AS_NUMBER(pop());
-        double b = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        stackTop = vm.stackTop;
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_ADD_NUM);
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(PEEK(0));
+        stackTop[-1] = NUMBER_VAL(a + b);
       } else {
-        runtimeError("operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("operands must be two numbers or two strings.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-    case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-    case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-    case OP_NOT: {
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
+    CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+    CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+    CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+    CASE(OP_NOT): {
+      stackTop[-1] = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
     }
-    case OP_NEGATE: {
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_NEGATE): {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("operand must be a number.");
       }
-      
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
+
+      stackTop[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
     }
-    case OP_PRINT: {
-      printValue(pop());
+    CASE(OP_PRINT): {
+      printValue(POP());
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_JUMP: { 
+    CASE(OP_JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
+    CASE(OP_JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0))) frame->ip += offset;
-      break;
+      if (isFalsey(PEEK(0))) ip += offset;
+      DISPATCH();
     }
-    case OP_LOOP: {
+    CASE(OP_LOOP): {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+      ENTER_TRACE();
+      ENTER_COMPILED();
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(OP_CALL): {
       int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) { 
+      STORE_FRAME();
+      if (!callValue(PEEK(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       //函数当前调用的栈帧一定是frameCount-1位置
-      frame = &vm.frames[vm.frameCount-1];
-      break;
+      LOAD_FRAME();
+      ENTER_COMPILED();
+      DISPATCH();
     }
-    case OP_INVOKE: {
-      ObjString* method = READ_STRING();
+    CASE(OP_TAIL_CALL): {
       int argCount = READ_BYTE();
-      if (!invoke(method, argCount)) {
+      STORE_FRAME();
+      if (!tailCall(argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_COMPILED();
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE: {
-      ObjString* method = READ_STRING();
+    CASE(OP_INVOKE_LONG):
+    CASE(OP_INVOKE): {
+      ObjString* name = READ_LONG_STRING(OP_INVOKE_LONG);
       int argCount = READ_BYTE();
-      ObjClass* superclass = AS_CLASS(pop());
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invokeCached(name, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      ENTER_COMPILED();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE_LONG):
+    CASE(OP_SUPER_INVOKE): {
+      ObjString* method = READ_LONG_STRING(OP_SUPER_INVOKE_LONG);
+      int argCount = READ_BYTE();
+      if (!IS_CLASS(PEEK(0))) {
+        RUNTIME_ERROR("superclass must be a class.");
+      }
+      ObjClass* superclass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!invokeFromClass(superclass, method, argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_COMPILED();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
-      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+    CASE(OP_CLOSURE_LONG):
+    CASE(OP_CLOSURE): {
+      ObjFunction* function =
+        AS_FUNCTION(constants[READ_OPERAND(OP_CLOSURE_LONG)]);
+      STORE_FRAME();
       ObjClosure* closure = newClosure(function);
-      push(OBJ_VAL(closure));
+      PUSH(OBJ_VAL(closure));
+      // capturing allocates upvalues, keep the closure visible to the gc
+      vm.stackTop = stackTop;
       for (int i =0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
         if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
+          closure->upvalues[i] = captureUpvalue(slots + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        // capturing may have promoted the closure
+        objectBarrier((Obj*)closure, (Obj*)closure->upvalues[i]);
       }
-      break;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
-    case OP_RETURN: {
-      Value result = pop();
-      closeUpvalues(frame->slots);
+    CASE(OP_CLOSE_UPVALUE):
+      closeUpvalues(stackTop - 1);
+      DROP();
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = POP();
+      closeUpvalues(slots);
       vm.frameCount--;
       if (vm.frameCount == 0) {
-        pop();
+        vm.stackTop = slots; // the script closure
         return INTERPRET_OK;
       }
 
-      vm.stackTop = frame->slots;
-      push(result);
+      slots[0] = result;
+      vm.stackTop = slots + 1;
+      if (vm.frameCount == baseFrame) {
+        return INTERPRET_OK; // back to the native caller
+      }
 
-      frame = &vm.frames[vm.frameCount-1];
-      break;
+      LOAD_FRAME();
+      ENTER_COMPILED();
+      DISPATCH();
     }
-    case OP_INHERIT: {
-      Value superclass = peek(1);
+    CASE(OP_INHERIT): {
+      Value superclass = PEEK(1);
       if (!IS_CLASS(superclass)) {
-        runtimeError("superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("superclass must be a class.");
       }
 
-      ObjClass* subclass = AS_CLASS(peek(0));
+      if (!IS_CLASS(PEEK(0))) {
+        RUNTIME_ERROR("can only inherit into a class.");
+      }
+      ObjClass* subclass = AS_CLASS(PEEK(0));
+      STORE_FRAME();
       tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-      pop(); // sub class
-      break;
+      rememberObject((Obj*)subclass);
+      DROP(); // sub class
+      DISPATCH();
     }
-    case OP_CLASS:
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    case OP_METHOD:
-      defineMethod(READ_STRING());
-      break;
-    default: break;
+    CASE(OP_CLASS_LONG):
+    CASE(OP_CLASS): {
+      ObjString* name = READ_LONG_STRING(OP_CLASS_LONG);
+      STORE_FRAME();
+      ObjClass* klass = newClass(name);
+      PUSH(OBJ_VAL(klass));
+      DISPATCH();
+    }
+    CASE(OP_METHOD_LONG):
+    CASE(OP_METHOD): {
+      ObjString* name = READ_LONG_STRING(OP_METHOD_LONG);
+      if (!IS_CLASS(PEEK(1))) {
+        RUNTIME_ERROR("methods can only be defined on classes.");
+      }
+      STORE_FRAME();
+      defineMethod(name);
+      stackTop = vm.stackTop;
+      DISPATCH();
+    }
+    CASE(OP_FOR_PREP): {
+      Value i = slots[READ_BYTE()];
+      Value limit = slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(i) || !IS_NUMBER(limit)) {
+        RUNTIME_ERROR("operands must be numbers.");
+      }
+      if (!(AS_NUMBER(i) < AS_NUMBER(limit))) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_FOR_LOOP): {
+      Value* i = &slots[READ_BYTE()];
+      Value limit = slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(*i)) {
+        RUNTIME_ERROR("can only increment numbers.");
+      }
+      *i = NUMBER_VAL(AS_NUMBER(*i) + 1);
+      if (!IS_NUMBER(limit)) {
+        RUNTIME_ERROR("operands must be numbers.");
+      }
+      if (AS_NUMBER(*i) < AS_NUMBER(limit)) {
+        ip -= offset;
+        ENTER_TRACE();
+        ENTER_COMPILED();
+      }
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCALS): {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        PUSH(a);
+        PUSH(b);
+        STORE_FRAME();
+        concatenate();
+        stackTop = vm.stackTop;
+      } else {
+        RUNTIME_ERROR("operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCAL_CONST_JUMP): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("operands must be numbers.");
+      }
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_INC_LOCAL): {
+      Value* slot = &slots[READ_BYTE()];
+      if (!IS_NUMBER(*slot)) {
+        RUNTIME_ERROR("can only increment numbers.");
+      }
+      *slot = NUMBER_VAL(AS_NUMBER(*slot) + 1);
+      DISPATCH();
+    }
+    CASE(OP_DEC_LOCAL): {
+      Value* slot = &slots[READ_BYTE()];
+      if (!IS_NUMBER(*slot)) {
+        RUNTIME_ERROR("can only decreament numbers.");
+      }
+      *slot = NUMBER_VAL(AS_NUMBER(*slot) - 1);
+      DISPATCH();
     }
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_POPN): {
+      stackTop -= READ_BYTE();
+      DISPATCH();
+    }
+    CASE(OP_NOT_EQUAL): {
+      Value b = POP();
+      Value a = PEEK(0);
+      stackTop[-1] = BOOL_VAL(!valuesEqual(a, b));
+      DISPATCH();
+    }
+    // the negated comparisons they replace, so NaN compares true
+    CASE(OP_LESS_EQUAL):    NEGATED_OP(>); DISPATCH();
+    CASE(OP_GREATER_EQUAL): NEGATED_OP(<); DISPATCH();
+    CASE(OP_POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(POP())) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM):      BINARY_NUM_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+    CASE(OP_ADD_STR): {
+      if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      STORE_FRAME();
+      concatenate();
+      stackTop = vm.stackTop;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_NUM): BINARY_NUM_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+    CASE(OP_MULTIPLY_NUM): BINARY_NUM_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+    CASE(OP_DIVIDE_NUM):   BINARY_NUM_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+    CASE(OP_EQUAL_NUM):    BINARY_NUM_OP(BOOL_VAL, ==, OP_EQUAL); DISPATCH();
+    CASE(OP_GREATER_NUM):  BINARY_NUM_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+    CASE(OP_LESS_NUM):     BINARY_NUM_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+#ifndef COMPUTED_GOTO
+    default: DISPATCH();
+#endif
   }
 
+  return INTERPRET_RUNTIME_ERROR; // unreachable.
+
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_OPERAND
+#undef READ_LONG_STRING
+#undef READ_CACHE
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef QUICKEN_STAT
 #undef BINARY_OP
+#undef BINARY_NUM_OP
+#undef NEGATED_OP
+#undef TRACE_INSTRUCTION
+#undef ENTER_COMPILED
+#undef ENTER_TRACE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
-  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+// the loop for register code, see regcode.h. takes the top frame over
+// at the instruction its ip maps to and keeps going through calls to
+// and returns into functions that have register code, everything else
+// is left to run().
+int runRegisters(CallFrame* frame) {
+  // the frame run() handed over, frames above it were called from here
+  int entryCount = vm.frameCount;
+  ObjFunction* function;
+  RegCode* rc;
+  Value* regs;
+  Value* constants;
+  uint32_t* pc;
+  uint32_t word;
+
+#define LOAD_FRAME() do { \
+  function = frame->closure->function; \
+  rc = function->registers; \
+  regs = frame->slots; \
+  constants = function->chunk.constants.values; \
+} while (false)
+
+#define R(index)        (regs[index])
+#define SITE()          (&rc->sites[pc - rc->code - 1])
+#define SYNC_IP(site)   (frame->ip = function->chunk.code + (site)->offset)
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define READ_CACHE(data) (&function->chunk.caches[(data) >> 8])
+#define READ_NAME(data) AS_STRING(constants[(data) & 0xff])
+
+#define REG_ERROR(...) do { \
+  SYNC_IP(SITE()); \
+  runtimeError(__VA_ARGS__); \
+  return CODE_ERROR; \
+} while (false)
+
+#define NUMBER_OP(valueType, op, right) do { \
+  Value b = R(REG_B(word)); \
+  Value c = (right); \
+  if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+    REG_ERROR("operands must be numbers."); \
+  } \
+  R(REG_A(word)) = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
+} while (false)
+
+#define EQUAL_OP(right) do { \
+  Value b = R(REG_B(word)); \
+  Value c = (right); \
+  R(REG_A(word)) = BOOL_VAL(IS_NUMBER(b) && IS_NUMBER(c) \
+    ? AS_NUMBER(b) == AS_NUMBER(c) : valuesEqual(b, c)); \
+} while (false)
+
+// strings are concatenated on the stack, at the slots the operands
+// had there.
+#define ADD_OP(right) do { \
+  Value b = R(REG_B(word)); \
+  Value c = (right); \
+  if (IS_NUMBER(b) && IS_NUMBER(c)) { \
+    R(REG_A(word)) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c)); \
+  } else if (IS_STRING(b) && IS_STRING(c)) { \
+    Value* base = regs + SITE()->base; \
+    base[0] = b; \
+    base[1] = c; \
+    vm.stackTop = base + 2; \
+    concatenate(); \
+    R(REG_A(word)) = base[0]; \
+  } else { \
+    REG_ERROR("operands must be two numbers or two strings."); \
+  } \
+} while (false)
+
+// after a call: a native left its result in the callee's register, a
+// new frame either has register code or goes to the interpreter.
+#define ENTER_CALLEE(frameCount) do { \
+  if (vm.frameCount != (frameCount)) { \
+    frame = &vm.frames[vm.frameCount - 1]; \
+    if (frame->closure->function->registers == NULL) return CODE_EXIT; \
+    LOAD_FRAME(); \
+    pc = rc->code; \
+  } \
+} while (false)
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [R_MOVE]          = &&L_R_MOVE,
+    [R_LOADK]         = &&L_R_LOADK,
+    [R_NIL]           = &&L_R_NIL,
+    [R_TRUE]          = &&L_R_TRUE,
+    [R_FALSE]         = &&L_R_FALSE,
+    [R_GET_GLOBAL]    = &&L_R_GET_GLOBAL,
+    [R_SET_GLOBAL]    = &&L_R_SET_GLOBAL,
+    [R_DEFINE_GLOBAL] = &&L_R_DEFINE_GLOBAL,
+    [R_GET_UPVALUE]   = &&L_R_GET_UPVALUE,
+    [R_SET_UPVALUE]   = &&L_R_SET_UPVALUE,
+    [R_GET_PROPERTY]  = &&L_R_GET_PROPERTY,
+    [R_SET_PROPERTY]  = &&L_R_SET_PROPERTY,
+    [R_GET_INDEX]     = &&L_R_GET_INDEX,
+    [R_SET_INDEX]     = &&L_R_SET_INDEX,
+    [R_ADD]           = &&L_R_ADD,
+    [R_SUBTRACT]      = &&L_R_SUBTRACT,
+    [R_MULTIPLY]      = &&L_R_MULTIPLY,
+    [R_DIVIDE]        = &&L_R_DIVIDE,
+    [R_EQUAL]         = &&L_R_EQUAL,
+    [R_GREATER]       = &&L_R_GREATER,
+    [R_LESS]          = &&L_R_LESS,
+    [R_ADD_K]         = &&L_R_ADD_K,
+    [R_SUBTRACT_K]    = &&L_R_SUBTRACT_K,
+    [R_MULTIPLY_K]    = &&L_R_MULTIPLY_K,
+    [R_DIVIDE_K]      = &&L_R_DIVIDE_K,
+    [R_EQUAL_K]       = &&L_R_EQUAL_K,
+    [R_GREATER_K]     = &&L_R_GREATER_K,
+    [R_LESS_K]        = &&L_R_LESS_K,
+    [R_INC]           = &&L_R_INC,
+    [R_DEC]           = &&L_R_DEC,
+    [R_NOT]           = &&L_R_NOT,
+    [R_NEGATE]        = &&L_R_NEGATE,
+    [R_PRINT]         = &&L_R_PRINT,
+    [R_JUMP]          = &&L_R_JUMP,
+    [R_JUMP_IF_FALSE] = &&L_R_JUMP_IF_FALSE,
+    [R_CALL]          = &&L_R_CALL,
+    [R_INVOKE]        = &&L_R_INVOKE,
+    [R_RETURN]        = &&L_R_RETURN,
+    [R_EXIT]          = &&L_R_EXIT,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op)       L_##op
+#define DISPATCH()     do { \
+  COUNT_INSTRUCTION(); \
+  word = *pc++; \
+  goto *dispatchTable[REG_OP(word)]; \
+} while (false)
+#else
+#define INTERPRET_LOOP loop: COUNT_INSTRUCTION(); word = *pc++; \
+  switch (REG_OP(word))
+#define CASE(op)       case op
+#define DISPATCH()     goto loop
+#endif
+
+  LOAD_FRAME();
+  int entry = rc->entries[frame->ip - function->chunk.code];
+  if (entry < 0) return CODE_EXIT;
+  pc = rc->code + entry;
+
+  INTERPRET_LOOP {
+    CASE(R_MOVE):  R(REG_A(word)) = R(REG_B(word)); DISPATCH();
+    CASE(R_LOADK): R(REG_A(word)) = constants[REG_BX(word)]; DISPATCH();
+    CASE(R_NIL):   R(REG_A(word)) = NIL_VAL; DISPATCH();
+    CASE(R_TRUE):  R(REG_A(word)) = BOOL_VAL(true); DISPATCH();
+    CASE(R_FALSE): R(REG_A(word)) = BOOL_VAL(false); DISPATCH();
+    CASE(R_GET_GLOBAL): {
+      Value value = vm.globalValues.values[REG_BX(word)];
+      if (IS_UNDEFINED(value)) {
+        REG_ERROR("undefined variable '%s'.", GLOBAL_NAME(REG_BX(word)));
+      }
+      R(REG_A(word)) = value;
+      DISPATCH();
+    }
+    CASE(R_SET_GLOBAL): {
+      Value* global = &vm.globalValues.values[REG_BX(word)];
+      if (IS_UNDEFINED(*global)) {
+        REG_ERROR("undefined variable '%s'.", GLOBAL_NAME(REG_BX(word)));
+      }
+      *global = R(REG_A(word));
+      DISPATCH();
+    }
+    CASE(R_DEFINE_GLOBAL):
+      vm.globalValues.values[REG_BX(word)] = R(REG_A(word));
+      DISPATCH();
+    CASE(R_GET_UPVALUE):
+      R(REG_A(word)) = *frame->closure->upvalues[REG_B(word)]->location;
+      DISPATCH();
+    CASE(R_SET_UPVALUE):
+      *frame->closure->upvalues[REG_B(word)]->location = R(REG_A(word));
+      DISPATCH();
+    CASE(R_GET_PROPERTY): {
+      RegSite* site = SITE();
+      uint32_t data = *pc++;
+      Value receiver = R(REG_B(word));
+      InlineCache* cache = READ_CACHE(data);
+      ICEntry* entry = findCacheEntry(cache, cacheKey(receiver));
+      if (entry != NULL && entry->index >= 0) {
+        CACHE_STAT(cacheHits);
+        R(REG_A(word)) = AS_INSTANCE(receiver)->fields[entry->index];
+        DISPATCH();
+      }
+
+      Value* base = regs + site->base;
+      base[0] = receiver;
+      vm.stackTop = base + 1;
+      SYNC_IP(site);
+      if (!vmGetProperty(READ_NAME(data), cache)) return CODE_ERROR;
+      R(REG_A(word)) = base[0];
+      DISPATCH();
+    }
+    CASE(R_SET_PROPERTY): {
+      RegSite* site = SITE();
+      uint32_t data = *pc++;
+      Value target = R(REG_B(word));
+      Value value = R(REG_C(word));
+      InlineCache* cache = READ_CACHE(data);
+      if (IS_INSTANCE(target)) {
+        ObjInstance* instance = AS_INSTANCE(target);
+        ICEntry* entry = findCacheEntry(cache, (Obj*)instance->shape);
+        if (entry != NULL && IS_NIL(entry->value)) {
+          CACHE_STAT(cacheHits);
+          instance->fields[entry->index] = value;
+          writeBarrier((Obj*)instance, value);
+          R(REG_A(word)) = value;
+          DISPATCH();
+        }
+      }
 
+      Value* base = regs + site->base;
+      base[0] = target;
+      base[1] = value;
+      vm.stackTop = base + 2;
+      SYNC_IP(site);
+      if (!vmSetProperty(READ_NAME(data), cache)) return CODE_ERROR;
+      R(REG_A(word)) = base[0];
+      DISPATCH();
+    }
+    CASE(R_GET_INDEX): {
+      Value target = R(REG_B(word));
+      Value index = R(REG_C(word));
+      if (IS_LIST(target)) {
+        if (!IS_NUMBER(index)) REG_ERROR("index must be a number.");
+        int i = (int)AS_NUMBER(index);
+        ObjList* list = AS_LIST(target);
+        if (i < 0 || i >= list->array.count) {
+          REG_ERROR("index out of range.");
+        }
+        R(REG_A(word)) = list->array.values[i];
+      } else if (IS_MAP(target)) {
+        if (!IS_STRING(index)) {
+          REG_ERROR("map can only be indexed by string.");
+        }
+        Value value;
+        if (!tableGet(&AS_MAP(target)->table, AS_STRING(index), &value)) {
+          REG_ERROR("undefined key '%s'", AS_CSTRING(index));
+        }
+        R(REG_A(word)) = value;
+      } else if (IS_STRING(target)) {
+        ObjString* s = AS_STRING(target);
+        if (!IS_NUMBER(index)) REG_ERROR("index must be a number.");
+        int i = (int)AS_NUMBER(index);
+        if (i < 0 || i >= s->length) REG_ERROR("index out of range.");
+        R(REG_A(word)) = NUMBER_VAL((double)s->chars[i]);
+      } else {
+        REG_ERROR("can only subscript list, string or index map.");
+      }
+      DISPATCH();
+    }
+    CASE(R_SET_INDEX): {
+      Value target = R(REG_A(word));
+      Value index = R(REG_B(word));
+      Value value = R(REG_C(word));
+      if (IS_LIST(target)) {
+        if (!IS_NUMBER(index)) REG_ERROR("index must be a number.");
+        int i = (int)AS_NUMBER(index);
+        ObjList* list = AS_LIST(target);
+        if (i < 0 || i >= list->array.count) {
+          REG_ERROR("index out of range.");
+        }
+        list->array.values[i] = value;
+        writeBarrier((Obj*)list, value);
+      } else if (IS_MAP(target)) {
+        if (!IS_STRING(index)) {
+          REG_ERROR("map can only be indexed by string.");
+        }
+        Value* base = regs + SITE()->base;
+        base[0] = target;
+        base[1] = index;
+        base[2] = value;
+        vm.stackTop = base + 3;
+        tableSet(&AS_MAP(target)->table, AS_STRING(index), value);
+        tableBarrier(AS_OBJ(target), AS_STRING(index), value);
+      } else {
+        REG_ERROR("can only set subscript of list or index of map.");
+      }
+      DISPATCH();
+    }
+    CASE(R_ADD):        ADD_OP(R(REG_C(word))); DISPATCH();
+    CASE(R_SUBTRACT):   NUMBER_OP(NUMBER_VAL, -, R(REG_C(word))); DISPATCH();
+    CASE(R_MULTIPLY):   NUMBER_OP(NUMBER_VAL, *, R(REG_C(word))); DISPATCH();
+    CASE(R_DIVIDE):     NUMBER_OP(NUMBER_VAL, /, R(REG_C(word))); DISPATCH();
+    CASE(R_GREATER):    NUMBER_OP(BOOL_VAL, >, R(REG_C(word))); DISPATCH();
+    CASE(R_LESS):       NUMBER_OP(BOOL_VAL, <, R(REG_C(word))); DISPATCH();
+    CASE(R_EQUAL):      EQUAL_OP(R(REG_C(word))); DISPATCH();
+    CASE(R_ADD_K):      ADD_OP(constants[REG_C(word)]); DISPATCH();
+    CASE(R_SUBTRACT_K): NUMBER_OP(NUMBER_VAL, -, constants[REG_C(word)]); DISPATCH();
+    CASE(R_MULTIPLY_K): NUMBER_OP(NUMBER_VAL, *, constants[REG_C(word)]); DISPATCH();
+    CASE(R_DIVIDE_K):   NUMBER_OP(NUMBER_VAL, /, constants[REG_C(word)]); DISPATCH();
+    CASE(R_GREATER_K):  NUMBER_OP(BOOL_VAL, >, constants[REG_C(word)]); DISPATCH();
+    CASE(R_LESS_K):     NUMBER_OP(BOOL_VAL, <, constants[REG_C(word)]); DISPATCH();
+    CASE(R_EQUAL_K):    EQUAL_OP(constants[REG_C(word)]); DISPATCH();
+    CASE(R_INC): {
+      Value value = R(REG_B(word));
+      if (!IS_NUMBER(value)) REG_ERROR("can only increment numbers.");
+      R(REG_A(word)) = NUMBER_VAL(AS_NUMBER(value) + 1);
+      DISPATCH();
+    }
+    CASE(R_DEC): {
+      Value value = R(REG_B(word));
+      if (!IS_NUMBER(value)) REG_ERROR("can only decreament numbers.");
+      R(REG_A(word)) = NUMBER_VAL(AS_NUMBER(value) - 1);
+      DISPATCH();
+    }
+    CASE(R_NOT):
+      R(REG_A(word)) = BOOL_VAL(isFalsey(R(REG_B(word))));
+      DISPATCH();
+    CASE(R_NEGATE): {
+      Value value = R(REG_B(word));
+      if (!IS_NUMBER(value)) REG_ERROR("operand must be a number.");
+      R(REG_A(word)) = NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(R_PRINT):
+      vmPrint(R(REG_A(word)));
+      DISPATCH();
+    CASE(R_JUMP):
+      pc = rc->code + REG_BX(word);
+      DISPATCH();
+    CASE(R_JUMP_IF_FALSE):
+      if (isFalsey(R(REG_A(word)))) pc = rc->code + REG_BX(word);
+      DISPATCH();
+    CASE(R_CALL): {
+      int argCount = REG_B(word);
+      Value* callee = &R(REG_A(word));
+      int frameCount = vm.frameCount;
+      SYNC_IP(SITE());
+      frame->pc = pc;
+      vm.stackTop = callee + argCount + 1;
+      bool ok = IS_CLOSURE(*callee) ? call(AS_CLOSURE(*callee), argCount)
+                                    : callValue(*callee, argCount);
+      if (!ok) return CODE_ERROR;
+      ENTER_CALLEE(frameCount);
+      DISPATCH();
+    }
+    CASE(R_INVOKE): {
+      RegSite* site = SITE();
+      uint32_t data = *pc++;
+      int argCount = REG_B(word);
+      int frameCount = vm.frameCount;
+      SYNC_IP(site);
+      frame->pc = pc;
+      vm.stackTop = &R(REG_A(word)) + argCount + 1;
+      if (!invokeCached(READ_NAME(data), argCount, READ_CACHE(data))) {
+        return CODE_ERROR;
+      }
+      ENTER_CALLEE(frameCount);
+      DISPATCH();
+    }
+    CASE(R_RETURN): {
+      Value result = R(REG_A(word));
+      closeUpvalues(regs);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = regs; // the script closure
+        return CODE_RETURNED;
+      }
+
+      regs[0] = result;
+      vm.stackTop = regs + 1;
+      if (vm.frameCount < entryCount) return CODE_RETURNED;
+
+      frame = &vm.frames[vm.frameCount - 1];
+      LOAD_FRAME();
+      pc = frame->pc;
+      DISPATCH();
+    }
+    CASE(R_EXIT):
+      frame->ip = function->chunk.code + REG_BX(word);
+      vm.stackTop = regs + REG_A(word);
+      return CODE_EXIT;
+#ifndef COMPUTED_GOTO
+    default: DISPATCH();
+#endif
+  }
+
+  return CODE_ERROR; // unreachable.
+
+#undef LOAD_FRAME
+#undef R
+#undef SITE
+#undef SYNC_IP
+#undef GLOBAL_NAME
+#undef READ_CACHE
+#undef READ_NAME
+#undef REG_ERROR
+#undef NUMBER_OP
+#undef EQUAL_OP
+#undef ADD_OP
+#undef ENTER_CALLEE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+// run a compiled script, its functions may have compiled code attached.
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   callValue(OBJ_VAL(closure), 0); //手动调用脚本入口
 
-  return run();
+  if (vm.compiledCode) {
+    switch (enterCompiled(0)) {
+    case CODE_RETURNED: return INTERPRET_OK;
+    case CODE_ERROR:    return INTERPRET_RUNTIME_ERROR;
+    case CODE_EXIT:     break;
+    }
+  }
+  return run(0);
+}
+
+InterpretResult interpret(const char* source) {
+  ObjFunction* function = compile(source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(function);
 }
 
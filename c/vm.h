@@ -4,39 +4,91 @@
 #include "object.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-// 栈的长度=栈帧数*指令上限
-#define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
+// frames and stack start this small and grow on demand, every frame
+// gets its function's frameSize slots of room when it is pushed.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL  (FRAMES_INITIAL * UINT8_COUNT)
+// default for vm.maxFrames, clox --max-frames sets it
+#define FRAMES_MAX 100000
+// calls from compiled code into compiled code, each takes c stack
+#define NATIVE_DEPTH_MAX 1000
 
 // 函数栈帧
-typedef struct {
+typedef struct CallFrame {
   ObjClosure* closure;
   uint8_t* ip;
   // the slots field points into the VM’s value stack 
   // at the first slot that this function can use
   Value* slots;
+  uint32_t* pc; // register code to go on with once a call returns
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
+  int maxFrames; // "stack overflow." past this many
 
-  Value stack[STACK_MAX];
+  // both move when they grow, see call()
+  Value* stack;
   Value* stackTop;
-  Table globals;
+  int stackCapacity;
+  // the compiler gives every global name a slot, the instructions
+  // then index globalValues directly.
+  Table globalSlots;        // name -> slot
+  ValueArray globalValues;  // UNDEFINED_VAL until defined
+  ValueArray globalNames;
   Table strings;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
 
   size_t bytesAllocated;
   size_t nextGC;
+  size_t nurseryBytes; // allocated since the last collection
 
-  Obj* objects;
+  // see memory.h
+  Obj* objects; // the old generation
+  Obj* nursery; // the young one
+  Obj** remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+  // inline caches filled with young keys or values since the last
+  // collection
+  InlineCache** youngCaches;
+  int youngCacheCount;
+  int youngCacheCapacity;
+  bool minorGC; // marking only reaches young objects
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
 
   ObjClass* listClass;
+
+  // instructions run by both loops, only kept with DEBUG_PRINT_STATS
+  size_t instructions;
+
+  // quickening counters, only kept with DEBUG_PRINT_STATS
+  size_t quickened;
+  size_t deoptimized;
+
+  // inline cache counters, only kept with DEBUG_PRINT_STATS
+  size_t cacheHits;
+  size_t cacheMisses;
+  size_t cacheMegamorphic;
+
+  // collector counters
+  size_t minorCollections;
+  size_t fullCollections;
+
+  bool compiledCode; // some functions may have compiled code to run
+  int nativeDepth;
+  bool registers; // clox --reg
+  bool jit; // clox --jit
+  bool lazy; // clox --lazy, see compiler.h
+  size_t jitCompiled;
+  size_t jitTraces;
+  size_t jitTraceAborts;
+  size_t jitBytes;
 } VM;
 
 typedef enum {
@@ -45,12 +97,42 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+// what compiled code, jitted or from clox --emit-c, hands back
+typedef enum {
+  CODE_EXIT,     // the interpreter goes on at frame->ip
+  CODE_ERROR,    // a runtime error was reported
+  CODE_RETURNED, // the frame returned, its result is on the stack
+} CodeStatus;
+
 extern VM vm;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);
+
+// runtime entry points compiled code calls back into. the frame's ip
+// and vm.stackTop have to be stored first.
+bool vmCall(int argCount);
+bool vmInvoke(ObjString* name, int argCount, InlineCache* cache);
+#ifdef JIT
+// the native code to call for a jitted callee, its frame pushed. NULL
+// when vmCall() or vmInvoke() has to do the call.
+uint8_t* vmCallEntry(int argCount);
+uint8_t* vmInvokeEntry(InlineCache* cache, int argCount);
+// what a callee entered that way returned if not CODE_RETURNED, false
+// on an error.
+bool vmFinishJitted(int status);
+#endif
+void vmReturn();
+bool vmGetProperty(ObjString* name, InlineCache* cache);
+bool vmSetProperty(ObjString* name, InlineCache* cache);
+void vmPrint(Value value);
+
+// the CompiledFn of functions with register code
+int runRegisters(CallFrame* frame);
 
 #endif